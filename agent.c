@@ -3,33 +3,426 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 #include "agent.h"
+#include "binary_protocol.h"
+#include "command_parser.h"
+#include "io_ring.h"
 #include "shared_memory.h"
+#include "wal.h"
 #include "data_structures.h"
-#include <ctype.h>
 
+#define BATCH_MAX_OPS 1024
+#define BATCH_LOCK_CHUNK 64 // non atomic batches let other agents in this often
+
+typedef enum
+{
+  BATCH_MOVE,
+  BATCH_DEMAND,
+  BATCH_SUPPLY,
+  BATCH_WATCH,
+  BATCH_UNWATCH,
+  BATCH_INVALID
+} batch_op_type_t;
+
+typedef struct
+{
+  batch_op_type_t type;
+  int args[4];
+  const char *error; // reply for BATCH_INVALID
+} batch_op_t;
+
+// Commands collected between begin and commit
+typedef struct
+{
+  int atomic;
+  int count;
+  int overflow;
+  batch_op_t ops[BATCH_MAX_OPS];
+} batch_t;
+
+#define OUTPUT_BUFFER_SIZE 4096
+
+// Replies and notifications of one connection. While the command thread works
+// through the lines of one read, everything is queued here and goes out with
+// a single writev, so a notification never overtakes an earlier reply.
 typedef struct
+{
+  pthread_mutex_t mutex;
+  int fd;
+  int queueing;
+  int binary; // frames of binary_protocol.h instead of text, for good once set
+  io_ring_t *ring; // sends go through the agent's io_uring, NULL for writev
+  size_t used;
+  char data[OUTPUT_BUFFER_SIZE];
+} conn_output_t;
+
+#define READ_BUFFER_SIZE 1024
+
+struct agent_args
 {
   int client_fd;
   int agent_id;
-} agent_args_t;
+  int closed;  // quit was handled or the client broke the framing
+  int wake_fd; // notification wakeup socket when polled, -1 otherwise
+  batch_t *batch; // open begin...commit block, NULL outside of one
+  conn_output_t *out;
+  int frame_op;      // op of the binary request being answered
+  size_t buffer_len; // bytes of a partial command at the start of buffer
+  char buffer[READ_BUFFER_SIZE];
+};
+
+#define URING_EVENTS 32
+#define URING_CLIENT 0
+#define URING_WAKEUP 1
+
+static int pipelined_replies = 1;
+static agent_loop_t agent_loop = AGENT_LOOP_THREADS;
+static const char *snapshot_dir = NULL;
+
+void set_pipelined_replies(int enabled)
+{
+  pipelined_replies = enabled;
+}
+
+void set_agent_loop(agent_loop_t loop)
+{
+  agent_loop = loop;
+}
+
+void set_snapshot_dir(const char *dir)
+{
+  snapshot_dir = dir;
+}
+
+// Writes the queued bytes followed by extra, caller holds out->mutex. A reply
+// only leaves once the changes it reports are in the write-ahead log. When
+// they never will be, the connection is shut down instead, the client must
+// not take them as done.
+static void write_output(conn_output_t *out, const char *extra, size_t extra_len)
+{
+  if (wal_sync() == -1)
+  {
+    out->used = 0;
+    shutdown(out->fd, SHUT_RDWR);
+    return;
+  }
+  struct iovec iov[2];
+  int count = 0;
+  if (out->used > 0)
+  {
+    iov[count].iov_base = out->data;
+    iov[count].iov_len = out->used;
+    count++;
+  }
+  if (extra_len > 0)
+  {
+    iov[count].iov_base = (void *)extra;
+    iov[count].iov_len = extra_len;
+    count++;
+  }
+  out->used = 0;
+
+  if (out->ring != NULL)
+  {
+    // Goes out with the next submission of the agent's loop
+    for (int i = 0; i < count; i++)
+    {
+      io_ring_write(out->ring, iov[i].iov_base, iov[i].iov_len);
+    }
+    return;
+  }
+
+  struct iovec *next = iov;
+  while (count > 0)
+  {
+    ssize_t written = writev(out->fd, next, count);
+    if (written <= 0)
+      return; // the client is gone, the agent notices on its next read
+    while (count > 0 && (size_t)written >= next->iov_len)
+    {
+      written -= next->iov_len;
+      next++;
+      count--;
+    }
+    if (count > 0)
+    {
+      next->iov_base = (char *)next->iov_base + written;
+      next->iov_len -= written;
+    }
+  }
+}
+
+// Caller holds out->mutex
+static void queue_locked(conn_output_t *out, const char *data, size_t len)
+{
+  if (!out->queueing || len > sizeof(out->data) - out->used)
+  {
+    write_output(out, data, len);
+  }
+  else
+  {
+    memcpy(out->data + out->used, data, len);
+    out->used += len;
+  }
+}
+
+static void queue_output(conn_output_t *out, const char *data, size_t len)
+{
+  pthread_mutex_lock(&out->mutex);
+  queue_locked(out, data, len);
+  pthread_mutex_unlock(&out->mutex);
+}
+
+// Header and payload are queued together, a notification never lands in
+// between. Caller holds out->mutex.
+static void queue_frame_locked(conn_output_t *out, int op, int flags, const void *payload, size_t len)
+{
+  bin_header_t header = {.length = sizeof(header) + len, .op = op, .flags = flags};
+  if (sizeof(header) > sizeof(out->data) - out->used)
+    write_output(out, NULL, 0);
+  memcpy(out->data + out->used, &header, sizeof(header));
+  out->used += sizeof(header);
+  queue_locked(out, payload, len);
+}
+
+static void begin_replies(conn_output_t *out)
+{
+  pthread_mutex_lock(&out->mutex);
+  out->queueing = pipelined_replies;
+  pthread_mutex_unlock(&out->mutex);
+}
+
+static void flush_replies(conn_output_t *out)
+{
+  pthread_mutex_lock(&out->mutex);
+  write_output(out, NULL, 0);
+  out->queueing = 0;
+  pthread_mutex_unlock(&out->mutex);
+}
+
+static void send_reply(agent_args_t *args, const char *data, size_t len)
+{
+  queue_output(args->out, data, len);
+}
+
+static void send_frame(agent_args_t *args, int op, int status, const void *payload, size_t len)
+{
+  pthread_mutex_lock(&args->out->mutex);
+  queue_frame_locked(args->out, op, status, payload, len);
+  pthread_mutex_unlock(&args->out->mutex);
+}
+
+// The format is read under the mutex, so nothing rendered as text can follow
+// the reply that switched the connection to frames. The change behind the
+// notification was logged before it was queued, writing it waits for that.
+static void send_notification(const notification_t *notif, void *ctx)
+{
+  conn_output_t *out = ctx;
+  wal_catch_up();
+  pthread_mutex_lock(&out->mutex);
+  if (out->binary)
+  {
+    queue_frame_locked(out, BIN_NOTIFICATION, notif->type, &notif->fulfilled, notification_payload_size(notif->type));
+  }
+  else
+  {
+    char message[256];
+    queue_locked(out, message, format_notification(notif, message, sizeof(message)));
+  }
+  pthread_mutex_unlock(&out->mutex);
+}
 
 void *command_handler_thread(void *arg);
 void *notification_thread(void *arg);
-void handle_command(agent_args_t *args, char *command_str);
-char *trim_whitespace(char *str);
+void *event_loop_thread(void *arg);
+void *uring_loop_thread(void *arg);
+void handle_command(agent_args_t *args, const char *line, size_t len);
+static void handle_frame(agent_args_t *args, const bin_request_t *request);
 
-void agent_process(int client_fd)
+agent_args_t *agent_connect(int client_fd)
 {
-  pthread_t cmd_thread, notif_thread;
   agent_args_t *args = malloc(sizeof(agent_args_t));
   args->client_fd = client_fd;
+  args->closed = 0;
+  args->wake_fd = -1;
+  args->batch = NULL;
+  args->frame_op = 0;
+  args->buffer_len = 0;
+  args->out = malloc(sizeof(conn_output_t));
+  pthread_mutex_init(&args->out->mutex, NULL);
+  args->out->fd = client_fd;
+  args->out->queueing = 0;
+  args->out->binary = 0;
+  args->out->ring = NULL;
+  args->out->used = 0;
+
+  if (get_next_agent_id(&args->agent_id) == -1)
+  {
+    fprintf(stderr, "Debug: agent table is full, closing the connection\n");
+    close(client_fd);
+    pthread_mutex_destroy(&args->out->mutex);
+    free(args->out);
+    free(args);
+    return NULL;
+  }
+  return args;
+}
+
+void agent_disconnect(agent_args_t *args)
+{
+  // The wakeup socket is named after the id, it must be gone before the id
+  // is handed out again
+  if (args->wake_fd != -1)
+    close(args->wake_fd);
+  cleanup_agent(args->agent_id);
+  close(args->client_fd);
+  free(args->batch);
+  pthread_mutex_destroy(&args->out->mutex);
+  free(args->out);
+  free(args);
+}
+
+// Handles every complete frame of data, returns the bytes they took
+static size_t handle_frames(agent_args_t *args, const char *data, size_t len)
+{
+  size_t used = 0;
+  while (!args->closed && len - used >= sizeof(bin_header_t))
+  {
+    bin_request_t request;
+    memset(&request, 0, sizeof(request));
+    memcpy(&request.header, data + used, sizeof(bin_header_t));
+    if (request.header.length < sizeof(bin_header_t) || request.header.length > sizeof(bin_request_t))
+    {
+      args->closed = 1;
+      break;
+    }
+    if (len - used < request.header.length)
+      break;
+    memcpy(&request, data + used, request.header.length);
+    used += request.header.length;
+    handle_frame(args, &request);
+  }
+  return used;
+}
+
+// Handles every complete command once bytes_read more are in the buffer
+static int handle_input(agent_args_t *args, size_t bytes_read)
+{
+  args->buffer_len += bytes_read;
+  args->buffer[args->buffer_len] = '\0';
+
+  // Every complete line of this read is handled before the replies go out
+  begin_replies(args->out);
+  char *line_start = args->buffer;
+  char *newline_pos;
+  while (!args->closed && !args->out->binary && (newline_pos = strchr(line_start, '\n')) != NULL)
+  {
+    *newline_pos = '\0'; // Replace newline with null terminator
+    // Now line_start points to a complete command string
+    handle_command(args, line_start, newline_pos - line_start);
+    // Move to the next line
+    line_start = newline_pos + 1;
+  }
+  size_t rest;
+  if (args->out->binary)
+  {
+    // Whatever followed the binary command are frames already
+    rest = args->buffer + args->buffer_len - line_start;
+    size_t used = handle_frames(args, line_start, rest);
+    line_start += used;
+    rest -= used;
+  }
+  else
+  {
+    rest = strlen(line_start);
+  }
+  flush_replies(args->out);
+  if (args->closed)
+    return -1;
+  // Move any remaining partial command to the beginning of the buffer
+  args->buffer_len = rest;
+  memmove(args->buffer, line_start, args->buffer_len);
+  return 0;
+}
 
-  get_next_agent_id(&args->agent_id);
-  // Register agent in shared memory if needed
+int agent_read(agent_args_t *args)
+{
+  ssize_t bytes_read = read(args->client_fd, args->buffer + args->buffer_len,
+                            sizeof(args->buffer) - args->buffer_len - 1);
+  if (bytes_read <= 0)
+  {
+    // Client closed connection or error
+    return -1;
+  }
+  return handle_input(args, bytes_read);
+}
 
-  // Create command handler thread
-  if (pthread_create(&cmd_thread, NULL, command_handler_thread, args) != 0)
+// Same for bytes an io_uring receive put elsewhere, taken a buffer at a time
+static int receive_input(agent_args_t *args, const char *data, size_t len)
+{
+  while (len > 0)
+  {
+    // A line that fills the buffer ends the connection, as the read() of
+    // zero bytes in agent_read does
+    size_t room = sizeof(args->buffer) - args->buffer_len - 1;
+    if (room == 0)
+      return -1;
+    size_t chunk = len < room ? len : room;
+    memcpy(args->buffer + args->buffer_len, data, chunk);
+    if (handle_input(args, chunk) == -1)
+      return -1;
+    data += chunk;
+    len -= chunk;
+  }
+  return 0;
+}
+
+int agent_wakeup_fd(agent_args_t *args)
+{
+  if (args->wake_fd == -1)
+    args->wake_fd = notification_wakeup_fd(args->agent_id);
+  return args->wake_fd;
+}
+
+// Pending notifications are sent right away, the wakeup socket is only armed
+// when there are none
+static void deliver_pending(agent_args_t *args)
+{
+  do
+  {
+    deliver_notifications(args->agent_id, send_notification, args->out);
+  } while (arm_notification_wakeup(args->agent_id) == 1);
+}
+
+void agent_notify(agent_args_t *args)
+{
+  char wakeups[64];
+  while (recv(args->wake_fd, wakeups, sizeof(wakeups), MSG_DONTWAIT) > 0)
+  {
+  }
+  deliver_pending(args);
+}
+
+void agent_process(int client_fd)
+{
+  pthread_t cmd_thread, notif_thread;
+  agent_args_t *args = agent_connect(client_fd);
+  if (args == NULL)
+    return;
+
+  // Create command handler thread, it also delivers the notifications when
+  // agents run an event loop
+  void *(*loop)(void *) = command_handler_thread;
+  if (agent_loop == AGENT_LOOP_EPOLL)
+    loop = event_loop_thread;
+  else if (agent_loop == AGENT_LOOP_URING)
+    loop = uring_loop_thread;
+  if (pthread_create(&cmd_thread, NULL, loop, args) != 0)
   {
     perror("pthread_create");
     close(client_fd);
@@ -38,7 +431,7 @@ void agent_process(int client_fd)
   }
 
   // Create notification thread
-  if (pthread_create(&notif_thread, NULL, notification_thread, args) != 0)
+  if (agent_loop == AGENT_LOOP_THREADS && pthread_create(&notif_thread, NULL, notification_thread, args) != 0)
   {
     perror("pthread_create");
     close(client_fd);
@@ -48,259 +441,638 @@ void agent_process(int client_fd)
 
   // Wait for threads to finish
   pthread_join(cmd_thread, NULL);
-  pthread_cancel(notif_thread); // Cancel notification thread if command handler exits
-  pthread_join(notif_thread, NULL);
+  if (agent_loop == AGENT_LOOP_THREADS)
+  {
+    interrupt_notifications(args->agent_id); // Stop notification thread if command handler exits
+    pthread_join(notif_thread, NULL);
+  }
 
-  cleanup_agent(args->agent_id);
-  close(client_fd);
-  free(args);
+  agent_disconnect(args);
 }
 
 void *command_handler_thread(void *arg)
 {
   agent_args_t *args = (agent_args_t *)arg;
-  int client_fd = args->client_fd;
-  char buffer[1024];
-  size_t buffer_len = 0; // Current length of data in buffer
 
-  while (1)
+  while (agent_read(args) == 0)
   {
-    ssize_t bytes_read = read(client_fd, buffer + buffer_len, sizeof(buffer) - buffer_len - 1);
-    if (bytes_read <= 0)
-    {
-      // Client closed connection or error
-      break;
-    }
-
-    buffer_len += bytes_read;
-    buffer[bytes_read] = '\0';
-
-    char *line_start = buffer;
-    char *newline_pos;
-    while ((newline_pos = strchr(line_start, '\n')) != NULL)
-    {
-      *newline_pos = '\0'; // Replace newline with null terminator
-      // Now line_start points to a complete command string
-      handle_command(args, line_start);
-      // Move to the next line
-      line_start = newline_pos + 1;
-    }
-    // Move any remaining partial command to the beginning of the buffer
-    buffer_len = strlen(line_start);
-    memmove(buffer, line_start, buffer_len);
   }
 
-  // Clean up and exit the thread
-  close(client_fd);
+  // Also fails the writes of a notification thread stuck on a client that
+  // stopped reading, so it can be joined
+  shutdown(args->client_fd, SHUT_RDWR);
   return NULL;
 }
 
 void *notification_thread(void *arg)
 {
   agent_args_t *args = (agent_args_t *)arg;
-  int client_fd = args->client_fd;
   int agent_id = args->agent_id;
 
   // Wait for notifications from shared memory and send to client
-
-  while (1)
+  while (notify_client(agent_id, send_notification, args->out) == 0)
   {
-    notify_client(agent_id, client_fd);
   }
 
   return NULL;
 }
 
-void handle_command(agent_args_t *args, char *command_str)
+// One thread per agent: waits for the client and for notifications together
+void *event_loop_thread(void *arg)
 {
-  int client_fd = args->client_fd;
-  int agent_id = args->agent_id;
+  agent_args_t *args = (agent_args_t *)arg;
+  int wake_fd = agent_wakeup_fd(args);
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = {.events = EPOLLIN};
+  event.data.fd = args->client_fd;
+  if (wake_fd == -1 || epoll_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, args->client_fd, &event) == -1)
+  {
+    perror("event loop setup");
+    if (epoll_fd != -1)
+      close(epoll_fd);
+    return NULL;
+  }
+  event.data.fd = wake_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
 
-  char *command = trim_whitespace(command_str);
-  if (strncmp(command, "move ", 5) == 0)
+  int running = 1;
+  while (running)
   {
-    int x, y;
-    if (sscanf(command + 5, "%d %d", &x, &y) == 2)
+    agent_notify(args);
+    struct epoll_event events[2];
+    int count = epoll_wait(epoll_fd, events, 2, -1);
+    for (int i = 0; i < count; i++)
     {
-      // Call move function
-      if (move(agent_id, x, y) == 0)
-      {
-        char response[20];
-        snprintf(response, sizeof(response), "OK");
-        write(client_fd, response, strlen(response));
-      }
-      else
-      {
-        write(client_fd, "Error: Move failed\n", 19);
-      }
+      if (events[i].data.fd == args->client_fd && agent_read(args) == -1)
+        running = 0;
     }
-    else
+  }
+
+  close(epoll_fd);
+  return NULL;
+}
+
+// One thread per agent on an io_uring. The client and the wakeup socket stay
+// armed with multishot receives and the replies of a round go out as one
+// send, submitted together with the wait for the next commands.
+void *uring_loop_thread(void *arg)
+{
+  agent_args_t *args = (agent_args_t *)arg;
+  int wake_fd = agent_wakeup_fd(args);
+  io_ring_t *ring = wake_fd == -1 ? NULL : io_ring_create(args->client_fd);
+  if (ring == NULL)
+  {
+    // io_uring unavailable or out of locked memory
+    return event_loop_thread(arg);
+  }
+  io_ring_recv(ring, args->client_fd, URING_CLIENT);
+  io_ring_recv(ring, wake_fd, URING_WAKEUP);
+  pthread_mutex_lock(&args->out->mutex);
+  args->out->ring = ring;
+  pthread_mutex_unlock(&args->out->mutex);
+
+  int running = 1;
+  while (running)
+  {
+    deliver_pending(args);
+    io_ring_event_t events[URING_EVENTS];
+    int count = io_ring_wait(ring, events, URING_EVENTS);
+    if (count == -1)
+      break;
+    // Wakeup datagrams are consumed by their receive, nothing else to do
+    for (int i = 0; i < count && running; i++)
     {
-      write(client_fd, "Error: Invalid move command\n", 28);
+      if (events[i].tag == URING_CLIENT &&
+          (events[i].result <= 0 || receive_input(args, events[i].data, events[i].result) == -1))
+        running = 0;
     }
   }
-  else if (strncmp(command, "demand ", 7) == 0)
+
+  io_ring_flush(ring);
+  pthread_mutex_lock(&args->out->mutex);
+  args->out->ring = NULL;
+  pthread_mutex_unlock(&args->out->mutex);
+  io_ring_destroy(ring);
+  return NULL;
+}
+
+// Turns one command of a batch into its op, same syntax and errors as
+// outside of one
+static void parse_batch_op(const command_t *cmd, batch_op_t *op)
+{
+  op->type = BATCH_INVALID;
+  switch (cmd->type)
+  {
+  case CMD_MOVE:
+    op->type = BATCH_MOVE;
+    break;
+  case CMD_DEMAND:
+    op->type = BATCH_DEMAND;
+    break;
+  case CMD_SUPPLY:
+    op->type = BATCH_SUPPLY;
+    break;
+  case CMD_WATCH:
+    op->type = BATCH_WATCH;
+    break;
+  case CMD_UNWATCH:
+    op->type = BATCH_UNWATCH;
+    break;
+  default:
+    op->error = "Error: Command not allowed in batch\n";
+    return;
+  }
+  if (!cmd->valid)
+  {
+    op->type = BATCH_INVALID;
+    op->error = command_error(cmd->type);
+    return;
+  }
+  memcpy(op->args, cmd->args, sizeof(op->args));
+}
+
+// Same for a request frame of a binary connection
+static void parse_batch_frame(const bin_request_t *request, batch_op_t *op)
+{
+  memcpy(op->args, request->args, sizeof(op->args));
+  switch (request->header.op)
+  {
+  case BIN_MOVE:
+    op->type = BATCH_MOVE;
+    break;
+  case BIN_DEMAND:
+    op->type = BATCH_DEMAND;
+    break;
+  case BIN_SUPPLY:
+    op->type = BATCH_SUPPLY;
+    break;
+  case BIN_WATCH:
+    op->type = BATCH_WATCH;
+    break;
+  case BIN_UNWATCH:
+    op->type = BATCH_UNWATCH;
+    break;
+  default:
+    op->type = BATCH_INVALID;
+    op->error = "Error: Command not allowed in batch\n";
+  }
+}
+
+// Caller holds lock_all_tables(), returns the reply of the command
+static const char *apply_batch_op(int agent_id, const batch_op_t *op)
+{
+  switch (op->type)
+  {
+  case BATCH_MOVE:
+    return move_nolock(agent_id, op->args[0], op->args[1]) == 0 ? "OK" : "Error: Move failed\n";
+  case BATCH_DEMAND:
+    return add_demand_nolock(agent_id, op->args[0], op->args[1], op->args[2]) == 0 ? "OK" : "Error: Add demand failed\n";
+  case BATCH_SUPPLY:
+    return add_supply_nolock(agent_id, op->args[0], op->args[1], op->args[2], op->args[3]) == 0 ? "OK" : "Error: Add supply failed\n";
+  case BATCH_WATCH:
+    return add_watch_nolock(agent_id, op->args[0]) == 0 ? "OK" : "Error: Add watch failed\n";
+  case BATCH_UNWATCH:
+    return remove_watch_nolock(agent_id) == 0 ? "OK" : "Error: Remove watch failed\n";
+  default:
+    return op->error;
+  }
+}
+
+// Adds the reply of one command to those of its batch, as text or as the
+// status byte a binary connection gets
+static size_t append_batch_reply(int binary, char *response, size_t len, const batch_op_t *op, const char *reply)
+{
+  if (binary)
+  {
+    response[len] = op->type == BATCH_INVALID ? BIN_INVALID : strcmp(reply, "OK") == 0 ? BIN_OK : BIN_FAILED;
+    return len + 1;
+  }
+  strcpy(response + len, reply);
+  return len + strlen(reply);
+}
+
+// Applies a committed batch and writes all of its replies at once. An atomic
+// batch runs under a single lock_all_tables() and is rejected as a whole if
+// any command is invalid or the tables cannot take it, a plain one gives
+// other agents a turn every BATCH_LOCK_CHUNK commands.
+static void run_batch(agent_args_t *args)
+{
+  batch_t *batch = args->batch;
+  args->batch = NULL;
+  int binary = args->out->binary;
+  int status = BIN_OK;
+
+  size_t size = (size_t)batch->count * 40 + 128;
+  char *response = malloc(size);
+  if (response == NULL)
+  {
+    free(batch);
+    if (binary)
+      send_frame(args, BIN_COMMIT, BIN_FAILED, NULL, 0);
+    else
+      send_reply(args, "Error: Batch failed\n", 20);
+    return;
+  }
+  size_t len = 0;
+  response[0] = '\0';
+
+  if (batch->overflow)
+  {
+    status = BIN_INVALID;
+    if (!binary)
+      len = snprintf(response, size, "Error: Batch exceeds %d commands\n", BATCH_MAX_OPS);
+  }
+  else if (batch->atomic)
   {
-    int nA, nB, nC;
-    if (sscanf(command + 7, "%d %d %d", &nA, &nB, &nC) == 3)
+    int invalid = -1;
+    int demands = 0;
+    int supplies = 0;
+    for (int k = 0; k < batch->count; k++)
     {
-      if (add_demand(agent_id, nA, nB, nC) == 0)
+      if (batch->ops[k].type == BATCH_INVALID && invalid == -1)
+        invalid = k;
+      demands += batch->ops[k].type == BATCH_DEMAND;
+      supplies += batch->ops[k].type == BATCH_SUPPLY;
+    }
+
+    if (invalid != -1)
+    {
+      status = BIN_REJECTED;
+      if (binary)
       {
-        char response[20];
-        snprintf(response, sizeof(response), "OK");
-        write(client_fd, response, strlen(response));
+        int32_t number = invalid + 1;
+        memcpy(response, &number, sizeof(number));
+        len = sizeof(number);
       }
       else
       {
-        write(client_fd, "Error: Add demand failed\n", 25);
+        len = snprintf(response, size, "Error: Batch rejected, command %d: %s", invalid + 1, batch->ops[invalid].error + strlen("Error: "));
       }
     }
     else
     {
-      write(client_fd, "Error: Invalid demand command\n", 30);
-    }
-  }
-  else if (strncmp(command, "supply ", 7) == 0)
-  {
-    int distance, nA, nB, nC;
-    if (sscanf(command + 7, "%d %d %d %d", &distance, &nA, &nB, &nC) == 4)
-    {
-      if (add_supply(agent_id, distance, nA, nB, nC) == 0)
+      lock_all_tables();
+      if (demands > free_demand_slots() || supplies > free_supply_slots())
       {
-        char response[20];
-        snprintf(response, sizeof(response), "OK");
-        write(client_fd, response, strlen(response));
+        status = BIN_REJECTED;
+        if (!binary)
+          len = snprintf(response, size, "Error: Batch rejected, not enough free slots\n");
       }
       else
       {
-        write(client_fd, "Error: Add supply failed\n", 25);
+        for (int k = 0; k < batch->count; k++)
+        {
+          const char *reply = apply_batch_op(args->agent_id, &batch->ops[k]);
+          len = append_batch_reply(binary, response, len, &batch->ops[k], reply);
+        }
       }
-    }
-    else
-    {
-      write(client_fd, "Error: Invalid supply command\n", 30);
+      unlock_all_tables();
     }
   }
-  else if (strncmp(command, "watch ", 6) == 0)
+  else
   {
-    int distance;
-    if (sscanf(command + 6, "%d", &distance) == 1)
+    for (int start = 0; start < batch->count; start += BATCH_LOCK_CHUNK)
     {
-      if (add_watch(agent_id, distance) == 0)
-      {
-        char response[20];
-        snprintf(response, sizeof(response), "OK");
-        write(client_fd, response, strlen(response));
-      }
-      else
+      int end = start + BATCH_LOCK_CHUNK < batch->count ? start + BATCH_LOCK_CHUNK : batch->count;
+      lock_all_tables();
+      for (int k = start; k < end; k++)
       {
-        write(client_fd, "Error: Add watch failed\n", 25);
+        const char *reply = apply_batch_op(args->agent_id, &batch->ops[k]);
+        len = append_batch_reply(binary, response, len, &batch->ops[k], reply);
       }
-    }
-    else
-    {
-      write(client_fd, "Error: Invalid watch command\n", 30);
+      unlock_all_tables();
     }
   }
-  else if (strcmp(command, "unwatch") == 0)
+
+  if (binary)
+    send_frame(args, BIN_COMMIT, status, response, len);
+  else if (len > 0)
+    send_reply(args, response, len);
+  free(response);
+  free(batch);
+}
+
+static void send_list_chunk(const char *data, size_t len, void *ctx)
+{
+  agent_args_t *args = ctx;
+  if (args->out->binary)
+    send_frame(args, args->frame_op, BIN_MORE, data, len);
+  else
+    send_reply(args, data, len);
+}
+
+static void send_error(agent_args_t *args, const char *error)
+{
+  send_reply(args, error, strlen(error));
+}
+
+// Streams a listing to the client: paged by "<offset> <limit>", limited to a
+// region by "near <R> [<x0> <y0> <x1> <y1>]" or "in <x0> <y0> <x1> <y1>", or
+// the whole table
+static void send_listing(agent_args_t *args, int all, int supplies, const command_t *cmd)
+{
+  const int *arg = cmd->args;
+  int result;
+  if (cmd->word != CMD_WORD_NONE)
   {
-    if (remove_watch(agent_id) == 0)
+    list_region_t region;
+    memset(&region, 0, sizeof(region));
+    region.near = cmd->word == CMD_WORD_NEAR;
+    region.radius = region.near ? arg[0] : 0;
+    region.box = cmd->argc >= 4;
+    if (region.box)
     {
-      char response[20];
-      snprintf(response, sizeof(response), "OK");
-      write(client_fd, response, strlen(response));
+      const int *bounds = arg + cmd->argc - 4;
+      region.x0 = bounds[0];
+      region.y0 = bounds[1];
+      region.x1 = bounds[2];
+      region.y1 = bounds[3];
     }
-    else
+    if (region.radius < 0)
     {
-      write(client_fd, "Error: Remove watch failed\n", 25);
+      send_error(args, command_error(cmd->type));
+      return;
     }
+    result = write_region_response(args->agent_id, supplies, &region, send_list_chunk, args);
   }
-  else if (strcmp(command, "mydemands") == 0)
+  else
   {
-    char *response = create_demand_response(agent_id, 0);
-    if (response == NULL)
+    int offset = cmd->argc == 2 ? arg[0] : 0;
+    int limit = cmd->argc == 2 ? arg[1] : -1;
+    if (offset < 0 || (cmd->argc == 2 && limit < 0))
     {
-      write(client_fd, "Error: No demands found\n", 24);
-    }
-    else
-    {
-      // Send demands to client
-      write(client_fd, response, strlen(response));
-      free(response);
+      send_error(args, command_error(cmd->type));
+      return;
     }
+    result = write_list_response(args->agent_id, all, supplies, offset, limit, send_list_chunk, args);
   }
-  else if (strcmp(command, "mysupplies") == 0)
+  if (result == -1)
   {
-    char *response = create_supply_response(agent_id, 0);
-    if (response == NULL)
-    {
-      write(client_fd, "Error: No supplies found\n", 24);
-    }
+    if (supplies)
+      send_reply(args, "Error: No supplies found\n", 24);
     else
-    {
-      // Send supplies to client
-      write(client_fd, response, strlen(response));
-      free(response);
-    }
+      send_reply(args, "Error: No demands found\n", 24);
   }
-  else if (strcmp(command, "listdemands") == 0)
+}
+
+// Dumps the market to a new file in snapshot_dir. Only this connection waits
+// for the file, the tables are locked just while the rows are copied.
+static void send_snapshot(agent_args_t *args)
+{
+  if (snapshot_dir == NULL)
   {
-    char *response = create_demand_response(agent_id, 1);
-    if (response == NULL)
-    {
-      write(client_fd, "Error: No demands found\n", 24);
-    }
+    send_reply(args, "Error: Snapshots are disabled\n", 30);
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/snapshot-%lld%03ld-%d.csv", snapshot_dir, (long long)now.tv_sec,
+           now.tv_nsec / 1000000, args->agent_id);
+  market_snapshot_t snapshot;
+  if (write_market_snapshot(path, &snapshot) == -1)
+  {
+    send_reply(args, "Error: Snapshot failed\n", 23);
+    return;
+  }
+  char response[PATH_MAX + 128];
+  snprintf(response, sizeof(response), "Snapshot of %d demands and %d supplies in %s, %.1f ms, tables locked %.3f ms.\n",
+           snapshot.demands, snapshot.supplies, path, snapshot.total_ms, snapshot.pause_ms);
+  send_reply(args, response, strlen(response));
+}
+
+void handle_command(agent_args_t *args, const char *line, size_t len)
+{
+  int agent_id = args->agent_id;
+  command_t cmd;
+  parse_command(line, len, &cmd);
+  if (cmd.type == CMD_BLANK)
+    return;
+
+  if (args->batch != NULL && cmd.type != CMD_COMMIT && cmd.type != CMD_QUIT)
+  {
+    // Inside a block every command is only parsed, replies come with commit
+    batch_t *batch = args->batch;
+    if (batch->count == BATCH_MAX_OPS)
+      batch->overflow = 1;
     else
-    {
-      // Send demands to client
-      write(client_fd, response, strlen(response));
-      free(response);
-    }
+      parse_batch_op(&cmd, &batch->ops[batch->count++]);
+    return;
+  }
+  if (cmd.type == CMD_UNKNOWN)
+  {
+    send_reply(args, "Error: Unknown command\n", 23);
+    return;
   }
-  else if (strcmp(command, "listsupplies") == 0)
+  if (!cmd.valid)
   {
-    char *response = create_supply_response(agent_id, 1);
-    if (response == NULL)
+    send_error(args, command_error(cmd.type));
+    return;
+  }
+
+  const int *arg = cmd.args;
+  switch (cmd.type)
+  {
+  case CMD_BEGIN:
+    args->batch = malloc(sizeof(batch_t));
+    if (args->batch == NULL)
     {
-      write(client_fd, "Error: No supplies found\n", 24);
+      send_reply(args, "Error: Begin failed\n", 20);
+      return;
     }
+    args->batch->atomic = cmd.word == CMD_WORD_ATOMIC;
+    args->batch->count = 0;
+    args->batch->overflow = 0;
+    break;
+  case CMD_COMMIT:
+    if (args->batch == NULL)
+      send_reply(args, "Error: Commit without begin\n", 28);
     else
-    {
-      // Send supplies to client
-      write(client_fd, response, strlen(response));
-      free(response);
-    }
+      run_batch(args);
+    break;
+  case CMD_MOVE:
+    if (move(agent_id, arg[0], arg[1]) == 0)
+      send_reply(args, "OK", 2);
+    else
+      send_reply(args, "Error: Move failed\n", 19);
+    break;
+  case CMD_DEMAND:
+    if (add_demand(agent_id, arg[0], arg[1], arg[2]) == 0)
+      send_reply(args, "OK", 2);
+    else
+      send_reply(args, "Error: Add demand failed\n", 25);
+    break;
+  case CMD_SUPPLY:
+    if (add_supply(agent_id, arg[0], arg[1], arg[2], arg[3]) == 0)
+      send_reply(args, "OK", 2);
+    else
+      send_reply(args, "Error: Add supply failed\n", 25);
+    break;
+  case CMD_WATCH:
+    if (add_watch(agent_id, arg[0]) == 0)
+      send_reply(args, "OK", 2);
+    else
+      send_reply(args, "Error: Add watch failed\n", 25);
+    break;
+  case CMD_UNWATCH:
+    if (remove_watch(agent_id) == 0)
+      send_reply(args, "OK", 2);
+    else
+      send_reply(args, "Error: Remove watch failed\n", 25);
+    break;
+  case CMD_MYDEMANDS:
+    send_listing(args, 0, 0, &cmd);
+    break;
+  case CMD_MYSUPPLIES:
+    send_listing(args, 0, 1, &cmd);
+    break;
+  case CMD_LISTDEMANDS:
+    send_listing(args, 1, 0, &cmd);
+    break;
+  case CMD_LISTSUPPLIES:
+    send_listing(args, 1, 1, &cmd);
+    break;
+  case CMD_STATS:
+  {
+    notification_stats_t agent, server;
+    notification_stats(agent_id, &agent, &server);
+    char response[256];
+    snprintf(response, sizeof(response),
+             "Notifications dropped %lu, spilled %lu, blocked %lu. Server dropped %lu, spilled %lu, blocked %lu.\n",
+             agent.dropped, agent.spilled, agent.blocked, server.dropped, server.spilled, server.blocked);
+    send_reply(args, response, strlen(response));
+    break;
+  }
+  case CMD_SNAPSHOT:
+    send_snapshot(args);
+    break;
+  case CMD_BINARY:
+  {
+    // The reply is the last text, later bytes are frames both ways
+    pthread_mutex_lock(&args->out->mutex);
+    queue_locked(args->out, "OK", 2);
+    args->out->binary = 1;
+    pthread_mutex_unlock(&args->out->mutex);
+    break;
   }
+  case CMD_QUIT:
+    send_reply(args, "OK", 3);
+    args->closed = 1;
+    break;
+  default:
+    break;
+  }
+}
 
-  else if (strcmp(command, "quit") == 0)
+// Listings keep their text rows, sent as BIN_MORE frames and ended by an
+// empty frame with the status
+static void send_frame_listing(agent_args_t *args, const bin_request_t *request)
+{
+  int op = request->header.op;
+  int all = op == BIN_LISTDEMANDS || op == BIN_LISTSUPPLIES;
+  int supplies = op == BIN_LISTSUPPLIES || op == BIN_MYSUPPLIES;
+  int flags = request->header.flags;
+  const int32_t *arg = request->args;
+  int result;
+  if (all && (flags & (BIN_FLAG_NEAR | BIN_FLAG_BOX)))
   {
-    write(client_fd, "OK", 3);
-    pthread_exit(NULL);
+    list_region_t region = {.near = (flags & BIN_FLAG_NEAR) != 0, .radius = arg[0], .box = (flags & BIN_FLAG_BOX) != 0,
+                            .x0 = arg[1], .y0 = arg[2], .x1 = arg[3], .y1 = arg[4]};
+    if (region.near && region.radius < 0)
+    {
+      send_frame(args, op, BIN_INVALID, NULL, 0);
+      return;
+    }
+    result = write_region_response(args->agent_id, supplies, &region, send_list_chunk, args);
   }
   else
   {
-    printf("Unknown command\n");
+    if (all && arg[0] < 0)
+    {
+      send_frame(args, op, BIN_INVALID, NULL, 0);
+      return;
+    }
+    // A frame that ends before the limit asks for the rest, not for 0 rows
+    int has_limit = request->header.length >= sizeof(bin_header_t) + 2 * sizeof(int32_t);
+    result = write_list_response(args->agent_id, all, supplies, all ? arg[0] : 0,
+                                 all && has_limit && arg[1] >= 0 ? arg[1] : -1, send_list_chunk, args);
   }
+  send_frame(args, op, result == -1 ? BIN_FAILED : BIN_OK, NULL, 0);
 }
 
-char *trim_whitespace(char *str)
+// Binary counterpart of handle_command, the arguments come ready to use
+static void handle_frame(agent_args_t *args, const bin_request_t *request)
 {
-  char *end;
-
-  // Trim leading space
-  while (isspace((unsigned char)*str))
-    str++;
-
-  if (*str == 0) // All spaces?
-    return str;
-
-  // Trim trailing space
-  end = str + strlen(str) - 1;
-  while (end > str && isspace((unsigned char)*end))
-    end--;
-
-  // Write new null terminator
-  *(end + 1) = '\0';
+  int agent_id = args->agent_id;
+  int op = request->header.op;
+  const int32_t *arg = request->args;
+  args->frame_op = op;
+  if (args->batch != NULL && op != BIN_COMMIT && op != BIN_QUIT)
+  {
+    batch_t *batch = args->batch;
+    if (batch->count == BATCH_MAX_OPS)
+      batch->overflow = 1;
+    else
+      parse_batch_frame(request, &batch->ops[batch->count++]);
+    return;
+  }
 
-  return str;
+  int status;
+  switch (op)
+  {
+  case BIN_MOVE:
+    status = move(agent_id, arg[0], arg[1]) == 0 ? BIN_OK : BIN_FAILED;
+    break;
+  case BIN_DEMAND:
+    status = add_demand(agent_id, arg[0], arg[1], arg[2]) == 0 ? BIN_OK : BIN_FAILED;
+    break;
+  case BIN_SUPPLY:
+    status = add_supply(agent_id, arg[0], arg[1], arg[2], arg[3]) == 0 ? BIN_OK : BIN_FAILED;
+    break;
+  case BIN_WATCH:
+    status = add_watch(agent_id, arg[0]) == 0 ? BIN_OK : BIN_FAILED;
+    break;
+  case BIN_UNWATCH:
+    status = remove_watch(agent_id) == 0 ? BIN_OK : BIN_FAILED;
+    break;
+  case BIN_MYDEMANDS:
+  case BIN_MYSUPPLIES:
+  case BIN_LISTDEMANDS:
+  case BIN_LISTSUPPLIES:
+    send_frame_listing(args, request);
+    return;
+  case BIN_STATS:
+  {
+    notification_stats_t agent, server;
+    notification_stats(agent_id, &agent, &server);
+    bin_stats_t stats = {agent.dropped, agent.spilled, agent.blocked, server.dropped, server.spilled, server.blocked};
+    send_frame(args, op, BIN_OK, &stats, sizeof(stats));
+    return;
+  }
+  case BIN_BEGIN:
+    // Like the text command, begin is only answered when it fails
+    args->batch = malloc(sizeof(batch_t));
+    if (args->batch == NULL)
+    {
+      send_frame(args, op, BIN_FAILED, NULL, 0);
+      return;
+    }
+    args->batch->atomic = (request->header.flags & BIN_FLAG_ATOMIC) != 0;
+    args->batch->count = 0;
+    args->batch->overflow = 0;
+    return;
+  case BIN_COMMIT:
+    if (args->batch == NULL)
+      send_frame(args, op, BIN_FAILED, NULL, 0);
+    else
+      run_batch(args);
+    return;
+  case BIN_QUIT:
+    status = BIN_OK;
+    args->closed = 1;
+    break;
+  default:
+    status = BIN_INVALID;
+  }
+  send_frame(args, op, status, NULL, 0);
 }
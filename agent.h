@@ -1,6 +1,44 @@
 #ifndef AGENT_H
 #define AGENT_H
 
+// Serves a client until it disconnects, from the threads of this process
 void agent_process(int client_fd);
 
+// One client connection and its agent, for callers running their own event
+// loop. Opaque outside agent.c.
+typedef struct agent_args agent_args_t;
+
+// Sets up the agent of a new client, NULL when the agent table is full (the
+// connection is closed then)
+agent_args_t *agent_connect(int client_fd);
+
+// Reads once from the client and handles every complete command. Returns -1
+// once the client closed the connection or quit.
+int agent_read(agent_args_t *args);
+
+// Socket to poll for the agent's notifications, -1 on error
+int agent_wakeup_fd(agent_args_t *args);
+
+// Sends the pending notifications and arms the wakeup socket again
+void agent_notify(agent_args_t *args);
+
+// Releases everything the agent holds and closes its connection
+void agent_disconnect(agent_args_t *args);
+
+// Queue the replies to all commands of one read and send them with one writev
+// (default), or write every reply as soon as it is ready
+void set_pipelined_replies(int enabled);
+
+typedef enum
+{
+  AGENT_LOOP_THREADS, // a command and a notification thread per agent
+  AGENT_LOOP_EPOLL,   // one thread polling the client and the wakeup socket
+  AGENT_LOOP_URING    // one thread on an io_uring, epoll where it is unavailable
+} agent_loop_t;
+
+void set_agent_loop(agent_loop_t loop);
+
+// Directory the snapshot command writes to, snapshots are refused while NULL
+void set_snapshot_dir(const char *dir);
+
 #endif // AGENT_H
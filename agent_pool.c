@@ -0,0 +1,251 @@
+#include "agent_pool.h"
+#include "agent.h"
+#include "shared_memory.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define POOL_IDLE 'i'
+
+// Parent side of one pre-forked agent process
+typedef struct
+{
+  pid_t pid;
+  int control_fd; // seqpacket: client fds go out, POOL_IDLE comes back
+  int idle;
+} pool_worker_t;
+
+typedef struct
+{
+  int listen_fd;
+  int min_idle;
+  int max_idle;
+  int count;
+  int capacity;
+  int idle_count;
+  pool_worker_t *workers;
+} agent_pool_t;
+
+static int receive_client(int control_fd)
+{
+  char byte;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(control_fd, &msg, 0) <= 0)
+    return -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    return -1;
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+static int send_client(int control_fd, int client_fd)
+{
+  char byte = 0;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &client_fd, sizeof(int));
+  return sendmsg(control_fd, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+// Serves one client after another until the parent closes the control socket
+static void worker_loop(int control_fd)
+{
+  int client_fd;
+  while ((client_fd = receive_client(control_fd)) != -1)
+  {
+    agent_process(client_fd);
+    char idle = POOL_IDLE;
+    if (write(control_fd, &idle, 1) != 1)
+      break;
+  }
+  exit(EXIT_SUCCESS);
+}
+
+// pending_fd is a client the parent accepted but has not passed on yet, -1
+// for none. The child must not keep it, or the client never sees EOF.
+static int spawn_worker(agent_pool_t *pool, int pending_fd)
+{
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) == -1)
+  {
+    perror("socketpair");
+    return -1;
+  }
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  if (pid == -1)
+  {
+    perror("fork");
+    close(pair[0]);
+    close(pair[1]);
+    return -1;
+  }
+  if (pid == 0)
+  {
+    if (end_with_parent(parent) == -1)
+      exit(EXIT_SUCCESS);
+    // The parent's ends of the other workers must close when the parent
+    // closes them, or a worker told to exit would never see it
+    close(pool->listen_fd);
+    if (pending_fd != -1)
+      close(pending_fd);
+    for (int i = 0; i < pool->count; i++)
+    {
+      close(pool->workers[i].control_fd);
+    }
+    close(pair[0]);
+    worker_loop(pair[1]);
+  }
+  close(pair[1]);
+
+  if (pool->count == pool->capacity)
+  {
+    pool->capacity = pool->capacity == 0 ? 16 : pool->capacity * 2;
+    pool->workers = realloc(pool->workers, pool->capacity * sizeof(pool_worker_t));
+  }
+  pool_worker_t *worker = &pool->workers[pool->count++];
+  worker->pid = pid;
+  worker->control_fd = pair[0];
+  worker->idle = 1;
+  pool->idle_count++;
+  return 0;
+}
+
+// Closing the control socket makes an idle worker exit
+static void remove_worker(agent_pool_t *pool, int index)
+{
+  pool_worker_t *worker = &pool->workers[index];
+  if (worker->idle)
+    pool->idle_count--;
+  close(worker->control_fd);
+  waitpid(worker->pid, NULL, 0);
+  pool->workers[index] = pool->workers[--pool->count];
+}
+
+static void handle_control(agent_pool_t *pool, int index)
+{
+  pool_worker_t *worker = &pool->workers[index];
+  char message;
+  if (read(worker->control_fd, &message, 1) != 1)
+  {
+    // The worker died, its agent was cleaned up or never will be
+    remove_worker(pool, index);
+    return;
+  }
+  if (message == POOL_IDLE && !worker->idle)
+  {
+    worker->idle = 1;
+    pool->idle_count++;
+    if (pool->idle_count > pool->max_idle)
+      remove_worker(pool, index);
+  }
+}
+
+static void dispatch(agent_pool_t *pool, int client_fd)
+{
+  int index = -1;
+  for (int i = pool->count - 1; i >= 0 && index == -1; i--)
+  {
+    if (pool->workers[i].idle)
+      index = i;
+  }
+  // A storm larger than the spare workers pays for the fork after all
+  if (index == -1)
+  {
+    if (spawn_worker(pool, client_fd) == -1)
+    {
+      close(client_fd);
+      return;
+    }
+    index = pool->count - 1;
+  }
+
+  pool_worker_t *worker = &pool->workers[index];
+  if (send_client(worker->control_fd, client_fd) == -1)
+  {
+    perror("pass client to agent");
+    remove_worker(pool, index);
+  }
+  else
+  {
+    worker->idle = 0;
+    pool->idle_count--;
+  }
+  close(client_fd);
+}
+
+void run_agent_pool(int listen_fd, int min_idle, int max_idle)
+{
+  agent_pool_t pool;
+  memset(&pool, 0, sizeof(pool));
+  pool.listen_fd = listen_fd;
+  pool.min_idle = min_idle;
+  pool.max_idle = max_idle < min_idle ? min_idle : max_idle;
+
+  struct pollfd *fds = NULL;
+  int fds_room = 0;
+  while (1)
+  {
+    if (fds_room < pool.count + 1)
+    {
+      fds_room = pool.capacity + 1;
+      fds = realloc(fds, fds_room * sizeof(struct pollfd));
+    }
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    for (int i = 0; i < pool.count; i++)
+    {
+      fds[i + 1].fd = pool.workers[i].control_fd;
+      fds[i + 1].events = POLLIN;
+    }
+    // Spare workers are only forked while no client is waiting
+    int refill = pool.idle_count < pool.min_idle;
+    int polled = pool.count;
+    int ready = poll(fds, polled + 1, refill ? 0 : -1);
+    if (ready == 0 && refill)
+      spawn_worker(&pool, -1);
+    if (ready <= 0)
+      continue;
+
+    // Back to front, removing a worker moves the last one into its place
+    for (int i = polled - 1; i >= 0; i--)
+    {
+      if (fds[i + 1].revents != 0)
+        handle_control(&pool, i);
+    }
+    if (fds[0].revents & POLLIN)
+    {
+      // Another acceptor sharing the socket may have taken the client
+      int client_fd = accept(listen_fd, NULL, NULL);
+      if (client_fd != -1)
+        dispatch(&pool, client_fd);
+      else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("accept");
+    }
+  }
+}
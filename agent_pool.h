@@ -0,0 +1,9 @@
+#ifndef AGENT_POOL_H
+#define AGENT_POOL_H
+
+// Accepts on listen_fd and passes each client to a pre-forked agent process.
+// min_idle agents are kept waiting, agents coming back from a client exit
+// while more than max_idle wait. Does not return.
+void run_agent_pool(int listen_fd, int min_idle, int max_idle);
+
+#endif // AGENT_POOL_H
@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include "arena.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ARENA_ALIGN 64
+#define ARENA_MAGIC 0x616e657261646d73ULL
+
+// File arenas are placed here when it is free, far from the heap and from the
+// shared libraries, so the next server finds the address free as well
+#define ARENA_FILE_ADDRESS ((void *)0x200000000000ULL)
+
+// The agents of a server that just stopped hold the file lock until they
+// end, which they do as soon as they hold no stripe
+#define ARENA_LOCK_WAIT_MS 2000
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+static size_t page_round(size_t bytes)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return (bytes + page - 1) / page * page;
+}
+
+static size_t align_round(size_t bytes)
+{
+  return (bytes + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+}
+
+// Sets up a new arena on fd, which must be empty
+static arena_t *arena_setup(int fd, void *address, size_t reserve, size_t initial)
+{
+  if (ftruncate(fd, initial) == -1)
+  {
+    perror("ftruncate");
+    close(fd);
+    return NULL;
+  }
+  arena_t *arena = MAP_FAILED;
+  if (address != NULL)
+    arena = mmap(address, reserve, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE | MAP_FIXED_NOREPLACE, fd, 0);
+  if (arena == MAP_FAILED)
+    arena = mmap(NULL, reserve, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+  if (arena == MAP_FAILED)
+  {
+    perror("mmap");
+    close(fd);
+    return NULL;
+  }
+
+  pthread_mutexattr_t mutexAttr;
+  pthread_mutexattr_init(&mutexAttr);
+  pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&arena->lock, &mutexAttr);
+  pthread_mutexattr_destroy(&mutexAttr);
+  arena->magic = ARENA_MAGIC;
+  arena->base = arena;
+  arena->fd = fd;
+  arena->reserved = reserve;
+  arena->carved = align_round(sizeof(arena_t));
+  arena->committed = initial;
+  return arena;
+}
+
+static void round_sizes(size_t *reserve, size_t *initial)
+{
+  *reserve = page_round(*reserve);
+  *initial = page_round(*initial < sizeof(arena_t) ? sizeof(arena_t) : *initial);
+  if (*initial > *reserve)
+    *reserve = *initial;
+}
+
+arena_t *arena_create(size_t reserve, size_t initial)
+{
+  round_sizes(&reserve, &initial);
+  int fd = memfd_create("supdemserv", MFD_CLOEXEC);
+  if (fd == -1)
+  {
+    perror("memfd_create");
+    return NULL;
+  }
+  return arena_setup(fd, NULL, reserve, initial);
+}
+
+// Maps the arena in fd at the address it was created at, NULL when the file
+// holds none of this size or the address is taken in this process
+static arena_t *arena_remap(int fd, size_t reserve)
+{
+  arena_t header;
+  struct stat st;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != ARENA_MAGIC ||
+      header.reserved != reserve || fstat(fd, &st) == -1 || (size_t)st.st_size < header.committed)
+    return NULL;
+  arena_t *arena = mmap(header.base, reserve, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE | MAP_FIXED_NOREPLACE,
+                        fd, 0);
+  // Kernels before 4.17 take the address as a hint only
+  if (arena != MAP_FAILED && arena != header.base)
+  {
+    munmap(arena, reserve);
+    arena = MAP_FAILED;
+  }
+  if (arena == MAP_FAILED)
+  {
+    fprintf(stderr, "Debug: the old address of the arena is taken, starting over\n");
+    return NULL;
+  }
+
+  // Whoever held the lock is gone
+  pthread_mutexattr_t mutexAttr;
+  pthread_mutexattr_init(&mutexAttr);
+  pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&arena->lock, &mutexAttr);
+  pthread_mutexattr_destroy(&mutexAttr);
+  arena->fd = fd;
+  return arena;
+}
+
+arena_t *arena_open(const char *path, size_t reserve, size_t initial, int *resumed)
+{
+  round_sizes(&reserve, &initial);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1)
+  {
+    perror(path);
+    return NULL;
+  }
+  // Forked agents share the lock through the descriptor, it is held until the
+  // last process of the server that has the file mapped exits
+  for (int waited = 0; flock(fd, LOCK_EX | LOCK_NB) == -1; waited += 10)
+  {
+    if (errno != EWOULDBLOCK || waited >= ARENA_LOCK_WAIT_MS)
+    {
+      fprintf(stderr, "%s: in use by a running server\n", path);
+      close(fd);
+      return NULL;
+    }
+    usleep(10 * 1000);
+  }
+  if (resumed != NULL)
+  {
+    arena_t *arena = arena_remap(fd, reserve);
+    *resumed = arena != NULL;
+    if (arena != NULL)
+      return arena;
+  }
+  if (ftruncate(fd, 0) == -1)
+  {
+    perror("ftruncate");
+    close(fd);
+    return NULL;
+  }
+  return arena_setup(fd, ARENA_FILE_ADDRESS, reserve, initial);
+}
+
+void arena_destroy(arena_t *arena)
+{
+  int fd = arena->fd;
+  pthread_mutex_destroy(&arena->lock);
+  munmap(arena, arena->reserved);
+  close(fd);
+}
+
+void *arena_first_slice(arena_t *arena)
+{
+  return (char *)arena + align_round(sizeof(arena_t));
+}
+
+void *arena_carve(arena_t *arena, size_t bytes)
+{
+  bytes = align_round(bytes);
+  if (bytes > arena->reserved - arena->carved)
+    return NULL;
+  void *slice = (char *)arena + arena->carved;
+  arena->carved += bytes;
+  return slice;
+}
+
+int arena_commit(arena_t *arena, const void *end)
+{
+  size_t size = page_round((size_t)((const char *)end - (const char *)arena));
+  if (size <= __atomic_load_n(&arena->committed, __ATOMIC_ACQUIRE))
+    return 0;
+  if (size > arena->reserved)
+    return -1;
+
+  int result = 0;
+  pthread_mutex_lock(&arena->lock);
+  // The file only ever grows, a smaller request that lost the race is a no-op
+  if (size > arena->committed)
+  {
+    if (ftruncate(arena->fd, size) == -1)
+      result = -1;
+    else
+      __atomic_store_n(&arena->committed, size, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&arena->lock);
+  return result;
+}
+
+void arena_release(arena_t *arena, void *start, size_t bytes)
+{
+  off_t offset = (char *)start - (char *)arena;
+  fallocate(arena->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, bytes);
+}
@@ -0,0 +1,51 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Shared memory backed by a memfd, or by a file for arena_open. The whole address range is reserved when
+// the arena is created and inherited by every forked agent, so growing only
+// extends the file: the mapping never moves and no process has to remap.
+// Pages past the committed size fault with SIGBUS, pages below it are only
+// backed by memory once touched.
+typedef struct
+{
+  uint64_t magic;       // ARENA_MAGIC, a file arena_open can map again
+  void *base;           // address the arena was created at, the pointers inside assume it
+  pthread_mutex_t lock; // process shared, serializes commits
+  int fd;
+  size_t reserved;  // bytes of address space mapped
+  size_t carved;    // bytes handed out by arena_carve
+  size_t committed; // file size
+} arena_t;
+
+// Maps reserve bytes and commits the first initial ones, the arena header
+// itself lives at the start of the mapping. Returns NULL on failure.
+arena_t *arena_create(size_t reserve, size_t initial);
+
+// Like arena_create, but backed by the file at path, which outlives the server.
+// When the file holds an arena of the same size that no running process has
+// mapped, it is mapped again at its old address and *resumed is set. Otherwise
+// the file, or with resumed NULL always, starts over as a new arena.
+arena_t *arena_open(const char *path, size_t reserve, size_t initial, int *resumed);
+
+void arena_destroy(arena_t *arena);
+
+// First slice arena_carve handed out, where an arena that was mapped again
+// keeps its own header
+void *arena_first_slice(arena_t *arena);
+
+// Cache line aligned slice of the reserved range, NULL once the range is used up.
+// Slices follow each other, committing the end of one commits all before it.
+// Only called while the layout is set up, before any agent is forked.
+void *arena_carve(arena_t *arena, size_t bytes);
+
+// Makes sure the file backs every byte below end, returns -1 if it cannot grow
+int arena_commit(arena_t *arena, const void *end);
+
+// Gives the memory behind a committed range back, it reads as zeros afterwards
+void arena_release(arena_t *arena, void *start, size_t bytes);
+
+#endif // ARENA_H
@@ -0,0 +1,80 @@
+#ifndef BINARY_PROTOCOL_H
+#define BINARY_PROTOCOL_H
+
+#include <stdint.h>
+
+// Framing of the binary protocol. A client switches its connection over by
+// sending the text command "binary", the "OK" reply is the last text it gets.
+// Every later byte in either direction belongs to a frame. Fields are in the
+// byte order of the server's machine.
+
+// Every frame starts with this header, length counts the whole frame
+typedef struct
+{
+  uint16_t length;
+  uint8_t op;    // a bin_op_t
+  uint8_t flags; // requests: BIN_FLAG_*, replies: a bin_status_t, events: the notification type
+} bin_header_t;
+
+// A request, args the client leaves out of a shorter frame are 0
+typedef struct
+{
+  bin_header_t header;
+  int32_t args[5];
+} bin_request_t;
+
+typedef enum
+{
+  BIN_MOVE = 1,     // x, y
+  BIN_DEMAND,       // nA, nB, nC
+  BIN_SUPPLY,       // distance, nA, nB, nC
+  BIN_WATCH,        // distance
+  BIN_UNWATCH,
+  BIN_MYDEMANDS,
+  BIN_MYSUPPLIES,
+  BIN_LISTDEMANDS,  // offset, limit (-1 or left out for the rest), or radius, x0, y0, x1, y1 with BIN_FLAG_NEAR/BOX
+  BIN_LISTSUPPLIES, // same as BIN_LISTDEMANDS
+  BIN_STATS,
+  BIN_BEGIN,        // BIN_FLAG_ATOMIC for begin atomic
+  BIN_COMMIT,
+  BIN_QUIT,
+  BIN_NOTIFICATION = 0x80 // event, not a reply to a request
+} bin_op_t;
+
+#define BIN_FLAG_ATOMIC 1
+#define BIN_FLAG_NEAR 1
+#define BIN_FLAG_BOX 2
+
+// A request gets one reply frame with the same op, except that BIN_BEGIN and
+// the requests of a batch are answered by its BIN_COMMIT, as in the text
+// protocol. Listings come as BIN_MORE frames of the text rows, followed by an
+// empty frame with the status.
+typedef enum
+{
+  BIN_OK,
+  BIN_FAILED,   // the command was valid but could not be carried out
+  BIN_INVALID,  // unknown op or bad arguments
+  BIN_REJECTED, // atomic batch rejected as a whole
+  BIN_MORE
+} bin_status_t;
+
+// Reply payloads:
+//   BIN_STATS   bin_stats_t
+//   BIN_COMMIT  one bin_status_t byte per command of the batch. A rejected
+//               atomic batch carries the int32 number of the invalid command
+//               instead, counted from 1, or nothing when it did not fit.
+// A BIN_NOTIFICATION event carries the notification_t payload of its type,
+// the int32 fields of demand_fulfilled_t, supply_delivered_t or
+// supply_added_t in declaration order, nothing for SUPPLY_REMOVED.
+
+typedef struct
+{
+  uint64_t dropped;
+  uint64_t spilled;
+  uint64_t blocked;
+  uint64_t server_dropped;
+  uint64_t server_spilled;
+  uint64_t server_blocked;
+} bin_stats_t;
+
+#endif // BINARY_PROTOCOL_H
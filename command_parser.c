@@ -0,0 +1,147 @@
+#include "command_parser.h"
+#include <string.h>
+#include <limits.h>
+
+typedef struct
+{
+  const char *name;
+  command_type_t type;
+  // Bit n of counts[word] is set when the command takes n numbers after word
+  unsigned char counts[4];
+  const char *error;
+} command_spec_t;
+
+#define COUNT(n) (1u << (n))
+
+// Slot of a command word is (first char + last char + 13 * length) & 31,
+// no two commands share one
+#define COMMAND_HASH(first, last, len) (((unsigned char)(first) + (unsigned char)(last) + 13 * (len)) & 31)
+
+static const command_spec_t command_table[32] = {
+    [0] = {"watch", CMD_WATCH, {COUNT(1)}, "Error: Invalid watch command\n"},
+    [2] = {"mysupplies", CMD_MYSUPPLIES, {COUNT(0)}, "Error: Invalid mysupplies command\n"},
+    [5] = {"commit", CMD_COMMIT, {COUNT(0)}, "Error: Invalid commit command\n"},
+    [6] = {"move", CMD_MOVE, {COUNT(2)}, "Error: Invalid move command\n"},
+    [7] = {"stats", CMD_STATS, {COUNT(0)}, "Error: Invalid stats command\n"},
+    [9] = {"binary", CMD_BINARY, {COUNT(0)}, "Error: Invalid binary command\n"},
+    [14] = {"listdemands", CMD_LISTDEMANDS, {COUNT(0) | COUNT(2), 0, COUNT(1) | COUNT(5), COUNT(4)}, "Error: Invalid listdemands command\n"},
+    [15] = {"snapshot", CMD_SNAPSHOT, {COUNT(0)}, "Error: Invalid snapshot command\n"},
+    [17] = {"begin", CMD_BEGIN, {COUNT(0), COUNT(0)}, "Error: Invalid begin command\n"},
+    [21] = {"mydemands", CMD_MYDEMANDS, {COUNT(0)}, "Error: Invalid mydemands command\n"},
+    [22] = {"demand", CMD_DEMAND, {COUNT(3)}, "Error: Invalid demand command\n"},
+    [24] = {"unwatch", CMD_UNWATCH, {COUNT(0)}, "Error: Invalid unwatch command\n"},
+    [25] = {"quit", CMD_QUIT, {COUNT(0)}, "Error: Invalid quit command\n"},
+    [26] = {"supply", CMD_SUPPLY, {COUNT(4)}, "Error: Invalid supply command\n"},
+    [27] = {"listsupplies", CMD_LISTSUPPLIES, {COUNT(0) | COUNT(2), 0, COUNT(1) | COUNT(5), COUNT(4)}, "Error: Invalid listsupplies command\n"},
+};
+
+// Not isspace(), which follows the locale
+static int is_blank(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+static const command_spec_t *lookup_command(const char *word, size_t len)
+{
+  const command_spec_t *spec = &command_table[COMMAND_HASH(word[0], word[len - 1], len)];
+  if (spec->name == NULL || strncmp(spec->name, word, len) != 0 || spec->name[len] != '\0')
+    return NULL;
+  return spec;
+}
+
+static command_word_t lookup_word(const char *word, size_t len)
+{
+  if (len == 6 && memcmp(word, "atomic", 6) == 0)
+    return CMD_WORD_ATOMIC;
+  if (len == 4 && memcmp(word, "near", 4) == 0)
+    return CMD_WORD_NEAR;
+  if (len == 2 && memcmp(word, "in", 2) == 0)
+    return CMD_WORD_IN;
+  return CMD_WORD_NONE;
+}
+
+// Reads the int at *p up to the next blank, -1 on anything else or overflow
+static int parse_int(const char **p, const char *end, int *value)
+{
+  const char *s = *p;
+  int negative = 0;
+  if (*s == '-' || *s == '+')
+    negative = *s++ == '-';
+  if (s == end || *s < '0' || *s > '9')
+    return -1;
+  long long v = 0;
+  while (s < end && *s >= '0' && *s <= '9')
+  {
+    v = v * 10 + (*s++ - '0');
+    if (v > (long long)INT_MAX + 1)
+      return -1;
+  }
+  if (s < end && !is_blank(*s))
+    return -1;
+  if (negative)
+    v = -v;
+  if (v > INT_MAX)
+    return -1;
+  *value = (int)v;
+  *p = s;
+  return 0;
+}
+
+void parse_command(const char *line, size_t len, command_t *cmd)
+{
+  const char *p = line;
+  const char *end = line + len;
+  cmd->valid = 0;
+  cmd->word = CMD_WORD_NONE;
+  cmd->argc = 0;
+
+  while (p < end && is_blank(*p))
+    p++;
+  const char *name = p;
+  while (p < end && !is_blank(*p))
+    p++;
+  if (p == name)
+  {
+    cmd->type = CMD_BLANK;
+    return;
+  }
+  const command_spec_t *spec = lookup_command(name, p - name);
+  if (spec == NULL)
+  {
+    cmd->type = CMD_UNKNOWN;
+    return;
+  }
+  cmd->type = spec->type;
+
+  while (1)
+  {
+    while (p < end && is_blank(*p))
+      p++;
+    if (p == end)
+      break;
+    if (cmd->argc == 0 && cmd->word == CMD_WORD_NONE && *p >= 'a' && *p <= 'z')
+    {
+      const char *word = p;
+      while (p < end && !is_blank(*p))
+        p++;
+      cmd->word = lookup_word(word, p - word);
+      if (cmd->word == CMD_WORD_NONE)
+        return;
+      continue;
+    }
+    if (cmd->argc == COMMAND_MAX_ARGS || parse_int(&p, end, &cmd->args[cmd->argc]) == -1)
+      return;
+    cmd->argc++;
+  }
+  cmd->valid = (spec->counts[cmd->word] & COUNT(cmd->argc)) != 0;
+}
+
+const char *command_error(command_type_t type)
+{
+  for (size_t i = 0; i < sizeof(command_table) / sizeof(command_table[0]); i++)
+  {
+    if (command_table[i].name != NULL && command_table[i].type == type)
+      return command_table[i].error;
+  }
+  return "Error: Unknown command\n";
+}
@@ -0,0 +1,56 @@
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+#include <stddef.h>
+
+#define COMMAND_MAX_ARGS 5
+
+typedef enum
+{
+  CMD_BLANK, // nothing but whitespace
+  CMD_UNKNOWN,
+  CMD_MOVE,
+  CMD_DEMAND,
+  CMD_SUPPLY,
+  CMD_WATCH,
+  CMD_UNWATCH,
+  CMD_MYDEMANDS,
+  CMD_MYSUPPLIES,
+  CMD_LISTDEMANDS,
+  CMD_LISTSUPPLIES,
+  CMD_STATS,
+  CMD_BEGIN,
+  CMD_COMMIT,
+  CMD_BINARY,
+  CMD_SNAPSHOT,
+  CMD_QUIT
+} command_type_t;
+
+// Word some commands take in front of their numbers
+typedef enum
+{
+  CMD_WORD_NONE,
+  CMD_WORD_ATOMIC, // begin atomic
+  CMD_WORD_NEAR,   // list... near R [x0 y0 x1 y1]
+  CMD_WORD_IN      // list... in x0 y0 x1 y1
+} command_word_t;
+
+typedef struct
+{
+  command_type_t type;
+  int valid; // 0 when the arguments do not fit the command
+  command_word_t word;
+  int argc;
+  int args[COMMAND_MAX_ARGS];
+} command_t;
+
+// Parses one line without its newline in a single pass. The command word is
+// looked up with a perfect hash, numbers are decimal ints with an optional
+// sign and must be separated by whitespace. Anything else makes the command
+// invalid.
+void parse_command(const char *line, size_t len, command_t *cmd);
+
+// "Error: Invalid <command> command\n" for a command that was not valid
+const char *command_error(command_type_t type);
+
+#endif // COMMAND_PARSER_H
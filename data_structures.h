@@ -2,12 +2,22 @@
 #define DATA_STRUCTURES_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include <time.h>
 
-#define MAX_DEMANDS 10000
-#define MAX_SUPPLIES 10000
-#define MAX_AGENTS 1000
-#define MAX_NOTIFICATIONS 1000
+// The tables start at the initial sizes and double when full, up to the
+// limits. Address space for the limits is reserved up front, memory is only
+// used for what the tables grew to.
+#define INITIAL_DEMANDS 1024
+#define INITIAL_SUPPLIES 1024
+#define INITIAL_AGENTS 64
+#define DEMAND_LIMIT (1 << 20)
+#define SUPPLY_LIMIT (1 << 20)
+#define AGENT_LIMIT (1 << 14)
+#define NOTIFICATION_RING_BYTES 65536 // per connected agent, a power of two
+#define GRID_MAX_DIM 64
+#define GRID_RADIUS_BUCKETS 32
+#define MAX_LOCK_STRIPES 64
 
 typedef struct
 {
@@ -17,6 +27,8 @@ typedef struct
   int nA;
   int nB;
   int nC;
+  int owner_next; // next demand of the same agent, -1 at the end
+  int owner_prev;
 } demand_t;
 
 typedef struct
@@ -28,8 +40,40 @@ typedef struct
   int nB;
   int nC;
   int distance;
+  int owner_next; // next supply of the same agent, -1 at the end
+  int owner_prev;
 } supply_t;
 
+typedef struct
+{
+  int head;
+  int count;
+} owner_list_t;
+
+// Column copies of the demand and supply tables for the batch match kernels.
+// Table capacities are whole bitmap words so a kernel may always read 64
+// slots at once.
+typedef struct
+{
+  int *agent_id;
+  int *x;
+  int *y;
+  int *nA;
+  int *nB;
+  int *nC;
+} demand_columns_t;
+
+typedef struct
+{
+  int *agent_id;
+  int *x;
+  int *y;
+  int *nA;
+  int *nB;
+  int *nC;
+  int *distance;
+} supply_columns_t;
+
 typedef struct
 {
   int agent_id;
@@ -38,6 +82,74 @@ typedef struct
   int distance;
 } watch_t;
 
+typedef enum
+{
+  SLOT_ALLOC_LOWEST,
+  SLOT_ALLOC_FREELIST
+} slot_alloc_policy_t;
+
+typedef struct
+{
+  int capacity;
+  int limit; // capacity the arrays below have room for
+  int live;
+  slot_alloc_policy_t policy;
+  int free_top;
+  uint64_t *used;
+  uint64_t *nonempty; // bit w set when used[w] has a live slot
+  uint64_t *notfull;  // bit w set when used[w] has a free slot
+  int *free_stack;
+} slot_table_t;
+
+// Writers of a table bracket every change with writers++ ... version++, writers--
+// so list readers can copy the table without locks and detect interference
+typedef struct
+{
+  unsigned long version;
+  int writers;
+} table_seq_t;
+
+typedef struct
+{
+  int next;
+  int prev;
+  int cell;
+  int radius;
+} grid_link_t;
+
+typedef struct
+{
+  int head;
+  int count;
+  int max_radius;
+} grid_cell_t;
+
+typedef struct
+{
+  int min_x;
+  int min_y;
+  int cols;
+  int rows;
+  int cell_w;
+  int cell_h;
+  int radius_count[GRID_RADIUS_BUCKETS];
+  grid_cell_t cells[GRID_MAX_DIM * GRID_MAX_DIM];
+} spatial_grid_t;
+
+typedef enum
+{
+  MATCH_KERNEL_AUTO,
+  MATCH_KERNEL_SCALAR,
+  MATCH_KERNEL_AVX2
+} match_kernel_t;
+
+typedef enum
+{
+  MATCH_INDEX_GRID,
+  MATCH_INDEX_SCAN,
+  MATCH_INDEX_VERIFY
+} match_index_mode_t;
+
 typedef enum
 {
   DEMAND_FULFILLED,
@@ -46,12 +158,9 @@ typedef enum
   SUPPLY_ADDED
 } notification_type_t;
 
+// Payloads carry only what the message of their type prints
 typedef struct
 {
-  notification_type_t type;
-  int agent_id;
-  int demand_id;
-  int supply_id;
   int demandX;
   int demandY;
   int demandA;
@@ -59,32 +168,152 @@ typedef struct
   int demandC;
   int supplyX;
   int supplyY;
+} demand_fulfilled_t;
+
+typedef struct
+{
+  int supplyX;
+  int supplyY;
   int supplyA;
   int supplyB;
   int supplyC;
   int supplyDistance;
-  time_t timestamp;
+  int demandX;
+  int demandY;
+  int demandA;
+  int demandB;
+  int demandC;
+} supply_delivered_t;
+
+typedef struct
+{
+  int supplyX;
+  int supplyY;
+  int supplyA;
+  int supplyB;
+  int supplyC;
+} supply_added_t;
+
+// A notification as producers hand it over and as it sits in a spill chunk
+typedef struct
+{
+  notification_type_t type;
+  union
+  {
+    demand_fulfilled_t fulfilled;
+    supply_delivered_t delivered;
+    supply_added_t added;
+  };
 } notification_t;
 
+// What a producer does when the watcher's ring has no room left
+typedef enum
+{
+  NOTIFY_OVERFLOW_DROP_OLDEST, // evict the oldest records until the new one fits
+  NOTIFY_OVERFLOW_BLOCK,       // wait for the agent to drain, drop after NOTIFY_BLOCK_MS
+  NOTIFY_OVERFLOW_SPILL        // queue behind the ring in shared spill chunks
+} notify_overflow_t;
+
+#define NOTIFY_BLOCK_MS 1000
+#define SPILL_CHUNK_RECORDS 84
+#define SPILL_CHUNK_LIMIT 16384 // shared by all agents
+#define SPILL_AGENT_CHUNKS 256  // most one agent may hold
+
 typedef struct
 {
-  notification_t notifications[MAX_NOTIFICATIONS];
-  int head;
-  int tail;
-  pthread_mutex_t mutex;
+  int next; // next chunk of the same list, -1 at the end
+  int count;
+  notification_t records[SPILL_CHUNK_RECORDS];
+} spill_chunk_t;
+
+// What the agent consuming a queue is doing, producers only make a wakeup
+// syscall for an agent that is about to sleep or sleeping
+typedef enum
+{
+  NOTIFY_AWAKE,
+  NOTIFY_WAIT_FUTEX,  // sleeps on the futex at waiting
+  NOTIFY_WAIT_FD,     // polls its wakeup socket
+  NOTIFY_INTERRUPTED  // stopped waiting for good
+} notify_wait_t;
+
+// Multi-producer, single-consumer ring. Producers reserve a record by moving
+// tail with a compare and swap, write it and publish it by storing its header
+// last. The header is the record's position plus one, shifted left by 8 and
+// or'ed with its type, so a header from an earlier lap never looks published.
+// Records start 8 byte aligned, the payload may continue at the start of the
+// ring. The consumer, or a producer evicting the oldest record, takes records
+// by moving head with a compare and swap.
+typedef struct
+{
+  int ring;                   // index into notification_rings, -1 when detached
+  int writers;                // producers using the ring, detaching waits for 0
+  int waiting;                // notify_wait_t, a futex word
+  unsigned long long head;    // bytes taken since the ring was attached
+  unsigned long long tail;    // bytes reserved since the ring was attached
+  unsigned long dropped;      // notifications lost to a full ring
+  unsigned long spilled;      // notifications that went to spill chunks
+  unsigned long blocked;      // times a producer had to wait for room
+  int spilling;               // spill chunks hold records, newer ones go there too
+  int spill_first;            // spill list, oldest chunk first
+  int spill_last;
+  int spill_chunks;
+  pthread_mutex_t mutex;      // spill list
 } notification_queue_t;
 
+// Lock order: stripe_locks in ascending order, then agent_state_lock, then the
+// leaf locks (slot_mutex, owner_locks, notification queues).
+// spill_mutex is taken last of the leaf locks.
+// agent_table_mutex is only taken without other locks. The arena lock is
+// taken last, when a table grows or a ring or spill chunk is first used.
+//
+// The tables are arrays in the shared arena, reserved for their limits and
+// grown in place, so the pointers below stay valid in every agent.
 typedef struct
 {
-  pthread_mutex_t mutex;
-  demand_t demands[MAX_DEMANDS];
-  supply_t supplies[MAX_SUPPLIES];
-  watch_t watches[MAX_AGENTS];
-  pthread_mutex_t agent_mutexes[MAX_AGENTS];
-  pthread_cond_t agent_conds[MAX_AGENTS];
-  int next_agent_id;
-  int agent_positions[MAX_AGENTS][2];
-  notification_queue_t notification_queue[MAX_AGENTS];
+  uint64_t layout; // fingerprint of the server that set the segment up, stored last
+  int map_width;
+  int map_height;
+  pthread_mutex_t stripe_locks[MAX_LOCK_STRIPES]; // stripe k guards band k of both grids
+  int lock_stripes;
+  pthread_mutex_t slot_mutex;        // both slot tables
+  pthread_mutex_t *owner_locks;      // owner lists and quantities of the agent's records
+  pthread_rwlock_t agent_state_lock; // watches and agent_positions
+  demand_t *demands;
+  slot_table_t demand_slots;
+  demand_columns_t demand_cols;
+  spatial_grid_t demand_grid;
+  grid_link_t *demand_links;
+  table_seq_t demand_seq;
+  supply_t *supplies;
+  slot_table_t supply_slots;
+  supply_columns_t supply_cols;
+  spatial_grid_t supply_grid;
+  grid_link_t *supply_links;
+  table_seq_t supply_seq;
+  pthread_mutex_t agent_table_mutex; // growing the agent entries
+  int agent_capacity;                // ids below it have their agent entries set up
+  watch_t *watches;
+  spatial_grid_t watch_grid; // watches by center and distance, indexed by agent id
+  grid_link_t *watch_links;
+  int next_agent_id;             // ids below it were handed out at least once
+  int *free_agent_ids;           // given back by cleanup_agent, under agent_table_mutex
+  int free_agent_id_count;
+  unsigned long retired_dropped; // overflow counters of the agents that gave their ids back
+  unsigned long retired_spilled;
+  unsigned long retired_blocked;
+  int server_pid; // names the agents' wakeup sockets
+  int (*agent_positions)[2];
+  owner_list_t *agent_demands;
+  owner_list_t *agent_supplies;
+  notification_queue_t *notification_queue;
+  unsigned char *notification_rings; // NOTIFICATION_RING_BYTES each, carved last
+  int *free_rings;                   // detached rings, under agent_table_mutex
+  int free_ring_count;
+  int rings_created;
+  spill_chunk_t *spill_chunks;
+  pthread_mutex_t spill_mutex; // spill chunk pool
+  int free_spill_chunk;        // list of unused chunks, -1 when empty
+  int spill_chunks_created;
 } shared_data_t;
 
 #endif // DATA_STRUCTURES_H
@@ -0,0 +1,510 @@
+#define _GNU_SOURCE
+#include "io_ring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#ifdef IORING_RECV_MULTISHOT
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define RING_ENTRIES 16
+#define RECV_BUFFERS 16 // a power of two
+#define RECV_BUFFER_SIZE 4096
+#define RING_SOURCES 2
+#define SEND_LIMIT (256 * 1024) // queued bytes before a write waits for the send in flight
+#define SEND_TAG UINT64_MAX     // user_data of sends, receives carry their source index
+
+typedef struct
+{
+  int fd;
+  int tag;
+  int armed;  // a receive request is in the kernel
+  int closed; // ended with end of file or an error, not armed again
+  int received;
+} ring_source_t;
+
+struct io_ring
+{
+  int fd;
+  int out_fd;
+  unsigned sq_entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *ring_map;
+  size_t ring_map_size;
+  size_t sqes_size;
+  unsigned to_submit;
+  int multishot; // cleared when the kernel refuses multishot receives
+
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  unsigned short buf_tail;
+  char *buffers;
+  unsigned short lent[RECV_BUFFERS]; // handed out with events, given back on the next wait
+  int lent_count;
+
+  ring_source_t sources[RING_SOURCES];
+  int source_count;
+  io_ring_event_t *backlog; // events that came in while a write waited for its send
+  int backlog_count;
+  int backlog_size;
+
+  char *pending; // queued by io_ring_write
+  size_t pending_used;
+  size_t pending_size;
+  char *sending; // in the kernel while in_flight
+  size_t sending_len;
+  size_t sent;
+  size_t sending_size;
+  int in_flight;
+  int send_failed; // the client is gone, later writes are dropped
+};
+
+static struct io_uring_sqe *get_sqe(io_ring_t *ring);
+
+static int enter(io_ring_t *ring, unsigned wait)
+{
+  int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if (ret >= 0)
+  {
+    ring->to_submit -= ret;
+    return 0;
+  }
+  // Interrupted, or the completion queue needs reaping first
+  return errno == EINTR || errno == EAGAIN || errno == EBUSY ? 0 : -1;
+}
+
+static struct io_uring_sqe *get_sqe(io_ring_t *ring)
+{
+  unsigned tail = *ring->sq_tail;
+  while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+  {
+    if (enter(ring, 0) == -1)
+      return NULL;
+  }
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  return sqe;
+}
+
+static void push_sqe(io_ring_t *ring)
+{
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+  ring->to_submit++;
+}
+
+static int next_cqe(io_ring_t *ring, struct io_uring_cqe *cqe)
+{
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+  *cqe = ring->cqes[head & *ring->cq_mask];
+  __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// Hands a receive buffer back to the kernel. Only addr, len and bid are set,
+// the resv field of the first entry is the ring's tail.
+static void provide_buffer(io_ring_t *ring, unsigned short bid)
+{
+  struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (RECV_BUFFERS - 1)];
+  buf->addr = (uintptr_t)(ring->buffers + (size_t)bid * RECV_BUFFER_SIZE);
+  buf->len = RECV_BUFFER_SIZE;
+  buf->bid = bid;
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void arm_recv(io_ring_t *ring, int index)
+{
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  if (sqe == NULL)
+    return;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = ring->sources[index].fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->ioprio = ring->multishot ? IORING_RECV_MULTISHOT : 0;
+  sqe->user_data = index;
+  push_sqe(ring);
+  ring->sources[index].armed = 1;
+}
+
+static void arm_sources(io_ring_t *ring)
+{
+  for (int i = 0; i < ring->source_count; i++)
+  {
+    if (!ring->sources[i].armed && !ring->sources[i].closed)
+      arm_recv(ring, i);
+  }
+}
+
+static void submit_send(io_ring_t *ring)
+{
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  if (sqe == NULL)
+  {
+    ring->send_failed = 1;
+    return;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = ring->out_fd;
+  sqe->addr = (uintptr_t)(ring->sending + ring->sent);
+  sqe->len = ring->sending_len - ring->sent;
+  // Kernels with multishot receives also retry stream sends until done
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  sqe->user_data = SEND_TAG;
+  push_sqe(ring);
+  ring->in_flight = 1;
+}
+
+// The queued bytes become the send in flight, the queue gets the other buffer
+static void start_send(io_ring_t *ring)
+{
+  if (ring->in_flight || ring->pending_used == 0)
+    return;
+  char *data = ring->sending;
+  size_t size = ring->sending_size;
+  ring->sending = ring->pending;
+  ring->sending_size = ring->pending_size;
+  ring->sending_len = ring->pending_used;
+  ring->sent = 0;
+  ring->pending = data;
+  ring->pending_size = size;
+  ring->pending_used = 0;
+  submit_send(ring);
+}
+
+static void finish_send(io_ring_t *ring, int result)
+{
+  ring->in_flight = 0;
+  if (result < 0 && result != -EINTR)
+  {
+    // The client is gone, the agent notices on its next receive
+    ring->send_failed = 1;
+    ring->pending_used = 0;
+    return;
+  }
+  if (result > 0)
+    ring->sent += result;
+  if (ring->sent < ring->sending_len)
+    submit_send(ring);
+}
+
+// Returns 1 and fills event when the completion is one for the caller
+static int handle_cqe(io_ring_t *ring, struct io_uring_cqe *cqe, io_ring_event_t *event)
+{
+  if (cqe->user_data == SEND_TAG)
+  {
+    finish_send(ring, cqe->res);
+    return 0;
+  }
+
+  ring_source_t *source = &ring->sources[cqe->user_data];
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    source->armed = 0;
+  if (cqe->res == -EINVAL && ring->multishot && !source->received)
+  {
+    // Kernel without multishot receives, every receive is armed again
+    ring->multishot = 0;
+    return 0;
+  }
+  if (cqe->res == -ENOBUFS)
+    return 0; // armed again once the caller gave buffers back
+
+  event->tag = source->tag;
+  event->result = cqe->res;
+  event->data = NULL;
+  event->buffer = -1;
+  if (cqe->flags & IORING_CQE_F_BUFFER)
+  {
+    event->buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    event->data = ring->buffers + (size_t)event->buffer * RECV_BUFFER_SIZE;
+  }
+  if (cqe->res > 0)
+    source->received = 1;
+  else
+    source->closed = 1;
+  return 1;
+}
+
+// Waits for the send in flight to complete, completions for the caller are
+// kept until the next io_ring_wait
+static void wait_for_send(io_ring_t *ring)
+{
+  while (ring->in_flight && !ring->send_failed)
+  {
+    struct io_uring_cqe cqe;
+    if (!next_cqe(ring, &cqe))
+    {
+      if (enter(ring, 1) == -1)
+        ring->send_failed = 1;
+      continue;
+    }
+    if (ring->backlog_count == ring->backlog_size)
+    {
+      ring->backlog_size = ring->backlog_size == 0 ? RECV_BUFFERS : ring->backlog_size * 2;
+      ring->backlog = realloc(ring->backlog, ring->backlog_size * sizeof(io_ring_event_t));
+    }
+    if (handle_cqe(ring, &cqe, &ring->backlog[ring->backlog_count]))
+      ring->backlog_count++;
+  }
+}
+
+int io_ring_supported()
+{
+  io_ring_t *ring = io_ring_create(-1);
+  if (ring == NULL)
+    return 0;
+  io_ring_destroy(ring);
+  return 1;
+}
+
+io_ring_t *io_ring_create(int out_fd)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+  if (fd == -1)
+    return NULL;
+  // Older kernels map the rings separately or may drop completions
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+  {
+    close(fd);
+    errno = ENOSYS;
+    return NULL;
+  }
+
+  io_ring_t *ring = calloc(1, sizeof(io_ring_t));
+  ring->fd = fd;
+  ring->out_fd = out_fd;
+  ring->multishot = 1;
+  ring->ring_map = MAP_FAILED;
+  ring->sqes = MAP_FAILED;
+  ring->buf_ring = MAP_FAILED;
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_map_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->ring_map = mmap(NULL, ring->ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                        IORING_OFF_SQ_RING);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  // The buffer ring is page aligned memory of our own, registered with the kernel
+  ring->buf_ring_size = RECV_BUFFERS * sizeof(struct io_uring_buf);
+  ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->ring_map == MAP_FAILED || ring->sqes == MAP_FAILED || ring->buf_ring == MAP_FAILED)
+  {
+    io_ring_destroy(ring);
+    return NULL;
+  }
+
+  char *map = ring->ring_map;
+  ring->sq_entries = params.sq_entries;
+  ring->sq_head = (unsigned *)(map + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(map + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(map + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(map + params.sq_off.array);
+  ring->cq_head = (unsigned *)(map + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(map + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(map + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(map + params.cq_off.cqes);
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)ring->buf_ring;
+  reg.ring_entries = RECV_BUFFERS;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+  {
+    io_ring_destroy(ring);
+    return NULL;
+  }
+  ring->buffers = malloc(RECV_BUFFERS * RECV_BUFFER_SIZE);
+  for (int i = 0; i < RECV_BUFFERS; i++)
+  {
+    provide_buffer(ring, i);
+  }
+  return ring;
+}
+
+void io_ring_recv(io_ring_t *ring, int fd, int tag)
+{
+  if (ring->source_count == RING_SOURCES)
+    return;
+  ring_source_t *source = &ring->sources[ring->source_count++];
+  source->fd = fd;
+  source->tag = tag;
+}
+
+void io_ring_write(io_ring_t *ring, const char *data, size_t len)
+{
+  if (len == 0 || ring->send_failed)
+    return;
+  while (ring->in_flight && !ring->send_failed && ring->pending_used + len > SEND_LIMIT)
+  {
+    wait_for_send(ring);
+    start_send(ring);
+  }
+  if (ring->send_failed)
+    return;
+  if (ring->pending_used + len > ring->pending_size)
+  {
+    size_t size = ring->pending_size == 0 ? RECV_BUFFER_SIZE : ring->pending_size;
+    while (size < ring->pending_used + len)
+    {
+      size *= 2;
+    }
+    ring->pending = realloc(ring->pending, size);
+    ring->pending_size = size;
+  }
+  memcpy(ring->pending + ring->pending_used, data, len);
+  ring->pending_used += len;
+}
+
+int io_ring_wait(io_ring_t *ring, io_ring_event_t *events, int max)
+{
+  // The caller is done with the events of the previous wait
+  for (int i = 0; i < ring->lent_count; i++)
+  {
+    provide_buffer(ring, ring->lent[i]);
+  }
+  ring->lent_count = 0;
+  start_send(ring);
+
+  int count = 0;
+  while (count == 0)
+  {
+    int taken = 0;
+    while (taken < ring->backlog_count && count < max)
+    {
+      events[count++] = ring->backlog[taken++];
+    }
+    ring->backlog_count -= taken;
+    memmove(ring->backlog, ring->backlog + taken, ring->backlog_count * sizeof(io_ring_event_t));
+
+    struct io_uring_cqe cqe;
+    while (count < max && next_cqe(ring, &cqe))
+    {
+      if (handle_cqe(ring, &cqe, &events[count]))
+        count++;
+    }
+    // A request ended by a full buffer ring or a refused multishot goes back
+    // in with the next submission, buffers of earlier events are back by now
+    if (ring->backlog_count == 0)
+      arm_sources(ring);
+
+    // Sends and receives staged by the caller go in with the wait itself. A
+    // send that completes whole with nothing queued behind it needs no action,
+    // so its completion is waited for together with the next event.
+    unsigned wait = 1;
+    if (count > 0)
+      wait = 0;
+    else if (ring->in_flight && ring->pending_used == 0 && ring->multishot)
+      wait = 2;
+    if ((wait > 0 || ring->to_submit > 0) && enter(ring, wait) == -1)
+      return -1;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    if (events[i].buffer != -1)
+      ring->lent[ring->lent_count++] = events[i].buffer;
+  }
+  return count;
+}
+
+void io_ring_flush(io_ring_t *ring)
+{
+  start_send(ring);
+  while (ring->in_flight && !ring->send_failed)
+  {
+    wait_for_send(ring);
+    start_send(ring);
+  }
+}
+
+void io_ring_destroy(io_ring_t *ring)
+{
+  // Closing the ring cancels the receives still armed
+  close(ring->fd);
+  if (ring->ring_map != MAP_FAILED)
+    munmap(ring->ring_map, ring->ring_map_size);
+  if (ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->buf_ring != MAP_FAILED)
+    munmap(ring->buf_ring, ring->buf_ring_size);
+  free(ring->buffers);
+  free(ring->backlog);
+  free(ring->pending);
+  free(ring->sending);
+  free(ring);
+}
+
+#else // no io_uring headers, agents use the epoll loop
+
+int io_ring_supported()
+{
+  return 0;
+}
+
+io_ring_t *io_ring_create(int out_fd)
+{
+  (void)out_fd;
+  errno = ENOSYS;
+  return NULL;
+}
+
+void io_ring_recv(io_ring_t *ring, int fd, int tag)
+{
+  (void)ring;
+  (void)fd;
+  (void)tag;
+}
+
+void io_ring_write(io_ring_t *ring, const char *data, size_t len)
+{
+  (void)ring;
+  (void)data;
+  (void)len;
+}
+
+int io_ring_wait(io_ring_t *ring, io_ring_event_t *events, int max)
+{
+  (void)ring;
+  (void)events;
+  (void)max;
+  return -1;
+}
+
+void io_ring_flush(io_ring_t *ring)
+{
+  (void)ring;
+}
+
+void io_ring_destroy(io_ring_t *ring)
+{
+  (void)ring;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stddef.h>
+
+// An io_uring serving one connection, set up with the raw system calls.
+// Sockets are received with multishot requests into buffers the kernel picks
+// from a registered ring, writes collect in a queue that goes out as one send
+// with the next submission.
+typedef struct io_ring io_ring_t;
+
+typedef struct
+{
+  int tag;          // of the socket the event is for
+  int result;       // bytes received, 0 at end of file, -errno on error
+  const char *data; // received bytes, valid until the next io_ring_wait
+  int buffer;       // receive buffer holding data, -1 if none
+} io_ring_event_t;
+
+// 1 when this kernel has everything io_ring_create needs
+int io_ring_supported();
+
+// Ring whose writes go to out_fd, NULL when io_uring is unavailable
+io_ring_t *io_ring_create(int out_fd);
+
+// Keeps receiving from fd, events carry tag, until it is closed or fails
+void io_ring_recv(io_ring_t *ring, int fd, int tag);
+
+// Queues bytes for out_fd. Waits for the send in flight when a lot is queued
+// already, as a blocking write would for a client that does not read.
+void io_ring_write(io_ring_t *ring, const char *data, size_t len);
+
+// Submits what was queued and waits for at least one event. Returns the
+// number of events, -1 on error.
+int io_ring_wait(io_ring_t *ring, io_ring_event_t *events, int max);
+
+// Waits until everything queued was sent or the client is gone
+void io_ring_flush(io_ring_t *ring);
+
+void io_ring_destroy(io_ring_t *ring);
+
+#endif // IO_RING_H
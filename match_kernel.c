@@ -0,0 +1,154 @@
+#include "match_kernel.h"
+#include "slot_table.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <immintrin.h>
+
+// Both kernels test the same five predicates as check_case, for the 64 slots
+// of one bitmap word, and return a bit mask of the slots that pass
+typedef uint64_t (*supply_word_fn)(const supply_columns_t *cols, int base, const demand_t *demand);
+typedef uint64_t (*demand_word_fn)(const demand_columns_t *cols, int base, const supply_t *supply);
+
+static uint64_t supply_word_scalar(const supply_columns_t *cols, int base, const demand_t *demand)
+{
+  uint64_t mask = 0;
+  for (int k = 0; k < 64; k++)
+  {
+    int i = base + k;
+    int pass = (cols->distance[i] > abs(demand->x - cols->x[i]) + abs(demand->y - cols->y[i])) &
+               (demand->nA <= cols->nA[i]) &
+               (demand->nB <= cols->nB[i]) &
+               (demand->nC <= cols->nC[i]) &
+               (cols->agent_id[i] != demand->agent_id);
+    mask |= (uint64_t)pass << k;
+  }
+  return mask;
+}
+
+static uint64_t demand_word_scalar(const demand_columns_t *cols, int base, const supply_t *supply)
+{
+  uint64_t mask = 0;
+  for (int k = 0; k < 64; k++)
+  {
+    int i = base + k;
+    int pass = (supply->distance > abs(cols->x[i] - supply->x) + abs(cols->y[i] - supply->y)) &
+               (cols->nA[i] <= supply->nA) &
+               (cols->nB[i] <= supply->nB) &
+               (cols->nC[i] <= supply->nC) &
+               (supply->agent_id != cols->agent_id[i]);
+    mask |= (uint64_t)pass << k;
+  }
+  return mask;
+}
+
+#define LOAD8(column, i) _mm256_loadu_si256((const __m256i *)&(column)[i])
+
+__attribute__((target("avx2"))) static uint64_t supply_word_avx2(const supply_columns_t *cols, int base, const demand_t *demand)
+{
+  const __m256i dx = _mm256_set1_epi32(demand->x);
+  const __m256i dy = _mm256_set1_epi32(demand->y);
+  const __m256i dA = _mm256_set1_epi32(demand->nA);
+  const __m256i dB = _mm256_set1_epi32(demand->nB);
+  const __m256i dC = _mm256_set1_epi32(demand->nC);
+  const __m256i owner = _mm256_set1_epi32(demand->agent_id);
+  uint64_t mask = 0;
+  for (int k = 0; k < 64; k += 8)
+  {
+    int i = base + k;
+    __m256i manhattan = _mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(dx, LOAD8(cols->x, i))),
+                                         _mm256_abs_epi32(_mm256_sub_epi32(dy, LOAD8(cols->y, i))));
+    __m256i pass = _mm256_cmpgt_epi32(LOAD8(cols->distance, i), manhattan);
+    // a <= b is the complement of a > b, collected as a fail mask
+    __m256i fail = _mm256_cmpgt_epi32(dA, LOAD8(cols->nA, i));
+    fail = _mm256_or_si256(fail, _mm256_cmpgt_epi32(dB, LOAD8(cols->nB, i)));
+    fail = _mm256_or_si256(fail, _mm256_cmpgt_epi32(dC, LOAD8(cols->nC, i)));
+    fail = _mm256_or_si256(fail, _mm256_cmpeq_epi32(owner, LOAD8(cols->agent_id, i)));
+    pass = _mm256_andnot_si256(fail, pass);
+    mask |= (uint64_t)(unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(pass)) << k;
+  }
+  return mask;
+}
+
+__attribute__((target("avx2"))) static uint64_t demand_word_avx2(const demand_columns_t *cols, int base, const supply_t *supply)
+{
+  const __m256i sx = _mm256_set1_epi32(supply->x);
+  const __m256i sy = _mm256_set1_epi32(supply->y);
+  const __m256i sA = _mm256_set1_epi32(supply->nA);
+  const __m256i sB = _mm256_set1_epi32(supply->nB);
+  const __m256i sC = _mm256_set1_epi32(supply->nC);
+  const __m256i distance = _mm256_set1_epi32(supply->distance);
+  const __m256i owner = _mm256_set1_epi32(supply->agent_id);
+  uint64_t mask = 0;
+  for (int k = 0; k < 64; k += 8)
+  {
+    int i = base + k;
+    __m256i manhattan = _mm256_add_epi32(_mm256_abs_epi32(_mm256_sub_epi32(LOAD8(cols->x, i), sx)),
+                                         _mm256_abs_epi32(_mm256_sub_epi32(LOAD8(cols->y, i), sy)));
+    __m256i pass = _mm256_cmpgt_epi32(distance, manhattan);
+    __m256i fail = _mm256_cmpgt_epi32(LOAD8(cols->nA, i), sA);
+    fail = _mm256_or_si256(fail, _mm256_cmpgt_epi32(LOAD8(cols->nB, i), sB));
+    fail = _mm256_or_si256(fail, _mm256_cmpgt_epi32(LOAD8(cols->nC, i), sC));
+    fail = _mm256_or_si256(fail, _mm256_cmpeq_epi32(owner, LOAD8(cols->agent_id, i)));
+    pass = _mm256_andnot_si256(fail, pass);
+    mask |= (uint64_t)(unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(pass)) << k;
+  }
+  return mask;
+}
+
+static supply_word_fn supply_word = supply_word_scalar;
+static demand_word_fn demand_word = demand_word_scalar;
+
+match_kernel_t match_kernel_select(match_kernel_t kernel)
+{
+  __builtin_cpu_init();
+  int has_avx2 = __builtin_cpu_supports("avx2");
+  if (kernel == MATCH_KERNEL_AUTO)
+    kernel = has_avx2 ? MATCH_KERNEL_AVX2 : MATCH_KERNEL_SCALAR;
+  if (kernel == MATCH_KERNEL_AVX2 && !has_avx2)
+  {
+    fprintf(stderr, "Debug: AVX2 not supported, using the scalar match kernel\n");
+    kernel = MATCH_KERNEL_SCALAR;
+  }
+
+  if (kernel == MATCH_KERNEL_AVX2)
+  {
+    supply_word = supply_word_avx2;
+    demand_word = demand_word_avx2;
+  }
+  else
+  {
+    supply_word = supply_word_scalar;
+    demand_word = demand_word_scalar;
+  }
+  return kernel;
+}
+
+// Only words holding a live slot are tested, and results are masked with the
+// occupancy bits so the first set bit is the same slot a scalar scan returns
+int kernel_first_supply(const supply_columns_t *cols, const slot_table_t *slots, const demand_t *demand)
+{
+  for (int i = slot_next(slots, 0); i != -1; i = slot_next(slots, (i | 63) + 1))
+  {
+    int w = i / 64;
+    uint64_t hits = supply_word(cols, w * 64, demand) & slots->used[w];
+    if (w == (slots->capacity - 1) / 64 && slots->capacity % 64 != 0)
+      hits &= ~(~0ULL << (slots->capacity % 64));
+    if (hits != 0)
+      return w * 64 + __builtin_ctzll(hits);
+  }
+  return -1;
+}
+
+int kernel_first_demand(const demand_columns_t *cols, const slot_table_t *slots, const supply_t *supply)
+{
+  for (int i = slot_next(slots, 0); i != -1; i = slot_next(slots, (i | 63) + 1))
+  {
+    int w = i / 64;
+    uint64_t hits = demand_word(cols, w * 64, supply) & slots->used[w];
+    if (w == (slots->capacity - 1) / 64 && slots->capacity % 64 != 0)
+      hits &= ~(~0ULL << (slots->capacity % 64));
+    if (hits != 0)
+      return w * 64 + __builtin_ctzll(hits);
+  }
+  return -1;
+}
@@ -0,0 +1,16 @@
+#ifndef MATCH_KERNEL_H
+#define MATCH_KERNEL_H
+
+#include "data_structures.h"
+
+// Picks the kernel used by the scans below, MATCH_KERNEL_AUTO checks the CPU.
+// Returns the kernel actually in use.
+match_kernel_t match_kernel_select(match_kernel_t kernel);
+
+// Lowest used supply slot that passes check_case for the demand, -1 if none
+int kernel_first_supply(const supply_columns_t *cols, const slot_table_t *slots, const demand_t *demand);
+
+// Lowest used demand slot the supply passes check_case for, -1 if none
+int kernel_first_demand(const demand_columns_t *cols, const slot_table_t *slots, const supply_t *supply);
+
+#endif // MATCH_KERNEL_H
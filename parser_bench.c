@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "command_parser.h"
+
+// Microbenchmark of parse_command against the parsing handle_command did
+// before it: trim_whitespace, a chain of strcmp/strncmp and sscanf. Both see
+// every line of the given scripts, copied into a read buffer first as the
+// agent has it.
+
+#define LINE_MAX_BYTES 1024
+
+static char *trim_whitespace(char *str)
+{
+  char *end;
+  while (isspace((unsigned char)*str))
+    str++;
+  if (*str == 0)
+    return str;
+  end = str + strlen(str) - 1;
+  while (end > str && isspace((unsigned char)*end))
+    end--;
+  *(end + 1) = '\0';
+  return str;
+}
+
+static void scan_listing(const char *params, command_t *cmd)
+{
+  char extra;
+  if (*params == '\0')
+  {
+    cmd->valid = 1;
+    return;
+  }
+  params++;
+  int *a = cmd->args;
+  if (strncmp(params, "near ", 5) == 0)
+  {
+    cmd->word = CMD_WORD_NEAR;
+    cmd->argc = sscanf(params + 5, "%d %d %d %d %d %c", &a[0], &a[1], &a[2], &a[3], &a[4], &extra);
+    cmd->valid = cmd->argc == 1 || cmd->argc == 5;
+  }
+  else if (strncmp(params, "in ", 3) == 0)
+  {
+    cmd->word = CMD_WORD_IN;
+    cmd->argc = sscanf(params + 3, "%d %d %d %d %c", &a[0], &a[1], &a[2], &a[3], &extra);
+    cmd->valid = cmd->argc == 4;
+  }
+  else
+  {
+    cmd->argc = sscanf(params, "%d %d %c", &a[0], &a[1], &extra);
+    cmd->valid = cmd->argc == 2;
+  }
+}
+
+static void legacy_parse(char *line, command_t *cmd)
+{
+  char *command = trim_whitespace(line);
+  int *a = cmd->args;
+  cmd->valid = 0;
+  cmd->word = CMD_WORD_NONE;
+  cmd->argc = 0;
+  if (*command == '\0')
+  {
+    cmd->type = CMD_BLANK;
+  }
+  else if (strcmp(command, "begin") == 0 || strcmp(command, "begin atomic") == 0)
+  {
+    cmd->type = CMD_BEGIN;
+    cmd->word = command[5] != '\0' ? CMD_WORD_ATOMIC : CMD_WORD_NONE;
+    cmd->valid = 1;
+  }
+  else if (strcmp(command, "commit") == 0)
+  {
+    cmd->type = CMD_COMMIT;
+    cmd->valid = 1;
+  }
+  else if (strncmp(command, "move ", 5) == 0)
+  {
+    cmd->type = CMD_MOVE;
+    cmd->argc = 2;
+    cmd->valid = sscanf(command + 5, "%d %d", &a[0], &a[1]) == 2;
+  }
+  else if (strncmp(command, "demand ", 7) == 0)
+  {
+    cmd->type = CMD_DEMAND;
+    cmd->argc = 3;
+    cmd->valid = sscanf(command + 7, "%d %d %d", &a[0], &a[1], &a[2]) == 3;
+  }
+  else if (strncmp(command, "supply ", 7) == 0)
+  {
+    cmd->type = CMD_SUPPLY;
+    cmd->argc = 4;
+    cmd->valid = sscanf(command + 7, "%d %d %d %d", &a[0], &a[1], &a[2], &a[3]) == 4;
+  }
+  else if (strncmp(command, "watch ", 6) == 0)
+  {
+    cmd->type = CMD_WATCH;
+    cmd->argc = 1;
+    cmd->valid = sscanf(command + 6, "%d", &a[0]) == 1;
+  }
+  else if (strcmp(command, "unwatch") == 0)
+  {
+    cmd->type = CMD_UNWATCH;
+    cmd->valid = 1;
+  }
+  else if (strcmp(command, "mydemands") == 0)
+  {
+    cmd->type = CMD_MYDEMANDS;
+    cmd->valid = 1;
+  }
+  else if (strcmp(command, "mysupplies") == 0)
+  {
+    cmd->type = CMD_MYSUPPLIES;
+    cmd->valid = 1;
+  }
+  else if (strcmp(command, "listdemands") == 0 || strncmp(command, "listdemands ", 12) == 0)
+  {
+    cmd->type = CMD_LISTDEMANDS;
+    scan_listing(command + 11, cmd);
+  }
+  else if (strcmp(command, "listsupplies") == 0 || strncmp(command, "listsupplies ", 13) == 0)
+  {
+    cmd->type = CMD_LISTSUPPLIES;
+    scan_listing(command + 12, cmd);
+  }
+  else if (strcmp(command, "stats") == 0)
+  {
+    cmd->type = CMD_STATS;
+    cmd->valid = 1;
+  }
+  else if (strcmp(command, "binary") == 0)
+  {
+    cmd->type = CMD_BINARY;
+    cmd->valid = 1;
+  }
+  else if (strcmp(command, "snapshot") == 0)
+  {
+    cmd->type = CMD_SNAPSHOT;
+    cmd->valid = 1;
+  }
+  else if (strcmp(command, "quit") == 0)
+  {
+    cmd->type = CMD_QUIT;
+    cmd->valid = 1;
+  }
+  else
+  {
+    cmd->type = CMD_UNKNOWN;
+  }
+}
+
+static double seconds_since(const struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+  int rounds = 200000;
+  int first = 1;
+  if (argc > 2 && strcmp(argv[1], "-r") == 0)
+  {
+    rounds = atoi(argv[2]);
+    first = 3;
+  }
+  if (first >= argc || rounds <= 0)
+  {
+    fprintf(stderr, "Usage: %s [-r rounds] scriptfile...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Every line of every script, without its newline
+  int count = 0;
+  int capacity = 64;
+  char **lines = malloc(capacity * sizeof(char *));
+  for (int f = first; f < argc; f++)
+  {
+    FILE *file = fopen(argv[f], "r");
+    if (file == NULL)
+    {
+      perror(argv[f]);
+      return EXIT_FAILURE;
+    }
+    char line[LINE_MAX_BYTES];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+      line[strcspn(line, "\n")] = '\0';
+      if (count == capacity)
+      {
+        capacity *= 2;
+        lines = realloc(lines, capacity * sizeof(char *));
+      }
+      lines[count++] = strdup(line);
+    }
+    fclose(file);
+  }
+  if (count == 0)
+  {
+    fprintf(stderr, "No commands in the scripts\n");
+    return EXIT_FAILURE;
+  }
+  size_t *lengths = malloc(count * sizeof(size_t));
+  for (int i = 0; i < count; i++)
+  {
+    lengths[i] = strlen(lines[i]);
+  }
+
+  // Where both accept a command they must read the same arguments
+  int disagree = 0;
+  char buffer[LINE_MAX_BYTES];
+  for (int i = 0; i < count; i++)
+  {
+    command_t old_cmd, new_cmd;
+    memcpy(buffer, lines[i], lengths[i] + 1);
+    legacy_parse(buffer, &old_cmd);
+    parse_command(lines[i], lengths[i], &new_cmd);
+    if (old_cmd.type != new_cmd.type || old_cmd.valid != new_cmd.valid ||
+        (new_cmd.valid && memcmp(old_cmd.args, new_cmd.args, new_cmd.argc * sizeof(int)) != 0))
+    {
+      printf("Parsers disagree on \"%s\"\n", lines[i]);
+      disagree++;
+    }
+  }
+
+  long checksum = 0;
+  command_t cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int r = 0; r < rounds; r++)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      memcpy(buffer, lines[i], lengths[i] + 1);
+      legacy_parse(buffer, &cmd);
+      checksum += cmd.type + cmd.args[0];
+    }
+  }
+  double legacy_seconds = seconds_since(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int r = 0; r < rounds; r++)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      memcpy(buffer, lines[i], lengths[i] + 1);
+      parse_command(buffer, lengths[i], &cmd);
+      checksum -= cmd.type + cmd.args[0];
+    }
+  }
+  double table_seconds = seconds_since(&start);
+
+  double commands = (double)rounds * count;
+  printf("%d lines, %d rounds, %d disagreements (checksum %ld)\n", count, rounds, disagree, checksum);
+  printf("sscanf: %.1f M commands/s, %.1f ns per command\n", commands / legacy_seconds / 1e6,
+         legacy_seconds / commands * 1e9);
+  printf("table:  %.1f M commands/s, %.1f ns per command, %.1fx\n", commands / table_seconds / 1e6,
+         table_seconds / commands * 1e9, legacy_seconds / table_seconds);
+
+  for (int i = 0; i < count; i++)
+  {
+    free(lines[i]);
+  }
+  free(lines);
+  free(lengths);
+  return 0;
+}
@@ -0,0 +1,132 @@
+#define _GNU_SOURCE
+#include "reactor.h"
+#include "agent.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define REACTOR_EVENTS 64
+
+// Both descriptors of a connection point here, the low bit of the epoll data
+// tells the wakeup socket from the client
+typedef struct
+{
+  agent_args_t *agent;
+  int client_fd;
+  int wake_fd;
+} reactor_conn_t;
+
+#define WAKEUP_TAG 1
+
+static void *worker_thread(void *arg)
+{
+  int epoll_fd = (int)(intptr_t)arg;
+  struct epoll_event events[REACTOR_EVENTS];
+
+  while (1)
+  {
+    int count = epoll_wait(epoll_fd, events, REACTOR_EVENTS, -1);
+    for (int i = 0; i < count; i++)
+    {
+      uintptr_t data = (uintptr_t)events[i].data.ptr;
+      reactor_conn_t *conn = (reactor_conn_t *)(data & ~(uintptr_t)WAKEUP_TAG);
+      if (conn == NULL)
+        continue;
+
+      if (!(data & WAKEUP_TAG) && agent_read(conn->agent) == -1)
+      {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->client_fd, NULL);
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->wake_fd, NULL);
+        agent_disconnect(conn->agent);
+        // The other descriptor may have an event later in this batch
+        for (int j = i + 1; j < count; j++)
+        {
+          if (((uintptr_t)events[j].data.ptr & ~(uintptr_t)WAKEUP_TAG) == (uintptr_t)conn)
+            events[j].data.ptr = NULL;
+        }
+        free(conn);
+        continue;
+      }
+      agent_notify(conn->agent);
+    }
+  }
+  return NULL;
+}
+
+// Every connection is an fd for the client and one for its wakeups
+static void raise_fd_limit()
+{
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+  {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+void run_reactor(int listen_fd, int workers)
+{
+  raise_fd_limit();
+  int *epoll_fds = malloc(workers * sizeof(int));
+  for (int w = 0; w < workers; w++)
+  {
+    pthread_t thread;
+    epoll_fds[w] = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fds[w] == -1 || pthread_create(&thread, NULL, worker_thread, (void *)(intptr_t)epoll_fds[w]) != 0)
+    {
+      perror("reactor worker");
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+  }
+
+  // Connections are dealt to the workers in turn and stay with theirs
+  int next = 0;
+  struct pollfd listener = {.fd = listen_fd, .events = POLLIN};
+  while (1)
+  {
+    int client_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client_fd == -1)
+    {
+      // The listening socket does not block, wait until more clients queue up
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        poll(&listener, 1, -1);
+      else if (errno != EINTR)
+        perror("accept");
+      continue;
+    }
+    agent_args_t *agent = agent_connect(client_fd);
+    if (agent == NULL)
+      continue;
+
+    reactor_conn_t *conn = malloc(sizeof(reactor_conn_t));
+    conn->agent = agent;
+    conn->client_fd = client_fd;
+    conn->wake_fd = agent_wakeup_fd(agent);
+    if (conn->wake_fd == -1)
+    {
+      perror("notification wakeup socket");
+      agent_disconnect(agent);
+      free(conn);
+      continue;
+    }
+
+    // Arm the wakeup before the worker can see the connection. The client
+    // goes in last, its events are the only ones that free conn.
+    agent_notify(agent);
+    int epoll_fd = epoll_fds[next];
+    next = (next + 1) % workers;
+    struct epoll_event event = {.events = EPOLLIN};
+    event.data.ptr = (void *)((uintptr_t)conn | WAKEUP_TAG);
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->wake_fd, &event);
+    event.data.ptr = conn;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+  }
+}
@@ -0,0 +1,8 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+// Serves every connection of listen_fd from this process with workers epoll
+// threads, instead of forking an agent per connection. Does not return.
+void run_reactor(int listen_fd, int workers);
+
+#endif // REACTOR_H
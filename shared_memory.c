@@ -1,411 +1,373 @@
 #define _GNU_SOURCE
 #include "shared_memory.h"
 #include "data_structures.h"
+#include "spatial_index.h"
+#include "slot_table.h"
+#include "match_kernel.h"
+#include "arena.h"
+#include "wal.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
+#include <errno.h>
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
-
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+static arena_t *arena = NULL;
 static shared_data_t *shared_data = NULL;
-
-void init_shared_memory()
+static match_index_mode_t match_index_mode = MATCH_INDEX_GRID;
+static slot_alloc_policy_t slot_alloc_policy = SLOT_ALLOC_LOWEST;
+static match_kernel_t match_kernel = MATCH_KERNEL_AUTO;
+static int lock_stripe_count = 16;
+static int wake_socket = -1; // unbound, sends the wakeups of this process
+static int list_staleness_ms = 0;
+static notify_overflow_t notify_overflow = NOTIFY_OVERFLOW_DROP_OLDEST;
+// Bump when a field of the segment changes meaning without changing a size
+#define SEGMENT_VERSION 1
+
+static const char *segment_path = NULL; // file behind the arena, NULL for a memfd
+static int segment_resumed = 0;         // the tables were taken over from an earlier server
+
+#define SNAPSHOT_OPTIMISTIC_TRIES 8
+#define LIST_CHUNK_BYTES 4096 // listings reach the sink in pieces of about this size
+#define LIST_ROW_BYTES 128    // longest formatted row
+
+void set_match_index_mode(match_index_mode_t mode)
 {
-  // Allocate shared memory
-  size_t shm_size = sizeof(shared_data_t);
-  shared_data = mmap(
-      NULL,
-      shm_size,
-      PROT_READ | PROT_WRITE,
-      MAP_SHARED | MAP_ANONYMOUS,
-      -1,
-      0);
-  if (shared_data == MAP_FAILED)
-  {
-    perror("initialize shared memory problem");
-    exit(EXIT_FAILURE);
-  }
-  // Initialize shared data and synchronization primitives
-  pthread_mutexattr_t mutexAttr;
-  pthread_mutexattr_init(&mutexAttr);
-  pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
-  pthread_mutex_init(&shared_data->mutex, &mutexAttr);
+  match_index_mode = mode;
+}
 
-  // Initialize other fields
-  memset(shared_data->demands, 0, sizeof(shared_data->demands));
-  memset(shared_data->supplies, 0, sizeof(shared_data->supplies));
-  memset(shared_data->watches, 0, sizeof(shared_data->watches));
-  memset(shared_data->agent_mutexes, 0, sizeof(shared_data->agent_mutexes));
-  memset(shared_data->agent_conds, 0, sizeof(shared_data->agent_conds));
-  for (int i = 0; i < MAX_DEMANDS; i++)
-  {
-    shared_data->demands[i].agent_id = -1;
-  }
-  for (int i = 0; i < MAX_SUPPLIES; i++)
-  {
-    shared_data->supplies[i].agent_id = -1;
-  }
-  for (int i = 0; i < MAX_AGENTS; i++)
-  {
-    shared_data->watches[i].agent_id = -1;
-  }
-  shared_data->next_agent_id = 0;
+void set_slot_alloc_policy(slot_alloc_policy_t policy)
+{
+  slot_alloc_policy = policy;
+}
 
-  for (int i = 0; i < MAX_AGENTS; i++)
-  {
-    pthread_mutexattr_t agent_mutexAttr;
-    pthread_mutexattr_init(&agent_mutexAttr);
-    pthread_mutexattr_setpshared(&agent_mutexAttr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&shared_data->agent_mutexes[i], &agent_mutexAttr);
-    pthread_mutexattr_destroy(&agent_mutexAttr);
+void set_segment_path(const char *path)
+{
+  segment_path = path;
+}
 
-    pthread_condattr_t condAttr;
-    pthread_condattr_init(&condAttr);
-    pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
-    pthread_cond_init(&shared_data->agent_conds[i], &condAttr);
-    pthread_condattr_destroy(&condAttr);
+void set_match_kernel(match_kernel_t kernel)
+{
+  match_kernel = kernel;
+}
 
-    shared_data->notification_queue[i].head = 0;
-    shared_data->notification_queue[i].tail = 0;
-    pthread_mutexattr_t notification_mutexAttr;
-    pthread_mutexattr_init(&notification_mutexAttr);
-    pthread_mutexattr_setpshared(&notification_mutexAttr, PTHREAD_PROCESS_SHARED);
-    pthread_mutex_init(&shared_data->notification_queue[i].mutex, &notification_mutexAttr);
-    pthread_mutexattr_destroy(&notification_mutexAttr);
-  }
+void set_list_staleness(int ms)
+{
+  list_staleness_ms = ms < 0 ? 0 : ms;
 }
 
-void destroy_shared_memory()
+void set_notify_overflow(notify_overflow_t policy)
 {
-  pthread_mutex_destroy(&shared_data->mutex);
+  notify_overflow = policy;
+}
 
-  // Unmap shared memory
-  size_t shm_size = sizeof(shared_data_t);
-  munmap(shared_data, shm_size);
+void set_lock_stripes(int stripes)
+{
+  if (stripes < 1)
+    stripes = 1;
+  if (stripes > MAX_LOCK_STRIPES)
+    stripes = MAX_LOCK_STRIPES;
+  lock_stripe_count = stripes;
 }
 
-int add_demand(int agent_id, int nA, int nB, int nC)
+// Stripe k owns the k-th band of columns in both grids, so supplies are
+// banded by x and demands by x + y
+static uint64_t stripe_band(const spatial_grid_t *grid, long long v0, long long v1)
 {
-  pthread_mutex_lock(&shared_data->mutex);
-  int x = shared_data->agent_positions[agent_id][0];
-  int y = shared_data->agent_positions[agent_id][1];
-  int empty_demand_index = find_first_empty_demand();
-  if (empty_demand_index == -1)
+  int stripes = shared_data->lock_stripes;
+  int s0 = grid_column(grid, v0) * stripes / grid->cols;
+  int s1 = grid_column(grid, v1) * stripes / grid->cols;
+  uint64_t set = 0;
+  for (int s = s0; s <= s1; s++)
   {
-    printf("Debug: exceeded max demands\n");
-    pthread_mutex_unlock(&shared_data->mutex);
-    return -1;
+    set |= 1ULL << s;
   }
-  demand_t *demand = &shared_data->demands[empty_demand_index];
-  demand->agent_id = agent_id;
-  demand->x = x;
-  demand->y = y;
-  demand->nA = nA;
-  demand->nB = nB;
-  demand->nC = nC;
-  check_match(agent_id, empty_demand_index, 1);
-  pthread_mutex_unlock(&shared_data->mutex);
-  return 0;
+  return set;
 }
 
-int remove_demand(int agent_id, int demand_id)
+static uint64_t all_stripes()
 {
-  pthread_mutex_lock(&shared_data->mutex);
-  int result = remove_demand_nolock(agent_id, demand_id);
-  pthread_mutex_unlock(&shared_data->mutex);
-  return result;
+  int stripes = shared_data->lock_stripes;
+  return stripes == 64 ? ~0ULL : (1ULL << stripes) - 1;
 }
 
-int add_supply(int agent_id, int distance, int nA, int nB, int nC)
+// lock_stripes calls of this process not undone yet. Every change to the
+// tables happens under stripes, a SIGTERM that comes in between ends the
+// process at the last unlock so the tables stay whole.
+static int stripes_held = 0;
+static volatile sig_atomic_t termination_pending = 0;
+
+// Stripes are always taken in ascending order so overlapping sets cannot deadlock
+static void lock_stripes(uint64_t set)
 {
-  pthread_mutex_lock(&shared_data->mutex);
-  int x = shared_data->agent_positions[agent_id][0];
-  int y = shared_data->agent_positions[agent_id][1];
-  int empty_supply_index = find_first_empty_supply();
-  if (empty_supply_index == -1)
+  __atomic_add_fetch(&stripes_held, 1, __ATOMIC_SEQ_CST);
+  for (uint64_t s = set; s != 0; s &= s - 1)
   {
-    printf("Debug: exceeded max supplies\n");
-    pthread_mutex_unlock(&shared_data->mutex);
-    return -1;
+    pthread_mutex_lock(&shared_data->stripe_locks[__builtin_ctzll(s)]);
   }
-  supply_t *supply = &shared_data->supplies[empty_supply_index];
-  supply->agent_id = agent_id;
-  supply->x = x;
-  supply->y = y;
-  supply->distance = distance;
-  supply->nA = nA;
-  supply->nB = nB;
-  supply->nC = nC;
-  check_match(agent_id, empty_supply_index, 0);
+}
 
-  for (int i = 0; i < MAX_AGENTS; i++)
+static void unlock_stripes(uint64_t set)
+{
+  for (uint64_t s = set; s != 0; s &= s - 1)
   {
-    watch_t *watch = &shared_data->watches[i];
-    if (watch->distance > 0 && watch->agent_id != -1 && watch->agent_id != agent_id)
-    { // Check if the agent is watching
-      int dx = abs(watch->x - x);
-      int dy = abs(watch->y - y);
-      int manhattan_distance = dx + dy;
-
-      if (manhattan_distance <= watch->distance)
-      {
-        // Prepare notification
-        notification_t notif;
-        notif.type = SUPPLY_ADDED;
-        notif.agent_id = watch->agent_id;
-        notif.supplyX = x;
-        notif.supplyY = y;
-        notif.supplyA = nA;
-        notif.supplyB = nB;
-        notif.supplyC = nC;
-        notif.supplyDistance = distance;
-        notif.supply_id = empty_supply_index;
-        notif.timestamp = time(NULL);
-
-        // Add notification to agent's queue
-        pthread_mutex_lock(&shared_data->notification_queue[watch->agent_id].mutex);
-        notification_queue_t *queue = &shared_data->notification_queue[watch->agent_id];
-        queue->notifications[queue->tail] = notif;
-        queue->tail = (queue->tail + 1) % MAX_NOTIFICATIONS;
-        pthread_mutex_unlock(&shared_data->notification_queue[watch->agent_id].mutex);
-        // Notify the agent
-        pthread_mutex_lock(&shared_data->agent_mutexes[watch->agent_id]);
-        pthread_cond_signal(&shared_data->agent_conds[watch->agent_id]);
-        pthread_mutex_unlock(&shared_data->agent_mutexes[watch->agent_id]);
-      }
-    }
+    pthread_mutex_unlock(&shared_data->stripe_locks[__builtin_ctzll(s)]);
   }
-  pthread_mutex_unlock(&shared_data->mutex);
-  return 0;
+  if (__atomic_sub_fetch(&stripes_held, 1, __ATOMIC_SEQ_CST) == 0 && termination_pending)
+    _exit(EXIT_SUCCESS);
 }
 
-int remove_supply(int agent_id, int supply_id)
+static void terminate_outside_stripes(int sig)
 {
-  pthread_mutex_lock(&shared_data->mutex);
-  int result = remove_supply_nolock(agent_id, supply_id);
-  pthread_mutex_unlock(&shared_data->mutex);
-  return result;
+  (void)sig;
+  termination_pending = 1;
+  if (__atomic_load_n(&stripes_held, __ATOMIC_SEQ_CST) == 0)
+    _exit(EXIT_SUCCESS);
 }
 
-int add_watch(int agent_id, int distance)
+void defer_termination()
 {
-  pthread_mutex_lock(&shared_data->mutex);
-  int x = shared_data->agent_positions[agent_id][0];
-  int y = shared_data->agent_positions[agent_id][1];
-  watch_t *watch = &shared_data->watches[agent_id];
-  watch->agent_id = agent_id;
-  watch->x = x;
-  watch->y = y;
-  watch->distance = distance;
-  pthread_mutex_unlock(&shared_data->mutex);
-  return 0;
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = terminate_outside_stripes;
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
 }
 
-int remove_watch(int agent_id)
+int end_with_parent(pid_t parent)
 {
-  pthread_mutex_lock(&shared_data->mutex);
-  shared_data->watches[agent_id].agent_id = -1;
-  shared_data->watches[agent_id].x = 0;
-  shared_data->watches[agent_id].y = 0;
-  shared_data->watches[agent_id].distance = 0;
-  pthread_mutex_unlock(&shared_data->mutex);
-  return 0;
+  defer_termination();
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  return getppid() == parent ? 0 : -1;
 }
 
-int move(int agent_id, int x, int y)
+// A new demand needs its own cell and every supply cell within the supply
+// reach. The reach can grow while we wait, a supply that could serve the
+// demand also takes the demand's band, so rechecking it once we hold the
+// stripes is enough.
+static uint64_t lock_demand_stripes(int x, int y, int *reach)
 {
-  pthread_mutex_lock(&shared_data->mutex);
-  if (agent_id >= MAX_AGENTS)
+  if (match_index_mode != MATCH_INDEX_GRID)
   {
-    pthread_mutex_unlock(&shared_data->mutex);
-    return -1;
+    uint64_t set = all_stripes();
+    lock_stripes(set);
+    *reach = grid_reach(&shared_data->supply_grid);
+    return set;
+  }
+  long long u = (long long)x + y;
+  for (;;)
+  {
+    int r = grid_reach(&shared_data->supply_grid);
+    uint64_t set = stripe_band(&shared_data->demand_grid, u, u);
+    if (r >= 0)
+      set |= stripe_band(&shared_data->supply_grid, (long long)x - r, (long long)x + r);
+    lock_stripes(set);
+    if (grid_reach(&shared_data->supply_grid) <= r)
+    {
+      *reach = r;
+      return set;
+    }
+    unlock_stripes(set);
   }
-  shared_data->agent_positions[agent_id][0] = x;
-  shared_data->agent_positions[agent_id][1] = y;
-  pthread_mutex_unlock(&shared_data->mutex);
-  return 0;
 }
 
-int check_match(int agent_id, int demand_or_supply_id, int is_demand)
+// A new supply needs its own cell and the demand cells it can reach
+static uint64_t lock_supply_stripes(int x, int y, int distance)
 {
-  int had_a_match = 0;
-  int i_index = 0;
-  int supplier_agent_id = -1;
-  int demander_agent_id = -1;
-  int demandX = 0;
-  int demandY = 0;
-  int demandA = 0;
-  int demandB = 0;
-  int demandC = 0;
-  int supplyX = 0;
-  int supplyY = 0;
-  int supplyA = 0;
-  int supplyB = 0;
-  int supplyC = 0;
-  int supplyDistance = 0;
-  if (is_demand)
+  uint64_t set;
+  if (match_index_mode != MATCH_INDEX_GRID)
   {
-    for (int i = 0; i < MAX_SUPPLIES; i++)
-    {
-      if (shared_data->supplies[i].agent_id != -1 && check_case(demand_or_supply_id, i))
-      {
-        supplier_agent_id = shared_data->supplies[i].agent_id;
-        demander_agent_id = agent_id;
-        supplyX = shared_data->supplies[i].x;
-        supplyY = shared_data->supplies[i].y;
-        supplyA = shared_data->supplies[i].nA;
-        supplyB = shared_data->supplies[i].nB;
-        supplyC = shared_data->supplies[i].nC;
-        supplyDistance = shared_data->supplies[i].distance;
-        demandX = shared_data->demands[demand_or_supply_id].x;
-        demandY = shared_data->demands[demand_or_supply_id].y;
-        demandA = shared_data->demands[demand_or_supply_id].nA;
-        demandB = shared_data->demands[demand_or_supply_id].nB;
-        demandC = shared_data->demands[demand_or_supply_id].nC;
-
-        shared_data->supplies[i].nA -= shared_data->demands[demand_or_supply_id].nA;
-        shared_data->supplies[i].nB -= shared_data->demands[demand_or_supply_id].nB;
-        shared_data->supplies[i].nC -= shared_data->demands[demand_or_supply_id].nC;
-
-        if (shared_data->supplies[i].nA == 0 && shared_data->supplies[i].nB == 0 && shared_data->supplies[i].nC == 0)
-        {
-          remove_supply_nolock(shared_data->supplies[i].agent_id, i);
-        }
-        remove_demand_nolock(agent_id, demand_or_supply_id);
-
-        i_index = i;
-        had_a_match = 1;
-        break;
-      }
-    }
+    set = all_stripes();
   }
   else
   {
-    for (int i = 0; i < MAX_DEMANDS; i++)
-    {
-      if (shared_data->demands[i].agent_id != -1 && check_case(i, demand_or_supply_id))
-      {
-        supplier_agent_id = agent_id;
-        demander_agent_id = shared_data->demands[i].agent_id;
-        supplyX = shared_data->supplies[demand_or_supply_id].x;
-        supplyY = shared_data->supplies[demand_or_supply_id].y;
-        supplyA = shared_data->supplies[demand_or_supply_id].nA;
-        supplyB = shared_data->supplies[demand_or_supply_id].nB;
-        supplyC = shared_data->supplies[demand_or_supply_id].nC;
-        supplyDistance = shared_data->supplies[demand_or_supply_id].distance;
-        demandX = shared_data->demands[i].x;
-        demandY = shared_data->demands[i].y;
-        demandA = shared_data->demands[i].nA;
-        demandB = shared_data->demands[i].nB;
-        demandC = shared_data->demands[i].nC;
-
-        shared_data->supplies[demand_or_supply_id].nA -= shared_data->demands[i].nA;
-        shared_data->supplies[demand_or_supply_id].nB -= shared_data->demands[i].nB;
-        shared_data->supplies[demand_or_supply_id].nC -= shared_data->demands[i].nC;
-        if (shared_data->supplies[demand_or_supply_id].nA == 0 && shared_data->supplies[demand_or_supply_id].nB == 0 && shared_data->supplies[demand_or_supply_id].nC == 0)
-        {
-          remove_supply_nolock(shared_data->supplies[demand_or_supply_id].agent_id, demand_or_supply_id);
-        }
-        remove_demand_nolock(agent_id, i);
-        i_index = i;
-        had_a_match = 1;
-        break;
-      }
-    }
+    long long u = (long long)x + y;
+    set = stripe_band(&shared_data->supply_grid, x, x);
+    if (distance > 0)
+      set |= stripe_band(&shared_data->demand_grid, u - (distance - 1), u + (distance - 1));
   }
+  lock_stripes(set);
+  return set;
+}
 
-  if (had_a_match)
-  {
-    // Prepare notification
-    notification_t notif_sup;
-    notif_sup.type = SUPPLY_DELIVERED;
-    notif_sup.supply_id = is_demand ? demand_or_supply_id : i_index;
-    notif_sup.demand_id = is_demand ? i_index : demand_or_supply_id;
-    notif_sup.supplyX = supplyX;
-    notif_sup.supplyY = supplyY;
-    notif_sup.supplyA = supplyA;
-    notif_sup.supplyB = supplyB;
-    notif_sup.supplyC = supplyC;
-    notif_sup.supplyDistance = supplyDistance;
-    notif_sup.demandX = demandX;
-    notif_sup.demandY = demandY;
-    notif_sup.demandA = demandA;
-    notif_sup.demandB = demandB;
-    notif_sup.demandC = demandC;
-    notif_sup.timestamp = time(NULL);
-    notif_sup.agent_id = supplier_agent_id;
-    // Notify the supplier
-    pthread_mutex_lock(&shared_data->notification_queue[supplier_agent_id].mutex);
-    notification_queue_t *supplier_queue = &shared_data->notification_queue[supplier_agent_id];
-    supplier_queue->notifications[supplier_queue->tail] = notif_sup;
-    supplier_queue->tail = (supplier_queue->tail + 1) % MAX_NOTIFICATIONS;
-    pthread_mutex_unlock(&shared_data->notification_queue[supplier_agent_id].mutex);
+// The column copies follow every write to a demand or supply record
+static void sync_demand_columns(int demand_id)
+{
+  demand_t *demand = &shared_data->demands[demand_id];
+  demand_columns_t *cols = &shared_data->demand_cols;
+  cols->agent_id[demand_id] = demand->agent_id;
+  cols->x[demand_id] = demand->x;
+  cols->y[demand_id] = demand->y;
+  cols->nA[demand_id] = demand->nA;
+  cols->nB[demand_id] = demand->nB;
+  cols->nC[demand_id] = demand->nC;
+}
 
-    pthread_mutex_lock(&shared_data->agent_mutexes[supplier_agent_id]);
-    pthread_cond_signal(&shared_data->agent_conds[supplier_agent_id]);
-    pthread_mutex_unlock(&shared_data->agent_mutexes[supplier_agent_id]);
+static void sync_supply_columns(int supply_id)
+{
+  supply_t *supply = &shared_data->supplies[supply_id];
+  supply_columns_t *cols = &shared_data->supply_cols;
+  cols->agent_id[supply_id] = supply->agent_id;
+  cols->x[supply_id] = supply->x;
+  cols->y[supply_id] = supply->y;
+  cols->nA[supply_id] = supply->nA;
+  cols->nB[supply_id] = supply->nB;
+  cols->nC[supply_id] = supply->nC;
+  cols->distance[supply_id] = supply->distance;
+}
 
-    notification_t notif_dem;
-    notif_dem.type = DEMAND_FULFILLED;
-    notif_dem.demand_id = is_demand ? demand_or_supply_id : i_index;
-    notif_dem.supply_id = is_demand ? i_index : demand_or_supply_id;
-    notif_dem.supplyX = supplyX;
-    notif_dem.supplyY = supplyY;
-    notif_dem.supplyA = supplyA;
-    notif_dem.supplyB = supplyB;
-    notif_dem.supplyC = supplyC;
-    notif_dem.supplyDistance = supplyDistance;
-    notif_dem.demandX = demandX;
-    notif_dem.demandY = demandY;
-    notif_dem.demandA = demandA;
-    notif_dem.demandB = demandB;
-    notif_dem.demandC = demandC;
-    notif_dem.timestamp = time(NULL);
-    notif_dem.agent_id = demander_agent_id;
+// Every change to a table is bracketed by these, see table_seq_t. They nest,
+// readers wait until the outermost write has ended.
+static void begin_table_write(table_seq_t *seq)
+{
+  __atomic_add_fetch(&seq->writers, 1, __ATOMIC_SEQ_CST);
+}
 
-    // Notify the demander
-    pthread_mutex_lock(&shared_data->notification_queue[demander_agent_id].mutex);
-    notification_queue_t *demander_queue = &shared_data->notification_queue[demander_agent_id];
-    demander_queue->notifications[demander_queue->tail] = notif_dem;
-    demander_queue->tail = (demander_queue->tail + 1) % MAX_NOTIFICATIONS;
-    pthread_mutex_unlock(&shared_data->notification_queue[demander_agent_id].mutex);
+static void end_table_write(table_seq_t *seq)
+{
+  __atomic_add_fetch(&seq->version, 1, __ATOMIC_RELEASE);
+  __atomic_sub_fetch(&seq->writers, 1, __ATOMIC_RELEASE);
+}
 
-    pthread_mutex_lock(&shared_data->agent_mutexes[demander_agent_id]);
-    pthread_cond_signal(&shared_data->agent_conds[demander_agent_id]);
-    pthread_mutex_unlock(&shared_data->agent_mutexes[demander_agent_id]);
-  }
-  return had_a_match;
+// Per agent lists are threaded through the owner_next/owner_prev fields
+static void link_owned_demand(int agent_id, int demand_id)
+{
+  pthread_mutex_lock(&shared_data->owner_locks[agent_id]);
+  owner_list_t *list = &shared_data->agent_demands[agent_id];
+  demand_t *demand = &shared_data->demands[demand_id];
+  demand->owner_prev = -1;
+  demand->owner_next = list->head;
+  if (list->head != -1)
+    shared_data->demands[list->head].owner_prev = demand_id;
+  list->head = demand_id;
+  list->count++;
+  pthread_mutex_unlock(&shared_data->owner_locks[agent_id]);
 }
 
-int check_case(int demand_id, int supply_id)
+static void unlink_owned_demand(int demand_id)
 {
-  int bool1 = (shared_data->supplies[supply_id].distance > (abs(shared_data->demands[demand_id].x - shared_data->supplies[supply_id].x) + abs(shared_data->demands[demand_id].y - shared_data->supplies[supply_id].y)));
-  int bool2 = shared_data->demands[demand_id].nA <= shared_data->supplies[supply_id].nA;
-  int bool3 = shared_data->demands[demand_id].nB <= shared_data->supplies[supply_id].nB;
-  int bool4 = shared_data->demands[demand_id].nC <= shared_data->supplies[supply_id].nC;
-  int bool5 = shared_data->supplies[supply_id].agent_id != shared_data->demands[demand_id].agent_id;
+  demand_t *demand = &shared_data->demands[demand_id];
+  pthread_mutex_lock(&shared_data->owner_locks[demand->agent_id]);
+  owner_list_t *list = &shared_data->agent_demands[demand->agent_id];
+  if (demand->owner_prev != -1)
+    shared_data->demands[demand->owner_prev].owner_next = demand->owner_next;
+  else
+    list->head = demand->owner_next;
+  if (demand->owner_next != -1)
+    shared_data->demands[demand->owner_next].owner_prev = demand->owner_prev;
+  list->count--;
+  demand->owner_next = -1;
+  demand->owner_prev = -1;
+  pthread_mutex_unlock(&shared_data->owner_locks[demand->agent_id]);
+}
 
-  return bool1 & bool2 & bool3 & bool4 & bool5;
+static void link_owned_supply(int agent_id, int supply_id)
+{
+  pthread_mutex_lock(&shared_data->owner_locks[agent_id]);
+  owner_list_t *list = &shared_data->agent_supplies[agent_id];
+  supply_t *supply = &shared_data->supplies[supply_id];
+  supply->owner_prev = -1;
+  supply->owner_next = list->head;
+  if (list->head != -1)
+    shared_data->supplies[list->head].owner_prev = supply_id;
+  list->head = supply_id;
+  list->count++;
+  pthread_mutex_unlock(&shared_data->owner_locks[agent_id]);
 }
 
-int remove_demand_nolock(int agent_id, int demand_id)
+static void unlink_owned_supply(int supply_id)
+{
+  supply_t *supply = &shared_data->supplies[supply_id];
+  pthread_mutex_lock(&shared_data->owner_locks[supply->agent_id]);
+  owner_list_t *list = &shared_data->agent_supplies[supply->agent_id];
+  if (supply->owner_prev != -1)
+    shared_data->supplies[supply->owner_prev].owner_next = supply->owner_next;
+  else
+    list->head = supply->owner_next;
+  if (supply->owner_next != -1)
+    shared_data->supplies[supply->owner_next].owner_prev = supply->owner_prev;
+  list->count--;
+  supply->owner_next = -1;
+  supply->owner_prev = -1;
+  pthread_mutex_unlock(&shared_data->owner_locks[supply->agent_id]);
+}
+
+// Log records of a demand or supply as the table holds it now
+static wal_record_t demand_record(wal_type_t type, int demand_id)
+{
+  demand_t *demand = &shared_data->demands[demand_id];
+  wal_record_t record = {type, demand_id, demand->agent_id, demand->x, demand->y, 0, demand->nA, demand->nB, demand->nC, 0};
+  return record;
+}
+
+static wal_record_t supply_record(wal_type_t type, int supply_id)
+{
+  supply_t *supply = &shared_data->supplies[supply_id];
+  wal_record_t record = {type, supply_id, supply->agent_id, supply->x, supply->y, supply->distance,
+                         supply->nA, supply->nB, supply->nC, 0};
+  return record;
+}
+
+static void log_demand(wal_type_t type, int demand_id)
+{
+  wal_record_t record = demand_record(type, demand_id);
+  wal_append(&record);
+}
+
+static void log_supply(wal_type_t type, int supply_id)
 {
-  // Assume mutex is already locked
+  wal_record_t record = supply_record(type, supply_id);
+  wal_append(&record);
+}
+
+// A match is one record, a crash cannot keep the supply decremented while
+// the demand it served stays
+static void log_match(int supply_id, int demand_id)
+{
+  wal_record_t record = supply_record(WAL_MATCH, supply_id);
+  record.x = demand_id;
+  wal_append(&record);
+}
+
+// Drops a demand from the indexes and the owner list and frees its slot,
+// caller holds the stripe of the demand. The slot goes back last since
+// another stripe may hand it out again right away. Nothing is logged, the
+// caller already did.
+static void forget_demand(int demand_id)
+{
+  begin_table_write(&shared_data->demand_seq);
+  grid_remove(&shared_data->demand_grid, shared_data->demand_links, demand_id);
+  unlink_owned_demand(demand_id);
   shared_data->demands[demand_id].agent_id = -1;
   shared_data->demands[demand_id].x = 0;
   shared_data->demands[demand_id].y = 0;
   shared_data->demands[demand_id].nA = 0;
   shared_data->demands[demand_id].nB = 0;
   shared_data->demands[demand_id].nC = 0;
-  return 0;
+  sync_demand_columns(demand_id);
+  pthread_mutex_lock(&shared_data->slot_mutex);
+  slot_release(&shared_data->demand_slots, demand_id);
+  pthread_mutex_unlock(&shared_data->slot_mutex);
+  end_table_write(&shared_data->demand_seq);
 }
 
-int remove_supply_nolock(int agent_id, int supply_id)
+static void forget_supply(int supply_id)
 {
-  // Assume mutex is already locked
-
+  begin_table_write(&shared_data->supply_seq);
+  grid_remove(&shared_data->supply_grid, shared_data->supply_links, supply_id);
+  unlink_owned_supply(supply_id);
   shared_data->supplies[supply_id].agent_id = -1;
   shared_data->supplies[supply_id].x = 0;
   shared_data->supplies[supply_id].y = 0;
@@ -413,257 +375,2462 @@ int remove_supply_nolock(int agent_id, int supply_id)
   shared_data->supplies[supply_id].nA = 0;
   shared_data->supplies[supply_id].nB = 0;
   shared_data->supplies[supply_id].nC = 0;
+  sync_supply_columns(supply_id);
+  pthread_mutex_lock(&shared_data->slot_mutex);
+  slot_release(&shared_data->supply_slots, supply_id);
+  pthread_mutex_unlock(&shared_data->slot_mutex);
+  end_table_write(&shared_data->supply_seq);
+}
 
-  // After removing the supply
-  notification_t notif;
-  notif.type = SUPPLY_REMOVED;
-  notif.supply_id = supply_id;
-  notif.agent_id = agent_id;
-  notif.timestamp = time(NULL);
-
-  // Add notification to agent's queue
-  int supplier_agent_id = agent_id; // or use shared_data->supplies[supply_id].agent_id
-  pthread_mutex_lock(&shared_data->notification_queue[supplier_agent_id].mutex);
-  notification_queue_t *queue = &shared_data->notification_queue[supplier_agent_id];
-  queue->notifications[queue->tail] = notif;
-  queue->tail = (queue->tail + 1) % MAX_NOTIFICATIONS;
-  pthread_mutex_unlock(&shared_data->notification_queue[supplier_agent_id].mutex);
-
-  // Notify the agent
-  pthread_mutex_lock(&shared_data->agent_mutexes[supplier_agent_id]);
-  pthread_cond_signal(&shared_data->agent_conds[supplier_agent_id]);
-  pthread_mutex_unlock(&shared_data->agent_mutexes[supplier_agent_id]);
-
-  return 0;
+static void clear_demand(int demand_id)
+{
+  if (shared_data->demands[demand_id].agent_id == -1)
+    return;
+  log_demand(WAL_REMOVE_DEMAND, demand_id);
+  forget_demand(demand_id);
 }
 
-void notify_client(int agent_id, int client_fd)
+static void clear_supply(int supply_id)
 {
-  // Wait for notification
-  pthread_mutex_lock(&shared_data->agent_mutexes[agent_id]);
-  pthread_cond_wait(&shared_data->agent_conds[agent_id], &shared_data->agent_mutexes[agent_id]);
-  pthread_mutex_unlock(&shared_data->agent_mutexes[agent_id]);
+  if (shared_data->supplies[supply_id].agent_id == -1)
+    return;
+  log_supply(WAL_REMOVE_SUPPLY, supply_id);
+  forget_supply(supply_id);
+}
 
-  // Retrieve notifications from the agent's queue
-  pthread_mutex_lock(&shared_data->notification_queue[agent_id].mutex);
-  notification_queue_t *queue = &shared_data->notification_queue[agent_id];
+// Address space the tables may grow into, one cache line of slack per array
+static size_t arena_reserve()
+{
+  size_t demand_bytes = slot_table_storage(DEMAND_LIMIT) +
+                        (size_t)DEMAND_LIMIT * (sizeof(demand_t) + sizeof(grid_link_t) + 6 * sizeof(int));
+  size_t supply_bytes = slot_table_storage(SUPPLY_LIMIT) +
+                        (size_t)SUPPLY_LIMIT * (sizeof(supply_t) + sizeof(grid_link_t) + 7 * sizeof(int));
+  size_t agent_bytes = (size_t)AGENT_LIMIT *
+                       (sizeof(pthread_mutex_t) + sizeof(watch_t) +
+                        sizeof(grid_link_t) + 2 * sizeof(int) + 2 * sizeof(owner_list_t) +
+                        sizeof(notification_queue_t) + 2 * sizeof(int) + NOTIFICATION_RING_BYTES);
+  size_t spill_bytes = (size_t)SPILL_CHUNK_LIMIT * sizeof(spill_chunk_t);
+  return sizeof(arena_t) + sizeof(shared_data_t) + demand_bytes + supply_bytes + agent_bytes + spill_bytes + 64 * 64;
+}
 
-  while (queue->head != queue->tail)
+static void *carve(size_t bytes)
+{
+  void *slice = arena_carve(arena, bytes);
+  if (slice == NULL)
   {
-    notification_t notif = queue->notifications[queue->head];
-    queue->head = (queue->head + 1) % MAX_NOTIFICATIONS;
-
-    // Process the notification
-    char message[256];
-    if (notif.type == DEMAND_FULFILLED)
-    {
-      snprintf(message, sizeof(message),
-               "Your demand at (%d,%d), [%d,%d,%d] is fulfilled by a client at (%d,%d).",
-               notif.demandX, notif.demandY, notif.demandA, notif.demandB, notif.demandC,
-               notif.supplyX, notif.supplyY);
-    }
-    else if (notif.type == SUPPLY_DELIVERED)
-    {
-      snprintf(message, sizeof(message),
-               "Your supply at (%d,%d), [%d,%d,%d] with distance %d is delivered to a client at (%d,%d) [%d,%d,%d].",
-               notif.supplyX, notif.supplyY, notif.supplyA, notif.supplyB, notif.supplyC, notif.supplyDistance,
-               notif.demandX, notif.demandY, notif.demandA, notif.demandB, notif.demandC);
-    }
-    else if (notif.type == SUPPLY_REMOVED)
-    {
-      snprintf(message, sizeof(message), "Your supply is removed from map.");
-    }
-    else if (notif.type == SUPPLY_ADDED)
-    {
-      snprintf(message, sizeof(message),
-               "A supply [%d,%d,%d] is inserted at (%d,%d).",
-               notif.supplyA, notif.supplyB, notif.supplyC, notif.supplyX, notif.supplyY);
-    }
-    // Send the message to the client
-    write(client_fd, message, strlen(message));
+    fprintf(stderr, "initialize shared memory problem: arena too small\n");
+    exit(EXIT_FAILURE);
   }
-
-  pthread_mutex_unlock(&queue->mutex);
+  return slice;
 }
 
-void get_next_agent_id(int *agent_id)
+// The arrays of each table are carved in a row, committing the end of the
+// last one covers the whole table. Capacities stay multiples of 64 so the
+// column copies always hold whole bitmap words.
+static int commit_entries(const void *array, size_t size, int count)
 {
-  pthread_mutex_lock(&shared_data->mutex);
-  *agent_id = shared_data->next_agent_id++;
-  pthread_mutex_unlock(&shared_data->mutex);
+  return arena_commit(arena, (const char *)array + size * count);
 }
 
-void remove_all_demands_nolock(int agent_id)
+// Sets up demand slots up to capacity, caller holds slot_mutex inside a demand
+// table write. The new entries are ready before the slot table publishes them.
+static int grow_demands(int capacity)
 {
-  for (int i = 0; i < MAX_DEMANDS; i++)
+  int old = shared_data->demand_slots.capacity;
+  if (capacity > DEMAND_LIMIT)
+    capacity = DEMAND_LIMIT;
+  if (capacity <= old)
+    return -1;
+  demand_columns_t *cols = &shared_data->demand_cols;
+  if (commit_entries(cols->nC, sizeof(int), capacity) == -1)
+    return -1;
+  for (int i = old; i < capacity; i++)
   {
-    if (shared_data->demands[i].agent_id == agent_id)
-    {
-      shared_data->demands[i].agent_id = -1;
-      shared_data->demands[i].x = 0;
-      shared_data->demands[i].y = 0;
-      shared_data->demands[i].nA = 0;
-      shared_data->demands[i].nB = 0;
-      shared_data->demands[i].nC = 0;
-    }
+    shared_data->demands[i].agent_id = -1;
+    shared_data->demands[i].owner_next = -1;
+    shared_data->demands[i].owner_prev = -1;
+    cols->agent_id[i] = -1;
   }
+  grid_links_init(shared_data->demand_links, old, capacity);
+  return slot_table_grow(&shared_data->demand_slots, capacity);
 }
 
-void remove_all_supplies_nolock(int agent_id)
+static int grow_supplies(int capacity)
 {
-  for (int i = 0; i < MAX_SUPPLIES; i++)
+  int old = shared_data->supply_slots.capacity;
+  if (capacity > SUPPLY_LIMIT)
+    capacity = SUPPLY_LIMIT;
+  if (capacity <= old)
+    return -1;
+  supply_columns_t *cols = &shared_data->supply_cols;
+  if (commit_entries(cols->distance, sizeof(int), capacity) == -1)
+    return -1;
+  for (int i = old; i < capacity; i++)
   {
-    if (shared_data->supplies[i].agent_id == agent_id)
-    {
-      shared_data->supplies[i].agent_id = -1;
-      shared_data->supplies[i].x = 0;
-      shared_data->supplies[i].y = 0;
-      shared_data->supplies[i].distance = 0;
-      shared_data->supplies[i].nA = 0;
-      shared_data->supplies[i].nB = 0;
-      shared_data->supplies[i].nC = 0;
-    }
+    shared_data->supplies[i].agent_id = -1;
+    shared_data->supplies[i].owner_next = -1;
+    shared_data->supplies[i].owner_prev = -1;
+    cols->agent_id[i] = -1;
   }
+  grid_links_init(shared_data->supply_links, old, capacity);
+  return slot_table_grow(&shared_data->supply_slots, capacity);
 }
 
-void cleanup_agent(int agent_id)
+// What an agent id has while no connection uses it, its records aside
+static void reset_agent(int agent_id, const pthread_mutexattr_t *mutexAttr)
 {
-  pthread_mutex_lock(&shared_data->mutex);
+  pthread_mutex_init(&shared_data->owner_locks[agent_id], mutexAttr);
   shared_data->watches[agent_id].agent_id = -1;
-  shared_data->watches[agent_id].x = 0;
-  shared_data->watches[agent_id].y = 0;
-  shared_data->watches[agent_id].distance = 0;
-
-  remove_all_demands_nolock(agent_id);
-  remove_all_supplies_nolock(agent_id);
-
-  pthread_mutex_unlock(&shared_data->mutex);
+  notification_queue_t *queue = &shared_data->notification_queue[agent_id];
+  memset(queue, 0, sizeof(notification_queue_t));
+  queue->ring = -1;
+  queue->spill_first = -1;
+  queue->spill_last = -1;
+  pthread_mutex_init(&queue->mutex, mutexAttr);
 }
 
-char *create_supply_response(int agent_id, int all)
+// Sets up the entries of agents up to capacity, caller holds agent_table_mutex
+static int grow_agents(int capacity)
 {
-  // Lock the shared data mutex
-  pthread_mutex_lock(&shared_data->mutex);
+  int old = shared_data->agent_capacity;
+  if (capacity > AGENT_LIMIT)
+    capacity = AGENT_LIMIT;
+  if (capacity <= old)
+    return -1;
+  if (commit_entries(shared_data->free_rings, sizeof(int), capacity) == -1 ||
+      commit_entries(shared_data->free_agent_ids, sizeof(int), capacity) == -1)
+    return -1;
 
-  // Count matching supplies first
-  int count = 0, all_count = 0;
-  for (int i = 0; i < MAX_SUPPLIES; i++)
+  pthread_mutexattr_t mutexAttr;
+  pthread_mutexattr_init(&mutexAttr);
+  pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+  for (int i = old; i < capacity; i++)
   {
-    if (shared_data->supplies[i].agent_id == agent_id)
-    {
-      count++;
-    }
-    if (shared_data->supplies[i].agent_id != -1)
-    {
-      all_count++;
-    }
+    shared_data->agent_positions[i][0] = 0;
+    shared_data->agent_positions[i][1] = 0;
+    shared_data->agent_demands[i].head = -1;
+    shared_data->agent_demands[i].count = 0;
+    shared_data->agent_supplies[i].head = -1;
+    shared_data->agent_supplies[i].count = 0;
+    reset_agent(i, &mutexAttr);
   }
-  if (all)
-    count = all_count;
+  pthread_mutexattr_destroy(&mutexAttr);
+  grid_links_init(shared_data->watch_links, old, capacity);
+  __atomic_store_n(&shared_data->agent_capacity, capacity, __ATOMIC_RELEASE);
+  return 0;
+}
 
-  // Allocate space for the response
-  char *response = malloc(1024 * sizeof(char));
-  if (response == NULL)
+// After a restart only the ids that still own records are taken, those are
+// kept from new clients so none of them finds the records as its own
+static void rebuild_free_agent_ids()
+{
+  pthread_mutex_lock(&shared_data->agent_table_mutex);
+  shared_data->free_agent_id_count = 0;
+  // Highest first, the lowest free id is handed out first
+  for (int id = shared_data->next_agent_id - 1; id >= 0; id--)
   {
-    pthread_mutex_unlock(&shared_data->mutex);
-    return NULL;
+    if (shared_data->agent_demands[id].head == -1 && shared_data->agent_supplies[id].head == -1)
+      shared_data->free_agent_ids[shared_data->free_agent_id_count++] = id;
   }
+  pthread_mutex_unlock(&shared_data->agent_table_mutex);
+}
 
-  // Start building the response
-  snprintf(response, 1024, "There are %d supplies in total.\n", count);
-  strcat(response, "X      |Y      |A    |B    |C    |D      |\n");
-  strcat(response, "-------+-------+-----+-----+-----+-------+\n");
-
-  // Add each supply to the response
-  for (int i = 0; i < MAX_SUPPLIES; i++)
+static void init_locks()
+{
+  pthread_mutexattr_t mutexAttr;
+  pthread_mutexattr_init(&mutexAttr);
+  pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+  for (int i = 0; i < MAX_LOCK_STRIPES; i++)
   {
-    if (shared_data->supplies[i].agent_id == agent_id || (all && shared_data->supplies[i].agent_id != -1))
-    {
-      char line[128];
-      snprintf(line, sizeof(line), "%7d|%7d|%5d|%5d|%5d|%7d|\n",
-               shared_data->supplies[i].x, shared_data->supplies[i].y,
-               shared_data->supplies[i].nA, shared_data->supplies[i].nB,
-               shared_data->supplies[i].nC, shared_data->supplies[i].distance);
-      strcat(response, line);
-    }
+    pthread_mutex_init(&shared_data->stripe_locks[i], &mutexAttr);
   }
-
-  // Unlock the shared data mutex
-  pthread_mutex_unlock(&shared_data->mutex);
-
-  return response;
+  pthread_mutex_init(&shared_data->slot_mutex, &mutexAttr);
+  pthread_mutex_init(&shared_data->agent_table_mutex, &mutexAttr);
+  pthread_mutex_init(&shared_data->spill_mutex, &mutexAttr);
+  pthread_mutexattr_destroy(&mutexAttr);
+
+  pthread_rwlockattr_t rwlockAttr;
+  pthread_rwlockattr_init(&rwlockAttr);
+  pthread_rwlockattr_setpshared(&rwlockAttr, PTHREAD_PROCESS_SHARED);
+  pthread_rwlock_init(&shared_data->agent_state_lock, &rwlockAttr);
+  pthread_rwlockattr_destroy(&rwlockAttr);
 }
 
-char *create_demand_response(int agent_id, int all)
+// Changes whenever a server would read a segment differently from the one
+// that set it up
+static uint64_t segment_layout(int map_width, int map_height)
 {
-  // Lock the shared data mutex
-  pthread_mutex_lock(&shared_data->mutex);
-
-  // Count matching demands first
-  int count = 0, all_count = 0;
-  for (int i = 0; i < MAX_DEMANDS; i++)
+  uint64_t fields[] = {SEGMENT_VERSION, sizeof(shared_data_t), sizeof(demand_t), sizeof(supply_t),
+                       sizeof(notification_queue_t), sizeof(spill_chunk_t), DEMAND_LIMIT, SUPPLY_LIMIT,
+                       AGENT_LIMIT, NOTIFICATION_RING_BYTES, SPILL_CHUNK_LIMIT, slot_alloc_policy,
+                       (uint64_t)map_width, (uint64_t)map_height};
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
   {
-    if (shared_data->demands[i].agent_id == agent_id)
-    {
-      count++;
-    }
-    if (shared_data->demands[i].agent_id != -1)
-    {
-      all_count++;
-    }
+    hash = (hash ^ fields[i]) * 1099511628211ULL;
   }
-  if (all)
-    count = all_count;
+  return hash == 0 ? 1 : hash;
+}
 
-  // Allocate space for the response
-  char *response = malloc(1024 * sizeof(char));
-  if (response == NULL)
+// Takes over the tables of a segment an earlier server left. Its locks may
+// have died with their holders and everything that belonged to a connection
+// is stale, those are set up again. Returns -1 when the segment does not fit
+// this server or a table was left in the middle of a change.
+static int resume_segment(int map_width, int map_height)
+{
+  shared_data = arena_first_slice(arena);
+  if (shared_data->layout != segment_layout(map_width, map_height))
   {
-    pthread_mutex_unlock(&shared_data->mutex);
-    return NULL;
+    fprintf(stderr, "Debug: %s is from another build or map size, starting over\n", segment_path);
+    return -1;
   }
-
-  // Start building the response
-  snprintf(response, 1024, "There are %d demands in total.\n", count);
-  strcat(response, "X      |Y      |A    |B    |C    |\n");
-  strcat(response, "-------+-------+-----+-----+-----+\n");
-
-  // Add each demand to the response
-  for (int i = 0; i < MAX_DEMANDS; i++)
+  if (shared_data->demand_seq.writers != 0 || shared_data->supply_seq.writers != 0)
   {
-    if (shared_data->demands[i].agent_id == agent_id || (all && shared_data->demands[i].agent_id != -1))
-    {
-      char line[128];
-      snprintf(line, sizeof(line), "%7d|%7d|%5d|%5d|%5d|\n",
-               shared_data->demands[i].x, shared_data->demands[i].y,
-               shared_data->demands[i].nA, shared_data->demands[i].nB,
-               shared_data->demands[i].nC);
-      strcat(response, line);
-    }
+    fprintf(stderr, "Debug: %s was left in the middle of a change, starting over\n", segment_path);
+    return -1;
+  }
+
+  init_locks();
+  pthread_mutexattr_t mutexAttr;
+  pthread_mutexattr_init(&mutexAttr);
+  pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+  for (int i = 0; i < shared_data->agent_capacity; i++)
+  {
+    reset_agent(i, &mutexAttr);
+  }
+  pthread_mutexattr_destroy(&mutexAttr);
+  grid_init(&shared_data->watch_grid, shared_data->watch_links, shared_data->agent_capacity,
+            0, 0, map_width, map_height);
+
+  // Rings and spill chunks only held notifications for the old connections
+  arena_release(arena, shared_data->notification_rings, (size_t)shared_data->rings_created * NOTIFICATION_RING_BYTES);
+  arena_release(arena, shared_data->spill_chunks, (size_t)shared_data->spill_chunks_created * sizeof(spill_chunk_t));
+  shared_data->free_ring_count = 0;
+  shared_data->rings_created = 0;
+  shared_data->free_spill_chunk = -1;
+  shared_data->spill_chunks_created = 0;
+  shared_data->retired_dropped = 0;
+  shared_data->retired_spilled = 0;
+  shared_data->retired_blocked = 0;
+  shared_data->lock_stripes = lock_stripe_count;
+  shared_data->server_pid = getpid();
+  rebuild_free_agent_ids();
+  match_kernel_select(match_kernel);
+  return 0;
+}
+
+void init_shared_memory(int map_width, int map_height)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  // Reserve the address space for every table, only the header is backed yet
+  size_t initial = sizeof(arena_t) + sizeof(shared_data_t);
+  int resumed = 0;
+  if (segment_path == NULL)
+    arena = arena_create(arena_reserve(), initial);
+  else
+    arena = arena_open(segment_path, arena_reserve(), initial, &resumed);
+  if (resumed)
+  {
+    if (resume_segment(map_width, map_height) == 0)
+    {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      segment_resumed = 1;
+      fprintf(stderr, "Debug: resumed %d demands and %d supplies from %s in %.2f ms\n", shared_data->demand_slots.live,
+             shared_data->supply_slots.live, segment_path,
+             (now.tv_sec - start.tv_sec) * 1e3 + (now.tv_nsec - start.tv_nsec) / 1e6);
+      return;
+    }
+    arena_destroy(arena);
+    arena = arena_open(segment_path, arena_reserve(), initial, NULL);
+  }
+  if (arena == NULL)
+  {
+    fprintf(stderr, "initialize shared memory problem\n");
+    exit(EXIT_FAILURE);
+  }
+  shared_data = carve(sizeof(shared_data_t));
+
+  void *demand_slot_storage = carve(slot_table_storage(DEMAND_LIMIT));
+  shared_data->demands = carve((size_t)DEMAND_LIMIT * sizeof(demand_t));
+  shared_data->demand_links = carve((size_t)DEMAND_LIMIT * sizeof(grid_link_t));
+  shared_data->demand_cols.agent_id = carve((size_t)DEMAND_LIMIT * sizeof(int));
+  shared_data->demand_cols.x = carve((size_t)DEMAND_LIMIT * sizeof(int));
+  shared_data->demand_cols.y = carve((size_t)DEMAND_LIMIT * sizeof(int));
+  shared_data->demand_cols.nA = carve((size_t)DEMAND_LIMIT * sizeof(int));
+  shared_data->demand_cols.nB = carve((size_t)DEMAND_LIMIT * sizeof(int));
+  shared_data->demand_cols.nC = carve((size_t)DEMAND_LIMIT * sizeof(int));
+
+  void *supply_slot_storage = carve(slot_table_storage(SUPPLY_LIMIT));
+  shared_data->supplies = carve((size_t)SUPPLY_LIMIT * sizeof(supply_t));
+  shared_data->supply_links = carve((size_t)SUPPLY_LIMIT * sizeof(grid_link_t));
+  shared_data->supply_cols.agent_id = carve((size_t)SUPPLY_LIMIT * sizeof(int));
+  shared_data->supply_cols.x = carve((size_t)SUPPLY_LIMIT * sizeof(int));
+  shared_data->supply_cols.y = carve((size_t)SUPPLY_LIMIT * sizeof(int));
+  shared_data->supply_cols.nA = carve((size_t)SUPPLY_LIMIT * sizeof(int));
+  shared_data->supply_cols.nB = carve((size_t)SUPPLY_LIMIT * sizeof(int));
+  shared_data->supply_cols.nC = carve((size_t)SUPPLY_LIMIT * sizeof(int));
+  shared_data->supply_cols.distance = carve((size_t)SUPPLY_LIMIT * sizeof(int));
+
+  shared_data->owner_locks = carve((size_t)AGENT_LIMIT * sizeof(pthread_mutex_t));
+  shared_data->watches = carve((size_t)AGENT_LIMIT * sizeof(watch_t));
+  shared_data->watch_links = carve((size_t)AGENT_LIMIT * sizeof(grid_link_t));
+  shared_data->agent_positions = carve((size_t)AGENT_LIMIT * sizeof(int[2]));
+  shared_data->agent_demands = carve((size_t)AGENT_LIMIT * sizeof(owner_list_t));
+  shared_data->agent_supplies = carve((size_t)AGENT_LIMIT * sizeof(owner_list_t));
+  shared_data->notification_queue = carve((size_t)AGENT_LIMIT * sizeof(notification_queue_t));
+  shared_data->free_rings = carve((size_t)AGENT_LIMIT * sizeof(int));
+  shared_data->free_agent_ids = carve((size_t)AGENT_LIMIT * sizeof(int));
+  shared_data->spill_chunks = carve((size_t)SPILL_CHUNK_LIMIT * sizeof(spill_chunk_t));
+  shared_data->notification_rings = carve((size_t)AGENT_LIMIT * NOTIFICATION_RING_BYTES);
+
+  // Initialize shared data and synchronization primitives
+  shared_data->lock_stripes = lock_stripe_count;
+  init_locks();
+
+  // Initialize other fields
+  shared_data->map_width = map_width;
+  shared_data->map_height = map_height;
+  shared_data->next_agent_id = 0;
+  shared_data->free_agent_id_count = 0;
+  shared_data->retired_dropped = 0;
+  shared_data->retired_spilled = 0;
+  shared_data->retired_blocked = 0;
+  shared_data->server_pid = getpid();
+  shared_data->agent_capacity = 0;
+  shared_data->free_ring_count = 0;
+  shared_data->rings_created = 0;
+  shared_data->free_spill_chunk = -1;
+  shared_data->spill_chunks_created = 0;
+  memset(&shared_data->demand_seq, 0, sizeof(shared_data->demand_seq));
+  memset(&shared_data->supply_seq, 0, sizeof(shared_data->supply_seq));
+  // The slot bitmaps are committed whole, they take a few bits per slot
+  if (arena_commit(arena, (char *)demand_slot_storage + slot_table_storage(DEMAND_LIMIT)) == -1 ||
+      arena_commit(arena, (char *)supply_slot_storage + slot_table_storage(SUPPLY_LIMIT)) == -1)
+  {
+    fprintf(stderr, "initialize shared memory problem: cannot back the slot tables\n");
+    exit(EXIT_FAILURE);
+  }
+  slot_table_init(&shared_data->demand_slots, demand_slot_storage, DEMAND_LIMIT, 0, slot_alloc_policy);
+  slot_table_init(&shared_data->supply_slots, supply_slot_storage, SUPPLY_LIMIT, 0, slot_alloc_policy);
+  match_kernel_select(match_kernel);
+  grid_init(&shared_data->supply_grid, shared_data->supply_links, 0,
+            0, 0, map_width, map_height);
+  rotated_grid_init(&shared_data->demand_grid, shared_data->demand_links, 0,
+                    map_width, map_height);
+  grid_init(&shared_data->watch_grid, shared_data->watch_links, 0,
+            0, 0, map_width, map_height);
+
+  if (grow_demands(INITIAL_DEMANDS) == -1 || grow_supplies(INITIAL_SUPPLIES) == -1 ||
+      grow_agents(INITIAL_AGENTS) == -1)
+  {
+    fprintf(stderr, "initialize shared memory problem: cannot back the initial tables\n");
+    exit(EXIT_FAILURE);
+  }
+  // Last, a server that dies while setting the segment up leaves none to resume
+  __atomic_store_n(&shared_data->layout, segment_layout(map_width, map_height), __ATOMIC_RELEASE);
+}
+
+void destroy_shared_memory()
+{
+  for (int i = 0; i < MAX_LOCK_STRIPES; i++)
+  {
+    pthread_mutex_destroy(&shared_data->stripe_locks[i]);
+  }
+  pthread_mutex_destroy(&shared_data->slot_mutex);
+  pthread_mutex_destroy(&shared_data->agent_table_mutex);
+  for (int i = 0; i < shared_data->agent_capacity; i++)
+  {
+    pthread_mutex_destroy(&shared_data->owner_locks[i]);
+  }
+  pthread_rwlock_destroy(&shared_data->agent_state_lock);
+
+  // Unmap shared memory
+  arena_destroy(arena);
+  arena = NULL;
+  shared_data = NULL;
+}
+
+static unsigned char *ring_bytes(int ring)
+{
+  return shared_data->notification_rings + (size_t)ring * NOTIFICATION_RING_BYTES;
+}
+
+// Rings are attached to an agent id for as long as the agent is connected,
+// caller holds agent_table_mutex
+static int attach_ring(int agent_id)
+{
+  int ring;
+  if (shared_data->free_ring_count > 0)
+  {
+    ring = shared_data->free_rings[--shared_data->free_ring_count];
+  }
+  else
+  {
+    ring = shared_data->rings_created;
+    if (commit_entries(shared_data->notification_rings, NOTIFICATION_RING_BYTES, ring + 1) == -1)
+      return -1;
+    shared_data->rings_created++;
+  }
+  // A reused id had its ring detached and no producer touches the queue before ring is set
+  notification_queue_t *queue = &shared_data->notification_queue[agent_id];
+  queue->head = 0;
+  queue->tail = 0;
+  queue->waiting = NOTIFY_AWAKE;
+  __atomic_store_n(&queue->ring, ring, __ATOMIC_SEQ_CST);
+  return 0;
+}
+
+// Returns a list of spill chunks to the pool
+static void release_spill_chunks(int first, int last)
+{
+  if (first == -1)
+    return;
+  pthread_mutex_lock(&shared_data->spill_mutex);
+  shared_data->spill_chunks[last].next = shared_data->free_spill_chunk;
+  shared_data->free_spill_chunk = first;
+  pthread_mutex_unlock(&shared_data->spill_mutex);
+}
+
+// Notifications for the agent are dropped from now on, the ring's memory goes
+// back to the system until another agent picks it up
+static void detach_ring(int agent_id)
+{
+  notification_queue_t *queue = &shared_data->notification_queue[agent_id];
+  int ring = __atomic_exchange_n(&queue->ring, -1, __ATOMIC_SEQ_CST);
+  if (ring == -1)
+    return;
+  // A producer that saw the ring attached may still be writing into it
+  while (__atomic_load_n(&queue->writers, __ATOMIC_SEQ_CST) != 0)
+  {
+    sched_yield();
+  }
+
+  pthread_mutex_lock(&queue->mutex);
+  release_spill_chunks(queue->spill_first, queue->spill_last);
+  queue->spill_first = -1;
+  queue->spill_last = -1;
+  queue->spill_chunks = 0;
+  queue->spilling = 0;
+  pthread_mutex_unlock(&queue->mutex);
+
+  arena_release(arena, ring_bytes(ring), NOTIFICATION_RING_BYTES);
+  pthread_mutex_lock(&shared_data->agent_table_mutex);
+  shared_data->free_rings[shared_data->free_ring_count++] = ring;
+  pthread_mutex_unlock(&shared_data->agent_table_mutex);
+}
+
+static size_t payload_size(notification_type_t type)
+{
+  switch (type)
+  {
+  case DEMAND_FULFILLED:
+    return sizeof(demand_fulfilled_t);
+  case SUPPLY_DELIVERED:
+    return sizeof(supply_delivered_t);
+  case SUPPLY_ADDED:
+    return sizeof(supply_added_t);
+  default:
+    return 0;
+  }
+}
+
+// Header plus payload, rounded up so the next header is 8 byte aligned too
+static unsigned int record_size(notification_type_t type)
+{
+  return (sizeof(unsigned long long) + payload_size(type) + 7) & ~7u;
+}
+
+// Stamped with pos + 1 so that a zeroed ring holds no published record
+static unsigned long long record_header(unsigned long long pos, notification_type_t type)
+{
+  return ((pos + 1) << 8) | type;
+}
+
+static unsigned long long *header_at(unsigned char *ring, unsigned long long pos)
+{
+  return (unsigned long long *)(ring + (pos & (NOTIFICATION_RING_BYTES - 1)));
+}
+
+// Type of the record published at pos, -1 if it is not published yet
+static int published_type(unsigned char *ring, unsigned long long pos)
+{
+  unsigned long long header = __atomic_load_n(header_at(ring, pos), __ATOMIC_ACQUIRE);
+  if (header >> 8 != ((pos + 1) & (~0ULL >> 8)))
+    return -1;
+  return header & 0xff;
+}
+
+// Ring positions wrap, a payload may continue at the start of the ring
+static void ring_write(unsigned char *ring, unsigned long long pos, const void *src, size_t len)
+{
+  size_t at = pos & (NOTIFICATION_RING_BYTES - 1);
+  size_t first = len < NOTIFICATION_RING_BYTES - at ? len : NOTIFICATION_RING_BYTES - at;
+  memcpy(ring + at, src, first);
+  memcpy(ring, (const unsigned char *)src + first, len - first);
+}
+
+static void ring_read(const unsigned char *ring, unsigned long long pos, void *dst, size_t len)
+{
+  size_t at = pos & (NOTIFICATION_RING_BYTES - 1);
+  size_t first = len < NOTIFICATION_RING_BYTES - at ? len : NOTIFICATION_RING_BYTES - at;
+  memcpy(dst, ring + at, first);
+  memcpy((unsigned char *)dst + first, ring, len - first);
+}
+
+// Reserves size bytes at the tail, -1 when the ring has no room for them
+static int reserve_record(notification_queue_t *queue, unsigned int size, unsigned long long *pos)
+{
+  unsigned long long tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+  while (1)
+  {
+    unsigned long long head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail + size - head > NOTIFICATION_RING_BYTES)
+      return -1;
+    if (__atomic_compare_exchange_n(&queue->tail, &tail, tail + size, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      *pos = tail;
+      return 0;
+    }
+  }
+}
+
+// Takes the oldest record off the ring unread. Returns -1 if it is still
+// being written, there is nothing to evict then without losing order.
+static int evict_oldest(notification_queue_t *queue, unsigned char *ring)
+{
+  unsigned long long head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+  int type = published_type(ring, head);
+  if (type == -1)
+    return head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) ? 0 : -1;
+  // Losing the race to the consumer or another producer frees room as well
+  if (__atomic_compare_exchange_n(&queue->head, &head, head + record_size(type), 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+// Queues a notification behind the ring while the agent is behind, returns -1
+// when the pool or the agent's share of it is used up. Caller holds the queue
+// mutex.
+static int spill_record(notification_queue_t *queue, const notification_t *notif)
+{
+  int last = queue->spill_last;
+  if (last == -1 || shared_data->spill_chunks[last].count == SPILL_CHUNK_RECORDS)
+  {
+    if (queue->spill_chunks == SPILL_AGENT_CHUNKS)
+      return -1;
+    pthread_mutex_lock(&shared_data->spill_mutex);
+    int chunk = shared_data->free_spill_chunk;
+    if (chunk != -1)
+    {
+      shared_data->free_spill_chunk = shared_data->spill_chunks[chunk].next;
+    }
+    else if (shared_data->spill_chunks_created < SPILL_CHUNK_LIMIT &&
+             commit_entries(shared_data->spill_chunks, sizeof(spill_chunk_t),
+                            shared_data->spill_chunks_created + 1) == 0)
+    {
+      chunk = shared_data->spill_chunks_created++;
+    }
+    pthread_mutex_unlock(&shared_data->spill_mutex);
+    if (chunk == -1)
+      return -1;
+
+    shared_data->spill_chunks[chunk].next = -1;
+    shared_data->spill_chunks[chunk].count = 0;
+    if (last == -1)
+      queue->spill_first = chunk;
+    else
+      shared_data->spill_chunks[last].next = chunk;
+    queue->spill_last = chunk;
+    queue->spill_chunks++;
+    last = chunk;
+  }
+  spill_chunk_t *spill = &shared_data->spill_chunks[last];
+  spill->records[spill->count++] = *notif;
+  __atomic_add_fetch(&queue->spilled, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static void futex_wait(int *word, int value)
+{
+  syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+static void futex_wake(int *word)
+{
+  syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Abstract socket name, nothing to clean up on disk and private to this server
+static socklen_t wakeup_address(int agent_id, struct sockaddr_un *addr)
+{
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "supdemserv-%d-%d",
+                     shared_data->server_pid, agent_id);
+  return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+static void send_wakeup(int agent_id)
+{
+  int fd = __atomic_load_n(&wake_socket, __ATOMIC_ACQUIRE);
+  if (fd == -1)
+  {
+    int created = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (created == -1)
+      return;
+    if (!__atomic_compare_exchange_n(&wake_socket, &fd, created, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      close(created);
+    else
+      fd = created;
+  }
+  struct sockaddr_un addr;
+  socklen_t len = wakeup_address(agent_id, &addr);
+  char byte = 0;
+  // A full socket is readable already, the wakeup is not needed then
+  sendto(fd, &byte, 1, MSG_DONTWAIT, (struct sockaddr *)&addr, len);
+}
+
+// Producers only make a syscall when the agent said it is going to sleep,
+// the one that moves it back to awake does the wakeup
+static void wake_agent(int agent_id)
+{
+  notification_queue_t *queue = &shared_data->notification_queue[agent_id];
+  // The record must be visible before the agent's state is read, the agent
+  // does the opposite when it goes to sleep
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int state = __atomic_load_n(&queue->waiting, __ATOMIC_RELAXED);
+  if (state != NOTIFY_WAIT_FUTEX && state != NOTIFY_WAIT_FD)
+    return;
+  if (!__atomic_compare_exchange_n(&queue->waiting, &state, NOTIFY_AWAKE, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return;
+  if (state == NOTIFY_WAIT_FUTEX)
+    futex_wake(&queue->waiting);
+  else
+    send_wakeup(agent_id);
+}
+
+static long long elapsed_ms(const struct timespec *since)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1000LL + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// Places a notification in the agent's ring, or where the overflow policy
+// puts it when the ring is full. Returns 1 if it was queued.
+static int queue_notification(int agent_id, notification_queue_t *queue, unsigned char *ring,
+                              const notification_t *notif)
+{
+  unsigned int size = record_size(notif->type);
+  struct timespec wait_start;
+  int waiting = 0;
+  while (1)
+  {
+    // Once records spill, newer ones follow them until the agent caught up
+    if (__atomic_load_n(&queue->spilling, __ATOMIC_ACQUIRE))
+    {
+      pthread_mutex_lock(&queue->mutex);
+      int queued = 0;
+      int spilling = queue->spilling;
+      if (spilling)
+      {
+        queued = spill_record(queue, notif) == 0;
+        if (!queued)
+          __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+      }
+      pthread_mutex_unlock(&queue->mutex);
+      if (spilling)
+        return queued;
+    }
+
+    unsigned long long pos;
+    if (reserve_record(queue, size, &pos) == 0)
+    {
+      ring_write(ring, pos + sizeof(unsigned long long), &notif->fulfilled, payload_size(notif->type)); // every payload starts at the union
+      __atomic_store_n(header_at(ring, pos), record_header(pos, notif->type), __ATOMIC_RELEASE);
+      return 1;
+    }
+
+    if (notify_overflow == NOTIFY_OVERFLOW_DROP_OLDEST)
+    {
+      if (evict_oldest(queue, ring) == -1)
+      {
+        __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+      }
+    }
+    else if (notify_overflow == NOTIFY_OVERFLOW_SPILL)
+    {
+      pthread_mutex_lock(&queue->mutex);
+      __atomic_store_n(&queue->spilling, 1, __ATOMIC_RELEASE);
+      pthread_mutex_unlock(&queue->mutex);
+    }
+    else
+    {
+      // Block: keep the agent awake until it made room or the wait timed out
+      if (!waiting)
+      {
+        waiting = 1;
+        clock_gettime(CLOCK_MONOTONIC, &wait_start);
+        __atomic_add_fetch(&queue->blocked, 1, __ATOMIC_RELAXED);
+      }
+      else if (elapsed_ms(&wait_start) >= NOTIFY_BLOCK_MS ||
+               __atomic_load_n(&queue->ring, __ATOMIC_SEQ_CST) == -1)
+      {
+        __atomic_add_fetch(&queue->dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+      }
+      wake_agent(agent_id);
+      struct timespec pause = {0, 50000};
+      nanosleep(&pause, NULL);
+    }
+  }
+}
+
+// Appends to the agent's ring and wakes its notification thread. The
+// notification is dropped when the agent has left.
+static void send_notification(int agent_id, const notification_t *notif)
+{
+  notification_queue_t *queue = &shared_data->notification_queue[agent_id];
+  __atomic_add_fetch(&queue->writers, 1, __ATOMIC_SEQ_CST);
+  int ring = __atomic_load_n(&queue->ring, __ATOMIC_SEQ_CST);
+  int queued = ring != -1 && queue_notification(agent_id, queue, ring_bytes(ring), notif);
+  __atomic_sub_fetch(&queue->writers, 1, __ATOMIC_RELEASE);
+  if (queued)
+    wake_agent(agent_id);
+}
+
+void notification_stats(int agent_id, notification_stats_t *agent, notification_stats_t *server)
+{
+  memset(agent, 0, sizeof(*agent));
+  // Under agent_table_mutex no agent moves its counters to the retired ones
+  pthread_mutex_lock(&shared_data->agent_table_mutex);
+  server->dropped = shared_data->retired_dropped;
+  server->spilled = shared_data->retired_spilled;
+  server->blocked = shared_data->retired_blocked;
+  int count = shared_data->agent_capacity;
+  for (int i = 0; i < count; i++)
+  {
+    notification_queue_t *queue = &shared_data->notification_queue[i];
+    notification_stats_t stats;
+    stats.dropped = __atomic_load_n(&queue->dropped, __ATOMIC_RELAXED);
+    stats.spilled = __atomic_load_n(&queue->spilled, __ATOMIC_RELAXED);
+    stats.blocked = __atomic_load_n(&queue->blocked, __ATOMIC_RELAXED);
+    server->dropped += stats.dropped;
+    server->spilled += stats.spilled;
+    server->blocked += stats.blocked;
+    if (i == agent_id)
+      *agent = stats;
+  }
+  pthread_mutex_unlock(&shared_data->agent_table_mutex);
+}
+
+// Agent positions and watches change rarely and are read on every add
+static void read_position(int agent_id, int *x, int *y)
+{
+  pthread_rwlock_rdlock(&shared_data->agent_state_lock);
+  *x = shared_data->agent_positions[agent_id][0];
+  *y = shared_data->agent_positions[agent_id][1];
+  pthread_rwlock_unlock(&shared_data->agent_state_lock);
+}
+
+// Takes a slot for the demand and enters it everywhere but in a match, caller
+// holds the stripe of the demand. Returns the slot, -1 when the table is full.
+static int store_demand(int agent_id, int x, int y, int nA, int nB, int nC)
+{
+  begin_table_write(&shared_data->demand_seq);
+  pthread_mutex_lock(&shared_data->slot_mutex);
+  int empty_demand_index = slot_alloc(&shared_data->demand_slots);
+  if (empty_demand_index == -1 && grow_demands(2 * shared_data->demand_slots.capacity) == 0)
+    empty_demand_index = slot_alloc(&shared_data->demand_slots);
+  pthread_mutex_unlock(&shared_data->slot_mutex);
+  if (empty_demand_index == -1)
+  {
+    printf("Debug: exceeded max demands\n");
+    end_table_write(&shared_data->demand_seq);
+    return -1;
+  }
+  demand_t *demand = &shared_data->demands[empty_demand_index];
+  demand->agent_id = agent_id;
+  demand->x = x;
+  demand->y = y;
+  demand->nA = nA;
+  demand->nB = nB;
+  demand->nC = nC;
+  sync_demand_columns(empty_demand_index);
+  link_owned_demand(agent_id, empty_demand_index);
+  rotated_grid_insert(&shared_data->demand_grid, shared_data->demand_links, empty_demand_index, x, y);
+  log_demand(WAL_ADD_DEMAND, empty_demand_index);
+  end_table_write(&shared_data->demand_seq);
+  return empty_demand_index;
+}
+
+// Caller holds the stripes of the demand and of the supplies within reach.
+// Refused once the write-ahead log failed, the change could not be kept.
+static int insert_demand(int agent_id, int x, int y, int nA, int nB, int nC, int reach)
+{
+  if (wal_failed())
+    return -1;
+  int demand_id = store_demand(agent_id, x, y, nA, nB, nC);
+  if (demand_id != -1)
+    check_match(agent_id, demand_id, 1, reach);
+  return demand_id;
+}
+
+int add_demand(int agent_id, int nA, int nB, int nC)
+{
+  int x;
+  int y;
+  int reach;
+  read_position(agent_id, &x, &y);
+  uint64_t stripes = lock_demand_stripes(x, y, &reach);
+  int demand_id = insert_demand(agent_id, x, y, nA, nB, nC, reach);
+  unlock_stripes(stripes);
+  return demand_id == -1 ? -1 : 0;
+}
+
+int add_demand_nolock(int agent_id, int nA, int nB, int nC)
+{
+  int x = shared_data->agent_positions[agent_id][0];
+  int y = shared_data->agent_positions[agent_id][1];
+  int demand_id = insert_demand(agent_id, x, y, nA, nB, nC, grid_reach(&shared_data->supply_grid));
+  return demand_id == -1 ? -1 : 0;
+}
+
+int remove_demand(int agent_id, int demand_id)
+{
+  uint64_t stripes = all_stripes();
+  lock_stripes(stripes);
+  int result = remove_demand_nolock(agent_id, demand_id);
+  unlock_stripes(stripes);
+  return result;
+}
+
+// A new supply as seen by the watchers around it
+typedef struct
+{
+  int agent_id;
+  int supply_id;
+  int x;
+  int y;
+  int distance;
+  int nA;
+  int nB;
+  int nC;
+} watch_fanout_t;
+
+static int notify_watcher(int watcher_id, void *ctx)
+{
+  watch_fanout_t *fanout = ctx;
+  watch_t *watch = &shared_data->watches[watcher_id];
+  if (watch->agent_id == fanout->agent_id)
+    return 0;
+  int manhattan_distance = abs(watch->x - fanout->x) + abs(watch->y - fanout->y);
+  if (manhattan_distance > watch->distance)
+    return 0;
+
+  // Prepare notification
+  notification_t notif;
+  notif.type = SUPPLY_ADDED;
+  notif.added.supplyX = fanout->x;
+  notif.added.supplyY = fanout->y;
+  notif.added.supplyA = fanout->nA;
+  notif.added.supplyB = fanout->nB;
+  notif.added.supplyC = fanout->nC;
+  send_notification(watch->agent_id, &notif);
+  return 0;
+}
+
+// Caller holds agent_state_lock
+static void notify_watchers(watch_fanout_t *fanout)
+{
+  grid_visit_covering(&shared_data->watch_grid, shared_data->watch_links, fanout->x, fanout->y,
+                      grid_reach(&shared_data->watch_grid), notify_watcher, fanout);
+}
+
+static int store_supply(int agent_id, int x, int y, int distance, int nA, int nB, int nC)
+{
+  begin_table_write(&shared_data->supply_seq);
+  pthread_mutex_lock(&shared_data->slot_mutex);
+  int empty_supply_index = slot_alloc(&shared_data->supply_slots);
+  if (empty_supply_index == -1 && grow_supplies(2 * shared_data->supply_slots.capacity) == 0)
+    empty_supply_index = slot_alloc(&shared_data->supply_slots);
+  pthread_mutex_unlock(&shared_data->slot_mutex);
+  if (empty_supply_index == -1)
+  {
+    printf("Debug: exceeded max supplies\n");
+    end_table_write(&shared_data->supply_seq);
+    return -1;
+  }
+  supply_t *supply = &shared_data->supplies[empty_supply_index];
+  supply->agent_id = agent_id;
+  supply->x = x;
+  supply->y = y;
+  supply->distance = distance;
+  supply->nA = nA;
+  supply->nB = nB;
+  supply->nC = nC;
+  sync_supply_columns(empty_supply_index);
+  link_owned_supply(agent_id, empty_supply_index);
+  grid_insert(&shared_data->supply_grid, shared_data->supply_links, empty_supply_index, x, y, distance);
+  log_supply(WAL_ADD_SUPPLY, empty_supply_index);
+  end_table_write(&shared_data->supply_seq);
+  return empty_supply_index;
+}
+
+// Caller holds the stripes of the supply and of the demands it can reach
+static int insert_supply(int agent_id, int x, int y, int distance, int nA, int nB, int nC)
+{
+  if (wal_failed())
+    return -1;
+  int supply_id = store_supply(agent_id, x, y, distance, nA, nB, nC);
+  if (supply_id != -1)
+    check_match(agent_id, supply_id, 0, 0);
+  return supply_id;
+}
+
+int add_supply(int agent_id, int distance, int nA, int nB, int nC)
+{
+  int x;
+  int y;
+  read_position(agent_id, &x, &y);
+  uint64_t stripes = lock_supply_stripes(x, y, distance);
+  int supply_id = insert_supply(agent_id, x, y, distance, nA, nB, nC);
+  unlock_stripes(stripes);
+  if (supply_id == -1)
+    return -1;
+
+  // Watchers only need the values above, the stripes are already released
+  watch_fanout_t fanout = {agent_id, supply_id, x, y, distance, nA, nB, nC};
+  pthread_rwlock_rdlock(&shared_data->agent_state_lock);
+  notify_watchers(&fanout);
+  pthread_rwlock_unlock(&shared_data->agent_state_lock);
+  return 0;
+}
+
+int add_supply_nolock(int agent_id, int distance, int nA, int nB, int nC)
+{
+  int x = shared_data->agent_positions[agent_id][0];
+  int y = shared_data->agent_positions[agent_id][1];
+  int supply_id = insert_supply(agent_id, x, y, distance, nA, nB, nC);
+  if (supply_id == -1)
+    return -1;
+
+  watch_fanout_t fanout = {agent_id, supply_id, x, y, distance, nA, nB, nC};
+  notify_watchers(&fanout);
+  return 0;
+}
+
+int remove_supply(int agent_id, int supply_id)
+{
+  uint64_t stripes = all_stripes();
+  lock_stripes(stripes);
+  int result = remove_supply_nolock(agent_id, supply_id);
+  unlock_stripes(stripes);
+  return result;
+}
+
+// Caller holds agent_state_lock for writing
+static void clear_watch(int agent_id)
+{
+  grid_remove(&shared_data->watch_grid, shared_data->watch_links, agent_id);
+  shared_data->watches[agent_id].agent_id = -1;
+  shared_data->watches[agent_id].x = 0;
+  shared_data->watches[agent_id].y = 0;
+  shared_data->watches[agent_id].distance = 0;
+}
+
+int add_watch(int agent_id, int distance)
+{
+  pthread_rwlock_wrlock(&shared_data->agent_state_lock);
+  add_watch_nolock(agent_id, distance);
+  pthread_rwlock_unlock(&shared_data->agent_state_lock);
+  return 0;
+}
+
+int add_watch_nolock(int agent_id, int distance)
+{
+  int x = shared_data->agent_positions[agent_id][0];
+  int y = shared_data->agent_positions[agent_id][1];
+  clear_watch(agent_id);
+  watch_t *watch = &shared_data->watches[agent_id];
+  watch->agent_id = agent_id;
+  watch->x = x;
+  watch->y = y;
+  watch->distance = distance;
+  // Only watches with a positive distance get notified, only those are indexed
+  if (distance > 0)
+    grid_insert(&shared_data->watch_grid, shared_data->watch_links, agent_id, x, y, distance);
+  return 0;
+}
+
+int remove_watch(int agent_id)
+{
+  pthread_rwlock_wrlock(&shared_data->agent_state_lock);
+  clear_watch(agent_id);
+  pthread_rwlock_unlock(&shared_data->agent_state_lock);
+  return 0;
+}
+
+int remove_watch_nolock(int agent_id)
+{
+  clear_watch(agent_id);
+  return 0;
+}
+
+int move(int agent_id, int x, int y)
+{
+  if (agent_id >= shared_data->agent_capacity)
+  {
+    return -1;
+  }
+  pthread_rwlock_wrlock(&shared_data->agent_state_lock);
+  shared_data->agent_positions[agent_id][0] = x;
+  shared_data->agent_positions[agent_id][1] = y;
+  pthread_rwlock_unlock(&shared_data->agent_state_lock);
+  return 0;
+}
+
+int move_nolock(int agent_id, int x, int y)
+{
+  if (agent_id >= shared_data->agent_capacity)
+  {
+    return -1;
+  }
+  shared_data->agent_positions[agent_id][0] = x;
+  shared_data->agent_positions[agent_id][1] = y;
+  return 0;
+}
+
+// Batches run the _nolock variants between these, nothing else can touch the
+// tables, watches or positions meanwhile. The whole batch is one table write
+// so lock-free listings never see part of it.
+void lock_all_tables()
+{
+  lock_stripes(all_stripes());
+  pthread_rwlock_wrlock(&shared_data->agent_state_lock);
+  begin_table_write(&shared_data->demand_seq);
+  begin_table_write(&shared_data->supply_seq);
+}
+
+void unlock_all_tables()
+{
+  end_table_write(&shared_data->supply_seq);
+  end_table_write(&shared_data->demand_seq);
+  pthread_rwlock_unlock(&shared_data->agent_state_lock);
+  unlock_stripes(all_stripes());
+}
+
+int free_demand_slots()
+{
+  return DEMAND_LIMIT - shared_data->demand_slots.live;
+}
+
+int free_supply_slots()
+{
+  return SUPPLY_LIMIT - shared_data->supply_slots.live;
+}
+
+typedef struct
+{
+  int id;
+  int best;
+} match_search_t;
+
+static int visit_supply_candidate(int supply_id, void *ctx)
+{
+  match_search_t *search = ctx;
+  if ((search->best == -1 || supply_id < search->best) && check_case(search->id, supply_id))
+  {
+    search->best = supply_id;
+  }
+  return 0;
+}
+
+static int visit_demand_candidate(int demand_id, void *ctx)
+{
+  match_search_t *search = ctx;
+  if ((search->best == -1 || demand_id < search->best) && check_case(demand_id, search->id))
+  {
+    search->best = demand_id;
+  }
+  return 0;
+}
+
+// Full table scans, batched 64 slots at a time over the column copies
+static int scan_matching_supply(int demand_id)
+{
+  return kernel_first_supply(&shared_data->supply_cols, &shared_data->supply_slots,
+                             &shared_data->demands[demand_id]);
+}
+
+static int scan_matching_demand(int supply_id)
+{
+  return kernel_first_demand(&shared_data->demand_cols, &shared_data->demand_slots,
+                             &shared_data->supplies[supply_id]);
+}
+
+// Lowest indexed supply that can serve the demand, same pick as a full table scan
+static int find_matching_supply(int demand_id, int reach)
+{
+  if (match_index_mode == MATCH_INDEX_SCAN)
+    return scan_matching_supply(demand_id);
+
+  match_search_t search = {demand_id, -1};
+  grid_visit_covering(&shared_data->supply_grid, shared_data->supply_links,
+                      shared_data->demands[demand_id].x, shared_data->demands[demand_id].y, reach,
+                      visit_supply_candidate, &search);
+  if (match_index_mode == MATCH_INDEX_VERIFY)
+  {
+    int expected = scan_matching_supply(demand_id);
+    if (expected != search.best)
+    {
+      fprintf(stderr, "Debug: supply index picked %d, scan picked %d for demand %d\n",
+              search.best, expected, demand_id);
+      return expected;
+    }
+  }
+  return search.best;
+}
+
+// Lowest indexed demand the supply can serve, same pick as a full table scan
+static int find_matching_demand(int supply_id)
+{
+  if (match_index_mode == MATCH_INDEX_SCAN)
+    return scan_matching_demand(supply_id);
+
+  // check_case wants the distance strictly greater than the Manhattan distance
+  supply_t *supply = &shared_data->supplies[supply_id];
+  int reach = supply->distance > 0 ? supply->distance - 1 : -1;
+  match_search_t search = {supply_id, -1};
+  rotated_grid_visit_within(&shared_data->demand_grid, shared_data->demand_links,
+                            supply->x, supply->y, reach, visit_demand_candidate, &search);
+  if (match_index_mode == MATCH_INDEX_VERIFY)
+  {
+    int expected = scan_matching_demand(supply_id);
+    if (expected != search.best)
+    {
+      fprintf(stderr, "Debug: demand index picked %d, scan picked %d for supply %d\n",
+              search.best, expected, supply_id);
+      return expected;
+    }
+  }
+  return search.best;
+}
+
+static void notify_supply_removed(int agent_id)
+{
+  notification_t notif;
+  notif.type = SUPPLY_REMOVED;
+  send_notification(agent_id, &notif);
+}
+
+int check_match(int agent_id, int demand_or_supply_id, int is_demand, int reach)
+{
+  int had_a_match = 0;
+  int supplier_agent_id = -1;
+  int demander_agent_id = -1;
+  int demandX = 0;
+  int demandY = 0;
+  int demandA = 0;
+  int demandB = 0;
+  int demandC = 0;
+  int supplyX = 0;
+  int supplyY = 0;
+  int supplyA = 0;
+  int supplyB = 0;
+  int supplyC = 0;
+  int supplyDistance = 0;
+  int supply_gone = 0;
+  if (is_demand)
+  {
+    int i = find_matching_supply(demand_or_supply_id, reach);
+    if (i != -1)
+    {
+      supplier_agent_id = shared_data->supplies[i].agent_id;
+      demander_agent_id = agent_id;
+      supplyX = shared_data->supplies[i].x;
+      supplyY = shared_data->supplies[i].y;
+      supplyA = shared_data->supplies[i].nA;
+      supplyB = shared_data->supplies[i].nB;
+      supplyC = shared_data->supplies[i].nC;
+      supplyDistance = shared_data->supplies[i].distance;
+      demandX = shared_data->demands[demand_or_supply_id].x;
+      demandY = shared_data->demands[demand_or_supply_id].y;
+      demandA = shared_data->demands[demand_or_supply_id].nA;
+      demandB = shared_data->demands[demand_or_supply_id].nB;
+      demandC = shared_data->demands[demand_or_supply_id].nC;
+
+      // The whole match is one write to both tables, a reader or a resumed
+      // segment never sees the supply drawn down next to a live demand.
+      // Only quantities change here, the supply keeps its cell in supply_grid.
+      begin_table_write(&shared_data->demand_seq);
+      begin_table_write(&shared_data->supply_seq);
+      pthread_mutex_lock(&shared_data->owner_locks[supplier_agent_id]);
+      shared_data->supplies[i].nA -= shared_data->demands[demand_or_supply_id].nA;
+      shared_data->supplies[i].nB -= shared_data->demands[demand_or_supply_id].nB;
+      shared_data->supplies[i].nC -= shared_data->demands[demand_or_supply_id].nC;
+      pthread_mutex_unlock(&shared_data->owner_locks[supplier_agent_id]);
+      sync_supply_columns(i);
+      log_match(i, demand_or_supply_id);
+
+      if (shared_data->supplies[i].nA == 0 && shared_data->supplies[i].nB == 0 && shared_data->supplies[i].nC == 0)
+      {
+        forget_supply(i);
+        supply_gone = 1;
+      }
+      forget_demand(demand_or_supply_id);
+      end_table_write(&shared_data->supply_seq);
+      end_table_write(&shared_data->demand_seq);
+
+      had_a_match = 1;
+    }
+  }
+  else
+  {
+    int i = find_matching_demand(demand_or_supply_id);
+    if (i != -1)
+    {
+      supplier_agent_id = agent_id;
+      demander_agent_id = shared_data->demands[i].agent_id;
+      supplyX = shared_data->supplies[demand_or_supply_id].x;
+      supplyY = shared_data->supplies[demand_or_supply_id].y;
+      supplyA = shared_data->supplies[demand_or_supply_id].nA;
+      supplyB = shared_data->supplies[demand_or_supply_id].nB;
+      supplyC = shared_data->supplies[demand_or_supply_id].nC;
+      supplyDistance = shared_data->supplies[demand_or_supply_id].distance;
+      demandX = shared_data->demands[i].x;
+      demandY = shared_data->demands[i].y;
+      demandA = shared_data->demands[i].nA;
+      demandB = shared_data->demands[i].nB;
+      demandC = shared_data->demands[i].nC;
+
+      begin_table_write(&shared_data->demand_seq);
+      begin_table_write(&shared_data->supply_seq);
+      pthread_mutex_lock(&shared_data->owner_locks[supplier_agent_id]);
+      shared_data->supplies[demand_or_supply_id].nA -= shared_data->demands[i].nA;
+      shared_data->supplies[demand_or_supply_id].nB -= shared_data->demands[i].nB;
+      shared_data->supplies[demand_or_supply_id].nC -= shared_data->demands[i].nC;
+      pthread_mutex_unlock(&shared_data->owner_locks[supplier_agent_id]);
+      sync_supply_columns(demand_or_supply_id);
+      log_match(demand_or_supply_id, i);
+      if (shared_data->supplies[demand_or_supply_id].nA == 0 && shared_data->supplies[demand_or_supply_id].nB == 0 && shared_data->supplies[demand_or_supply_id].nC == 0)
+      {
+        forget_supply(demand_or_supply_id);
+        supply_gone = 1;
+      }
+      forget_demand(i);
+      end_table_write(&shared_data->supply_seq);
+      end_table_write(&shared_data->demand_seq);
+      had_a_match = 1;
+    }
+  }
+
+  if (supply_gone)
+    notify_supply_removed(supplier_agent_id);
+  if (had_a_match)
+  {
+    // Notify the supplier
+    notification_t notif_sup;
+    notif_sup.type = SUPPLY_DELIVERED;
+    notif_sup.delivered.supplyX = supplyX;
+    notif_sup.delivered.supplyY = supplyY;
+    notif_sup.delivered.supplyA = supplyA;
+    notif_sup.delivered.supplyB = supplyB;
+    notif_sup.delivered.supplyC = supplyC;
+    notif_sup.delivered.supplyDistance = supplyDistance;
+    notif_sup.delivered.demandX = demandX;
+    notif_sup.delivered.demandY = demandY;
+    notif_sup.delivered.demandA = demandA;
+    notif_sup.delivered.demandB = demandB;
+    notif_sup.delivered.demandC = demandC;
+    send_notification(supplier_agent_id, &notif_sup);
+
+    // Notify the demander
+    notification_t notif_dem;
+    notif_dem.type = DEMAND_FULFILLED;
+    notif_dem.fulfilled.demandX = demandX;
+    notif_dem.fulfilled.demandY = demandY;
+    notif_dem.fulfilled.demandA = demandA;
+    notif_dem.fulfilled.demandB = demandB;
+    notif_dem.fulfilled.demandC = demandC;
+    notif_dem.fulfilled.supplyX = supplyX;
+    notif_dem.fulfilled.supplyY = supplyY;
+    send_notification(demander_agent_id, &notif_dem);
+  }
+  return had_a_match;
+}
+
+int check_case(int demand_id, int supply_id)
+{
+  int bool1 = (shared_data->supplies[supply_id].distance > (abs(shared_data->demands[demand_id].x - shared_data->supplies[supply_id].x) + abs(shared_data->demands[demand_id].y - shared_data->supplies[supply_id].y)));
+  int bool2 = shared_data->demands[demand_id].nA <= shared_data->supplies[supply_id].nA;
+  int bool3 = shared_data->demands[demand_id].nB <= shared_data->supplies[supply_id].nB;
+  int bool4 = shared_data->demands[demand_id].nC <= shared_data->supplies[supply_id].nC;
+  int bool5 = shared_data->supplies[supply_id].agent_id != shared_data->demands[demand_id].agent_id;
+
+  return bool1 & bool2 & bool3 & bool4 & bool5;
+}
+
+int remove_demand_nolock(int agent_id, int demand_id)
+{
+  // Assume the stripe of the record is already locked
+  clear_demand(demand_id);
+  return 0;
+}
+
+int remove_supply_nolock(int agent_id, int supply_id)
+{
+  // Assume the stripe of the record is already locked
+  clear_supply(supply_id);
+
+  // After removing the supply
+  notify_supply_removed(agent_id);
+
+  return 0;
+}
+
+size_t format_notification(const notification_t *notif, char *message, size_t size)
+{
+  int len = 0;
+  if (notif->type == DEMAND_FULFILLED)
+  {
+    len = snprintf(message, size,
+                   "Your demand at (%d,%d), [%d,%d,%d] is fulfilled by a client at (%d,%d).",
+                   notif->fulfilled.demandX, notif->fulfilled.demandY, notif->fulfilled.demandA,
+                   notif->fulfilled.demandB, notif->fulfilled.demandC, notif->fulfilled.supplyX, notif->fulfilled.supplyY);
+  }
+  else if (notif->type == SUPPLY_DELIVERED)
+  {
+    len = snprintf(message, size,
+                   "Your supply at (%d,%d), [%d,%d,%d] with distance %d is delivered to a client at (%d,%d) [%d,%d,%d].",
+                   notif->delivered.supplyX, notif->delivered.supplyY, notif->delivered.supplyA, notif->delivered.supplyB,
+                   notif->delivered.supplyC, notif->delivered.supplyDistance, notif->delivered.demandX,
+                   notif->delivered.demandY, notif->delivered.demandA, notif->delivered.demandB, notif->delivered.demandC);
+  }
+  else if (notif->type == SUPPLY_REMOVED)
+  {
+    len = snprintf(message, size, "Your supply is removed from map.");
+  }
+  else if (notif->type == SUPPLY_ADDED)
+  {
+    len = snprintf(message, size,
+                   "A supply [%d,%d,%d] is inserted at (%d,%d).",
+                   notif->added.supplyA, notif->added.supplyB, notif->added.supplyC, notif->added.supplyX, notif->added.supplyY);
+  }
+  return len < 0 ? 0 : (size_t)len < size ? (size_t)len : size - 1;
+}
+
+size_t notification_payload_size(notification_type_t type)
+{
+  return payload_size(type);
+}
+
+static int notifications_pending(notification_queue_t *queue)
+{
+  return __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) != __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) ||
+         __atomic_load_n(&queue->spilling, __ATOMIC_SEQ_CST);
+}
+
+// Moves the agent from awake to sleeping in state. Returns 0 if it may go to
+// sleep, 1 if notifications are pending and -1 once it was interrupted.
+static int prepare_sleep(notification_queue_t *queue, int state)
+{
+  int awake = NOTIFY_AWAKE;
+  if (!__atomic_compare_exchange_n(&queue->waiting, &awake, state, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return -1;
+  if (!notifications_pending(queue))
+    return 0;
+  __atomic_compare_exchange_n(&queue->waiting, &state, NOTIFY_AWAKE, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+  return 1;
+}
+
+// Back to awake unless a producer did that already or the agent was interrupted
+static void finish_sleep(notification_queue_t *queue, int state)
+{
+  __atomic_compare_exchange_n(&queue->waiting, &state, NOTIFY_AWAKE, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+int notify_client(int agent_id, notify_event_fn sink, void *ctx)
+{
+  notification_queue_t *queue = &shared_data->notification_queue[agent_id];
+  int ready = prepare_sleep(queue, NOTIFY_WAIT_FUTEX);
+  if (ready == -1)
+    return -1;
+  if (ready == 0)
+  {
+    futex_wait(&queue->waiting, NOTIFY_WAIT_FUTEX);
+    finish_sleep(queue, NOTIFY_WAIT_FUTEX);
+  }
+  deliver_notifications(agent_id, sink, ctx);
+  return 0;
+}
+
+void interrupt_notifications(int agent_id)
+{
+  notification_queue_t *queue = &shared_data->notification_queue[agent_id];
+  if (__atomic_exchange_n(&queue->waiting, NOTIFY_INTERRUPTED, __ATOMIC_SEQ_CST) == NOTIFY_WAIT_FUTEX)
+    futex_wake(&queue->waiting);
+}
+
+int notification_wakeup_fd(int agent_id)
+{
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  struct sockaddr_un addr;
+  socklen_t len = wakeup_address(agent_id, &addr);
+  if (bind(fd, (struct sockaddr *)&addr, len) == -1)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int arm_notification_wakeup(int agent_id)
+{
+  return prepare_sleep(&shared_data->notification_queue[agent_id], NOTIFY_WAIT_FD);
+}
+
+void deliver_notifications(int agent_id, notify_event_fn sink, void *ctx)
+{
+  notification_queue_t *queue = &shared_data->notification_queue[agent_id];
+  finish_sleep(queue, NOTIFY_WAIT_FD);
+
+  // Take the published records out of the agent's ring, producers must not
+  // wait on the client's socket
+  int ring = __atomic_load_n(&queue->ring, __ATOMIC_ACQUIRE);
+  if (ring == -1)
+    return;
+  unsigned char *bytes = ring_bytes(ring);
+  unsigned char pending[NOTIFICATION_RING_BYTES];
+  unsigned int count = 0;
+  unsigned long long head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+  int type;
+  while ((type = published_type(bytes, head)) != -1 && count + 1 + payload_size(type) <= sizeof(pending))
+  {
+    pending[count] = type;
+    ring_read(bytes, head + sizeof(unsigned long long), pending + count + 1, payload_size(type));
+    // A producer evicting the record first means the copy may be torn, skip it
+    if (__atomic_compare_exchange_n(&queue->head, &head, head + record_size(type), 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      count += 1 + payload_size(type);
+      head += record_size(type);
+    }
+  }
+
+  // Spilled records are newer than everything in the ring, they are only
+  // taken once the ring is empty
+  int spill_first = -1;
+  int spill_last = -1;
+  if (__atomic_load_n(&queue->spilling, __ATOMIC_ACQUIRE) &&
+      head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))
+  {
+    pthread_mutex_lock(&queue->mutex);
+    spill_first = queue->spill_first;
+    spill_last = queue->spill_last;
+    queue->spill_first = -1;
+    queue->spill_last = -1;
+    queue->spill_chunks = 0;
+    __atomic_store_n(&queue->spilling, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&queue->mutex);
+  }
+
+  for (unsigned int at = 0; at < count;)
+  {
+    notification_t notif;
+    notif.type = pending[at];
+    size_t size = payload_size(notif.type);
+    memcpy(&notif.fulfilled, pending + at + 1, size);
+    at += 1 + size;
+    sink(&notif, ctx);
+  }
+  for (int chunk = spill_first; chunk != -1; chunk = shared_data->spill_chunks[chunk].next)
+  {
+    spill_chunk_t *spill = &shared_data->spill_chunks[chunk];
+    for (int i = 0; i < spill->count; i++)
+    {
+      sink(&spill->records[i], ctx);
+    }
+  }
+  release_spill_chunks(spill_first, spill_last);
+}
+
+// Ids of agents that left are handed out again first, a new one only when
+// none is free
+int get_next_agent_id(int *agent_id)
+{
+  int id = -1;
+  pthread_mutex_lock(&shared_data->agent_table_mutex);
+  if (shared_data->free_agent_id_count > 0)
+  {
+    id = shared_data->free_agent_ids[--shared_data->free_agent_id_count];
+  }
+  else if (shared_data->next_agent_id < AGENT_LIMIT)
+  {
+    int capacity = shared_data->agent_capacity;
+    while (capacity <= shared_data->next_agent_id)
+    {
+      capacity *= 2;
+    }
+    if (capacity == shared_data->agent_capacity || grow_agents(capacity) == 0)
+      id = shared_data->next_agent_id++;
+  }
+  if (id != -1 && attach_ring(id) == -1)
+  {
+    shared_data->free_agent_ids[shared_data->free_agent_id_count++] = id;
+    id = -1;
+  }
+  pthread_mutex_unlock(&shared_data->agent_table_mutex);
+  *agent_id = id;
+  return id == -1 ? -1 : 0;
+}
+
+void remove_all_demands_nolock(int agent_id)
+{
+  while (shared_data->agent_demands[agent_id].head != -1)
+  {
+    clear_demand(shared_data->agent_demands[agent_id].head);
+  }
+}
+
+void remove_all_supplies_nolock(int agent_id)
+{
+  while (shared_data->agent_supplies[agent_id].head != -1)
+  {
+    clear_supply(shared_data->agent_supplies[agent_id].head);
+  }
+}
+
+// Takes the agent's records off one at a time under the stripe each one
+// lives in, a record may get matched by someone else in between
+static void release_owned_demands(int agent_id)
+{
+  for (;;)
+  {
+    pthread_mutex_lock(&shared_data->owner_locks[agent_id]);
+    int demand_id = shared_data->agent_demands[agent_id].head;
+    long long u = 0;
+    if (demand_id != -1)
+      u = (long long)shared_data->demands[demand_id].x + shared_data->demands[demand_id].y;
+    pthread_mutex_unlock(&shared_data->owner_locks[agent_id]);
+    if (demand_id == -1)
+      return;
+
+    uint64_t stripes = stripe_band(&shared_data->demand_grid, u, u);
+    lock_stripes(stripes);
+    if (shared_data->demands[demand_id].agent_id == agent_id)
+      clear_demand(demand_id);
+    unlock_stripes(stripes);
+  }
+}
+
+static void release_owned_supplies(int agent_id)
+{
+  for (;;)
+  {
+    pthread_mutex_lock(&shared_data->owner_locks[agent_id]);
+    int supply_id = shared_data->agent_supplies[agent_id].head;
+    int x = 0;
+    if (supply_id != -1)
+      x = shared_data->supplies[supply_id].x;
+    pthread_mutex_unlock(&shared_data->owner_locks[agent_id]);
+    if (supply_id == -1)
+      return;
+
+    uint64_t stripes = stripe_band(&shared_data->supply_grid, x, x);
+    lock_stripes(stripes);
+    if (shared_data->supplies[supply_id].agent_id == agent_id)
+      clear_supply(supply_id);
+    unlock_stripes(stripes);
+  }
+}
+
+// A match that found one of the agent's records before they were released
+// sends its notifications under the stripes it holds. Once every stripe was
+// free for a moment none of those is left, and the id can name another agent.
+static void release_agent_id(int agent_id)
+{
+  uint64_t stripes = all_stripes();
+  lock_stripes(stripes);
+  unlock_stripes(stripes);
+
+  notification_queue_t *queue = &shared_data->notification_queue[agent_id];
+  pthread_mutex_lock(&shared_data->agent_table_mutex);
+  shared_data->retired_dropped += __atomic_exchange_n(&queue->dropped, 0, __ATOMIC_RELAXED);
+  shared_data->retired_spilled += __atomic_exchange_n(&queue->spilled, 0, __ATOMIC_RELAXED);
+  shared_data->retired_blocked += __atomic_exchange_n(&queue->blocked, 0, __ATOMIC_RELAXED);
+  shared_data->free_agent_ids[shared_data->free_agent_id_count++] = agent_id;
+  pthread_mutex_unlock(&shared_data->agent_table_mutex);
+}
+
+void cleanup_agent(int agent_id)
+{
+  pthread_rwlock_wrlock(&shared_data->agent_state_lock);
+  clear_watch(agent_id);
+  // The next agent with this id starts where a new one does
+  shared_data->agent_positions[agent_id][0] = 0;
+  shared_data->agent_positions[agent_id][1] = 0;
+  pthread_rwlock_unlock(&shared_data->agent_state_lock);
+
+  release_owned_demands(agent_id);
+  release_owned_supplies(agent_id);
+  detach_ring(agent_id);
+  release_agent_id(agent_id);
+}
+
+// Final state of one table as the log leaves it, indexed by the old slots.
+// A type of 0 marks a slot that is free in the end.
+typedef struct
+{
+  wal_record_t *rows;
+  int room;
+} log_table_t;
+
+// NULL when the slot cannot be kept, the replay must fail rather than lose
+// a record that was acknowledged
+static wal_record_t *log_row(log_table_t *table, int id, int limit)
+{
+  if (id >= limit)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (id >= table->room)
+  {
+    int room = table->room == 0 ? 1024 : table->room;
+    while (room <= id)
+    {
+      room *= 2;
+    }
+    wal_record_t *rows = realloc(table->rows, room * sizeof(wal_record_t));
+    if (rows == NULL)
+      return NULL;
+    memset(rows + table->room, 0, (room - table->room) * sizeof(wal_record_t));
+    table->rows = rows;
+    table->room = room;
+  }
+  return &table->rows[id];
+}
+
+static int apply_log_record(const wal_record_t *record, void *ctx)
+{
+  log_table_t *tables = ctx; // demands, then supplies
+  if (record->type == WAL_MATCH && record->x >= 0)
+  {
+    wal_record_t *demand = log_row(&tables[0], record->x, DEMAND_LIMIT);
+    if (demand == NULL)
+      return -1;
+    demand->type = 0;
+  }
+  int supply = record->type != WAL_ADD_DEMAND && record->type != WAL_REMOVE_DEMAND;
+  wal_record_t *row = log_row(&tables[supply], record->id, supply ? SUPPLY_LIMIT : DEMAND_LIMIT);
+  if (row == NULL)
+    return -1;
+  switch (record->type)
+  {
+  case WAL_ADD_DEMAND:
+  case WAL_ADD_SUPPLY:
+    *row = *record;
+    break;
+  case WAL_MATCH:
+    if (row->type == WAL_ADD_SUPPLY)
+    {
+      row->nA = record->nA;
+      row->nB = record->nB;
+      row->nC = record->nC;
+      if (row->nA == 0 && row->nB == 0 && row->nC == 0)
+        row->type = 0;
+    }
+    break;
+  default:
+    row->type = 0;
+    break;
+  }
+  return 0;
+}
+
+// Makes room for agents below count and keeps new clients from getting their ids
+static int reserve_agent_ids(int count)
+{
+  pthread_mutex_lock(&shared_data->agent_table_mutex);
+  int capacity = shared_data->agent_capacity;
+  while (capacity < count)
+  {
+    capacity *= 2;
+  }
+  int result = capacity > shared_data->agent_capacity ? grow_agents(capacity) : 0;
+  if (result == 0 && shared_data->next_agent_id < count)
+    shared_data->next_agent_id = count;
+  pthread_mutex_unlock(&shared_data->agent_table_mutex);
+  return result;
+}
+
+// Enters a record that survived in the log without matching it, the log
+// only holds records that found no partner
+static int restore_record(const wal_record_t *row)
+{
+  if (row->agent_id < 0 || row->agent_id >= AGENT_LIMIT || reserve_agent_ids(row->agent_id + 1) == -1)
+    return -1;
+  if (row->type == WAL_ADD_DEMAND)
+    return store_demand(row->agent_id, row->x, row->y, row->nA, row->nB, row->nC);
+  return store_supply(row->agent_id, row->x, row->y, row->distance, row->nA, row->nB, row->nC);
+}
+
+int open_market_log(const char *path)
+{
+  log_table_t tables[2];
+  memset(tables, 0, sizeof(tables));
+  // A resumed segment already holds everything the log would replay
+  int replayed = segment_resumed ? 0 : wal_replay(path, apply_log_record, tables);
+  int restored[2] = {0, 0};
+  for (int t = 0; t < 2 && replayed != -1; t++)
+  {
+    for (int id = 0; id < tables[t].room; id++)
+    {
+      if (tables[t].rows[id].type == 0)
+        continue;
+      if (restore_record(&tables[t].rows[id]) == -1)
+      {
+        // The log is left as it is for a server that can take it all
+        errno = ENOSPC;
+        replayed = -1;
+        break;
+      }
+      restored[t]++;
+    }
+  }
+  free(tables[0].rows);
+  free(tables[1].rows);
+  if (replayed == -1)
+    return -1;
+  // Restoring took the ids of the old owners and skipped every id below them
+  if (replayed > 0)
+    rebuild_free_agent_ids();
+
+  // The log starts over with the tables as they are now, under their new slots
+  int count = shared_data->demand_slots.live + shared_data->supply_slots.live;
+  wal_record_t *records = malloc((count > 0 ? count : 1) * sizeof(wal_record_t));
+  if (records == NULL)
+    return -1;
+  int n = 0;
+  for (int id = slot_next(&shared_data->demand_slots, 0); id != -1; id = slot_next(&shared_data->demand_slots, id + 1))
+  {
+    records[n++] = demand_record(WAL_ADD_DEMAND, id);
+  }
+  for (int id = slot_next(&shared_data->supply_slots, 0); id != -1; id = slot_next(&shared_data->supply_slots, id + 1))
+  {
+    records[n++] = supply_record(WAL_ADD_SUPPLY, id);
+  }
+  int result = wal_start(path, records, n);
+  free(records);
+  if (replayed > 0)
+    fprintf(stderr, "Debug: replayed %d log records, restored %d demands and %d supplies\n", replayed, restored[0], restored[1]);
+  return result;
+}
+
+// Rows handed to the list formatters, copied out so that formatting runs
+// without any shared lock held
+typedef struct
+{
+  int index;
+  int agent_id;
+  int x;
+  int y;
+  int nA;
+  int nB;
+  int nC;
+  int distance;
+} list_row_t;
+
+// Process local copy of a whole table for listdemands/listsupplies
+typedef struct
+{
+  int valid;
+  unsigned long version; // table version the rows were copied at
+  struct timespec taken; // last time the rows were known to match the table
+  int count;
+  int room; // rows allocated
+  list_row_t *rows;
+} list_snapshot_t;
+
+static list_snapshot_t demand_snapshot;
+static list_snapshot_t supply_snapshot;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Copies live rows first to first + max - 1, in slot order, of the first
+// capacity slots of a table and stores the number of live rows in *total.
+// Bitmap words before the page are skipped by their population count. Without
+// locks the result is only usable when the table version did not move meanwhile.
+static int copy_table_rows(int supplies, list_row_t *rows, int capacity, int first, int max, int *total)
+{
+  const slot_table_t *slots = supplies ? &shared_data->supply_slots : &shared_data->demand_slots;
+  const int *agent_id = supplies ? shared_data->supply_cols.agent_id : shared_data->demand_cols.agent_id;
+  const int *x = supplies ? shared_data->supply_cols.x : shared_data->demand_cols.x;
+  const int *y = supplies ? shared_data->supply_cols.y : shared_data->demand_cols.y;
+  const int *nA = supplies ? shared_data->supply_cols.nA : shared_data->demand_cols.nA;
+  const int *nB = supplies ? shared_data->supply_cols.nB : shared_data->demand_cols.nB;
+  const int *nC = supplies ? shared_data->supply_cols.nC : shared_data->demand_cols.nC;
+  int n = 0;
+  int rank = 0;
+
+  for (int w = 0; w < (capacity + 63) / 64; w++)
+  {
+    uint64_t bits = __atomic_load_n(&slots->used[w], __ATOMIC_RELAXED);
+    int live = __builtin_popcountll(bits);
+    if (rank + live <= first || n == max)
+    {
+      rank += live;
+      continue;
+    }
+    for (; bits != 0; bits &= bits - 1)
+    {
+      int i = w * 64 + __builtin_ctzll(bits);
+      if (i >= capacity)
+        break;
+      if (agent_id[i] == -1) // slot taken, record not written yet
+        continue;
+      if (rank++ < first || n == max)
+        continue;
+      rows[n].index = i;
+      rows[n].agent_id = agent_id[i];
+      rows[n].x = x[i];
+      rows[n].y = y[i];
+      rows[n].nA = nA[i];
+      rows[n].nB = nB[i];
+      rows[n].nC = nC[i];
+      rows[n].distance = supplies ? shared_data->supply_cols.distance[i] : 0;
+      n++;
+    }
+  }
+  *total = rank;
+  return n;
+}
+
+static int table_unchanged(const table_seq_t *seq, unsigned long version)
+{
+  return __atomic_load_n(&seq->writers, __ATOMIC_ACQUIRE) == 0 &&
+         __atomic_load_n(&seq->version, __ATOMIC_ACQUIRE) == version;
+}
+
+// Makes room for a copy of every slot of the table as it is now, the table
+// only grows under a table write so a copy that races with one is retried.
+// Returns -1 when there is no memory for it, a shorter copy would be taken
+// for the whole table.
+static int snapshot_room(list_snapshot_t *snap, int supplies)
+{
+  const slot_table_t *slots = supplies ? &shared_data->supply_slots : &shared_data->demand_slots;
+  int capacity = __atomic_load_n(&slots->capacity, __ATOMIC_ACQUIRE);
+  if (capacity > snap->room)
+  {
+    list_row_t *rows = realloc(snap->rows, capacity * sizeof(list_row_t));
+    if (rows == NULL)
+      return -1;
+    snap->rows = rows;
+    snap->room = capacity;
+  }
+  return capacity;
+}
+
+// Copies the table while writers keep going and retries if one got in the
+// way, after a few misses the stripes are taken for a single copy. Returns
+// -1 and leaves no valid copy when there is no memory for one.
+static int take_snapshot(list_snapshot_t *snap, int supplies)
+{
+  table_seq_t *seq = supplies ? &shared_data->supply_seq : &shared_data->demand_seq;
+  snap->valid = 0;
+  for (int attempt = 0; attempt < SNAPSHOT_OPTIMISTIC_TRIES; attempt++)
+  {
+    unsigned long version = __atomic_load_n(&seq->version, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&seq->writers, __ATOMIC_ACQUIRE) != 0)
+      continue;
+    int room = snapshot_room(snap, supplies);
+    if (room == -1)
+      return -1;
+    int total;
+    int count = copy_table_rows(supplies, snap->rows, room, 0, room, &total);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (table_unchanged(seq, version))
+    {
+      snap->version = version;
+      snap->count = count;
+      snap->valid = 1;
+      return 0;
+    }
+  }
+
+  uint64_t stripes = all_stripes();
+  lock_stripes(stripes);
+  snap->version = __atomic_load_n(&seq->version, __ATOMIC_ACQUIRE);
+  int room = snapshot_room(snap, supplies);
+  if (room != -1)
+  {
+    int total;
+    snap->count = copy_table_rows(supplies, snap->rows, room, 0, room, &total);
+    snap->valid = 1;
+  }
+  unlock_stripes(stripes);
+  return room == -1 ? -1 : 0;
+}
+
+// Copies one page of a table from the live table, the stripes are only taken,
+// after a few misses, for as long as the page takes to copy
+static int copy_table_page(int supplies, list_row_t *rows, int first, int max, int *total)
+{
+  table_seq_t *seq = supplies ? &shared_data->supply_seq : &shared_data->demand_seq;
+  const slot_table_t *slots = supplies ? &shared_data->supply_slots : &shared_data->demand_slots;
+  for (int attempt = 0; attempt < SNAPSHOT_OPTIMISTIC_TRIES; attempt++)
+  {
+    unsigned long version = __atomic_load_n(&seq->version, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&seq->writers, __ATOMIC_ACQUIRE) != 0)
+      continue;
+    int count = copy_table_rows(supplies, rows, __atomic_load_n(&slots->capacity, __ATOMIC_ACQUIRE), first, max, total);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (table_unchanged(seq, version))
+      return count;
+  }
+
+  uint64_t stripes = all_stripes();
+  lock_stripes(stripes);
+  int count = copy_table_rows(supplies, rows, slots->capacity, first, max, total);
+  unlock_stripes(stripes);
+  return count;
+}
+
+static long age_ms(const struct timespec *then, const struct timespec *now)
+{
+  return (now->tv_sec - then->tv_sec) * 1000 + (now->tv_nsec - then->tv_nsec) / 1000000;
+}
+
+// Snapshot to answer a full listing from, at most list_staleness_ms behind
+// the table, NULL when no copy could be taken. Caller holds snapshot_mutex.
+static list_snapshot_t *current_snapshot(int supplies)
+{
+  list_snapshot_t *snap = supplies ? &supply_snapshot : &demand_snapshot;
+  table_seq_t *seq = supplies ? &shared_data->supply_seq : &shared_data->demand_seq;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  if (snap->valid && age_ms(&snap->taken, &now) <= list_staleness_ms)
+    return snap;
+  if ((!snap->valid || !table_unchanged(seq, snap->version)) && take_snapshot(snap, supplies) == -1)
+    return NULL;
+  snap->taken = now;
+  return snap;
+}
+
+static int compare_row_index(const void *a, const void *b)
+{
+  return ((const list_row_t *)a)->index - ((const list_row_t *)b)->index;
+}
+
+// Copies the agent's own records in table order
+static int copy_owned_rows(int agent_id, int supplies, list_row_t **rows_out)
+{
+  pthread_mutex_lock(&shared_data->owner_locks[agent_id]);
+  int count = supplies ? shared_data->agent_supplies[agent_id].count : shared_data->agent_demands[agent_id].count;
+  list_row_t *rows = malloc((count + 1) * sizeof(list_row_t));
+  if (rows == NULL)
+  {
+    pthread_mutex_unlock(&shared_data->owner_locks[agent_id]);
+    return -1;
+  }
+  int n = 0;
+  if (supplies)
+  {
+    for (int i = shared_data->agent_supplies[agent_id].head; i != -1; i = shared_data->supplies[i].owner_next)
+    {
+      supply_t *supply = &shared_data->supplies[i];
+      list_row_t row = {i, supply->agent_id, supply->x, supply->y, supply->nA, supply->nB, supply->nC, supply->distance};
+      rows[n++] = row;
+    }
+  }
+  else
+  {
+    for (int i = shared_data->agent_demands[agent_id].head; i != -1; i = shared_data->demands[i].owner_next)
+    {
+      demand_t *demand = &shared_data->demands[i];
+      list_row_t row = {i, demand->agent_id, demand->x, demand->y, demand->nA, demand->nB, demand->nC, 0};
+      rows[n++] = row;
+    }
+  }
+  pthread_mutex_unlock(&shared_data->owner_locks[agent_id]);
+
+  qsort(rows, n, sizeof(list_row_t), compare_row_index);
+  *rows_out = rows;
+  return n;
+}
+
+// Collects formatted text and hands it to the sink a chunk at a time
+typedef struct
+{
+  notify_sink_fn sink;
+  void *ctx;
+  size_t used;
+  char data[LIST_CHUNK_BYTES];
+} list_writer_t;
+
+static void list_flush(list_writer_t *writer)
+{
+  if (writer->used > 0)
+    writer->sink(writer->data, writer->used, writer->ctx);
+  writer->used = 0;
+}
+
+static void list_append(list_writer_t *writer, const char *text)
+{
+  size_t len = strlen(text);
+  if (writer->used + len > sizeof(writer->data))
+    list_flush(writer);
+  memcpy(writer->data + writer->used, text, len);
+  writer->used += len;
+}
+
+// Writes value right aligned like "%*d" followed by the column separator
+static char *put_field(char *p, int value, int width)
+{
+  char digits[12];
+  int n = 0;
+  unsigned int v = value < 0 ? -(unsigned int)value : (unsigned int)value;
+  do
+  {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v != 0);
+  if (value < 0)
+    digits[n++] = '-';
+  for (int pad = width - n; pad > 0; pad--)
+  {
+    *p++ = ' ';
+  }
+  while (n > 0)
+  {
+    *p++ = digits[--n];
+  }
+  *p++ = '|';
+  return p;
+}
+
+// Formats the listing in one pass, total is the count reported in the header
+// and scope says what it counts. age_ms is the age of the snapshot the rows
+// come from, -1 for none.
+static void write_list_rows(list_writer_t *writer, int supplies, const list_row_t *rows, int count, int total,
+                            const char *scope, int first, int paged, long age)
+{
+  char line[LIST_ROW_BYTES];
+  snprintf(line, sizeof(line), "There are %d %s %s.\n", total, supplies ? "supplies" : "demands", scope);
+  list_append(writer, line);
+  if (age >= 0)
+  {
+    snprintf(line, sizeof(line), "Snapshot age %ld ms, staleness bound %d ms.\n", age, list_staleness_ms);
+    list_append(writer, line);
+  }
+  if (paged)
+  {
+    snprintf(line, sizeof(line), "Showing %d rows from row %d.\n", count, first);
+    list_append(writer, line);
+  }
+  if (supplies)
+  {
+    list_append(writer, "X      |Y      |A    |B    |C    |D      |\n");
+    list_append(writer, "-------+-------+-----+-----+-----+-------+\n");
+  }
+  else
+  {
+    list_append(writer, "X      |Y      |A    |B    |C    |\n");
+    list_append(writer, "-------+-------+-----+-----+-----+\n");
+  }
+
+  for (int k = 0; k < count; k++)
+  {
+    if (writer->used + LIST_ROW_BYTES > sizeof(writer->data))
+      list_flush(writer);
+    char *p = writer->data + writer->used;
+    p = put_field(p, rows[k].x, 7);
+    p = put_field(p, rows[k].y, 7);
+    p = put_field(p, rows[k].nA, 5);
+    p = put_field(p, rows[k].nB, 5);
+    p = put_field(p, rows[k].nC, 5);
+    if (supplies)
+      p = put_field(p, rows[k].distance, 7);
+    *p++ = '\n';
+    writer->used = p - writer->data;
+  }
+  list_flush(writer);
+}
+
+// Rows first to first + limit - 1 of the full table, copied out of the
+// snapshot so that the mutex is not held while the client is written to
+static int copy_snapshot_page(int supplies, int first, int limit, list_row_t **rows_out, int *total, long *age)
+{
+  pthread_mutex_lock(&snapshot_mutex);
+  list_snapshot_t *snap = current_snapshot(supplies);
+  if (snap == NULL)
+  {
+    pthread_mutex_unlock(&snapshot_mutex);
+    return -1;
+  }
+  *total = snap->count;
+  int count = first >= snap->count ? 0 : snap->count - first;
+  if (limit >= 0 && count > limit)
+    count = limit;
+  list_row_t *rows = malloc((count + 1) * sizeof(list_row_t));
+  if (rows == NULL)
+  {
+    pthread_mutex_unlock(&snapshot_mutex);
+    return -1;
+  }
+  memcpy(rows, snap->rows + first, count * sizeof(list_row_t));
+  *age = -1;
+  if (list_staleness_ms > 0)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *age = age_ms(&snap->taken, &now);
+  }
+  pthread_mutex_unlock(&snapshot_mutex);
+  *rows_out = rows;
+  return count;
+}
+
+int write_list_response(int agent_id, int all, int supplies, int first, int limit, notify_sink_fn sink, void *ctx)
+{
+  list_row_t *rows = NULL;
+  const list_row_t *page;
+  int count;
+  int total;
+  long age = -1;
+  int paged = first > 0 || limit >= 0;
+
+  if (!all)
+  {
+    total = copy_owned_rows(agent_id, supplies, &rows);
+    if (total == -1)
+      return -1;
+    count = first >= total ? 0 : total - first;
+    if (limit >= 0 && count > limit)
+      count = limit;
+    page = rows + (count > 0 ? first : 0);
+  }
+  else if (!paged)
+  {
+    count = copy_snapshot_page(supplies, 0, -1, &rows, &total, &age);
+    page = rows;
+  }
+  else
+  {
+    // A page never costs a copy of the whole table
+    const slot_table_t *slots = supplies ? &shared_data->supply_slots : &shared_data->demand_slots;
+    int capacity = __atomic_load_n(&slots->capacity, __ATOMIC_ACQUIRE);
+    int room = limit >= 0 && limit < capacity ? limit : capacity;
+    rows = malloc((room + 1) * sizeof(list_row_t));
+    if (rows == NULL)
+      return -1;
+    count = copy_table_page(supplies, rows, first, room, &total);
+    page = rows;
+  }
+  if (count == -1)
+    return -1;
+
+  list_writer_t *writer = malloc(sizeof(list_writer_t));
+  if (writer == NULL)
+  {
+    free(rows);
+    return -1;
+  }
+  writer->sink = sink;
+  writer->ctx = ctx;
+  writer->used = 0;
+  write_list_rows(writer, supplies, page, count, total, "in total", first, paged, age);
+  free(writer);
+  free(rows);
+  return 0;
+}
+
+typedef struct
+{
+  const list_region_t *region;
+  int supplies;
+  int x; // agent position a near region is centered on
+  int y;
+  int count;
+  int room;
+  list_row_t *rows;
+} region_search_t;
+
+static int visit_region_row(int index, void *ctx)
+{
+  region_search_t *search = ctx;
+  const list_region_t *region = search->region;
+  list_row_t row;
+  if (search->supplies)
+  {
+    supply_t *supply = &shared_data->supplies[index];
+    list_row_t found = {index, supply->agent_id, supply->x, supply->y, supply->nA, supply->nB, supply->nC, supply->distance};
+    row = found;
+  }
+  else
+  {
+    demand_t *demand = &shared_data->demands[index];
+    list_row_t found = {index, demand->agent_id, demand->x, demand->y, demand->nA, demand->nB, demand->nC, 0};
+    row = found;
+  }
+
+  // The grid hands out whole cells, the exact test is ours
+  if (region->near && llabs((long long)row.x - search->x) + llabs((long long)row.y - search->y) > region->radius)
+    return 0;
+  if (region->box && (row.x < region->x0 || row.x > region->x1 || row.y < region->y0 || row.y > region->y1))
+    return 0;
+  if (search->count == search->room)
+  {
+    int room = search->room == 0 ? 64 : search->room * 2;
+    list_row_t *rows = realloc(search->rows, room * sizeof(list_row_t));
+    if (rows == NULL)
+      return 1;
+    search->rows = rows;
+    search->room = room;
+  }
+  search->rows[search->count++] = row;
+  return 0;
+}
+
+// Supplies are found by position in their grid, demands in the rotated grid
+// where the region's bounds become u = x + y and v = x - y bounds. Only the
+// stripes of the region's band are held while its cells are walked.
+static void copy_region_rows(int supplies, const list_region_t *region, region_search_t *search)
+{
+  long long x0 = LLONG_MIN / 4, y0 = LLONG_MIN / 4, x1 = LLONG_MAX / 4, y1 = LLONG_MAX / 4;
+  if (region->near)
+  {
+    x0 = (long long)search->x - region->radius;
+    x1 = (long long)search->x + region->radius;
+    y0 = (long long)search->y - region->radius;
+    y1 = (long long)search->y + region->radius;
   }
+  if (region->box)
+  {
+    x0 = region->x0 > x0 ? region->x0 : x0;
+    x1 = region->x1 < x1 ? region->x1 : x1;
+    y0 = region->y0 > y0 ? region->y0 : y0;
+    y1 = region->y1 < y1 ? region->y1 : y1;
+  }
+  if (x0 > x1 || y0 > y1)
+    return;
+
+  if (supplies)
+  {
+    uint64_t stripes = stripe_band(&shared_data->supply_grid, x0, x1);
+    lock_stripes(stripes);
+    grid_visit_box(&shared_data->supply_grid, shared_data->supply_links, x0, y0, x1, y1, visit_region_row, search);
+    unlock_stripes(stripes);
+    return;
+  }
+
+  long long u0 = x0 + y0, u1 = x1 + y1, v0 = x0 - y1, v1 = x1 - y0;
+  if (region->near)
+  {
+    long long u = (long long)search->x + search->y;
+    long long v = (long long)search->x - search->y;
+    u0 = u - region->radius > u0 ? u - region->radius : u0;
+    u1 = u + region->radius < u1 ? u + region->radius : u1;
+    v0 = v - region->radius > v0 ? v - region->radius : v0;
+    v1 = v + region->radius < v1 ? v + region->radius : v1;
+  }
+  uint64_t stripes = stripe_band(&shared_data->demand_grid, u0, u1);
+  lock_stripes(stripes);
+  grid_visit_box(&shared_data->demand_grid, shared_data->demand_links, u0, v0, u1, v1, visit_region_row, search);
+  unlock_stripes(stripes);
+}
+
+int write_region_response(int agent_id, int supplies, const list_region_t *region, notify_sink_fn sink, void *ctx)
+{
+  region_search_t search;
+  memset(&search, 0, sizeof(search));
+  search.region = region;
+  search.supplies = supplies;
+  read_position(agent_id, &search.x, &search.y);
+  copy_region_rows(supplies, region, &search);
+  qsort(search.rows, search.count, sizeof(list_row_t), compare_row_index);
+
+  char scope[LIST_ROW_BYTES];
+  int len = 0;
+  if (region->near)
+    len += snprintf(scope + len, sizeof(scope) - len, "within distance %d of (%d,%d)", region->radius, search.x, search.y);
+  if (region->box)
+    len += snprintf(scope + len, sizeof(scope) - len, "%sin [%d,%d]x[%d,%d]", region->near ? " " : "",
+                    region->x0, region->x1, region->y0, region->y1);
+
+  list_writer_t *writer = malloc(sizeof(list_writer_t));
+  if (writer == NULL)
+  {
+    free(search.rows);
+    return -1;
+  }
+  writer->sink = sink;
+  writer->ctx = ctx;
+  writer->used = 0;
+  write_list_rows(writer, supplies, search.rows, search.count, search.count, scope, 0, 0, -1);
+  free(writer);
+  free(search.rows);
+  return 0;
+}
 
-  // Unlock the shared data mutex
-  pthread_mutex_unlock(&shared_data->mutex);
+static double ms_since(const struct timespec *since)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
 
-  return response;
+#define SNAPSHOT_BUFFER_BYTES 65536
+
+static char *put_csv(char *p, int value)
+{
+  p = put_field(p, value, 0);
+  p[-1] = ',';
+  return p;
 }
 
-int find_first_empty_supply()
+// Runs in the forked child: only write(2) and the formatter above, no stdio
+static int write_snapshot_file(const char *path, list_row_t *const rows[2], const int count[2])
 {
-  for (int i = 0; i < MAX_SUPPLIES; i++)
+  char tmp_path[PATH_MAX];
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path))
+    return -1;
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    return -1;
+  char *buffer = malloc(SNAPSHOT_BUFFER_BYTES);
+  const char *header = "kind,slot,agent,x,y,distance,A,B,C\n";
+  size_t used = strlen(header);
+  int result = buffer == NULL ? -1 : 0;
+  if (buffer != NULL)
+    memcpy(buffer, header, used);
+  for (int t = 0; t < 2 && result == 0; t++)
+  {
+    for (int i = 0; i < count[t] && result == 0; i++)
+    {
+      const list_row_t *row = &rows[t][i];
+      char *p = buffer + used;
+      memcpy(p, t ? "supply," : "demand,", 7);
+      p += 7;
+      p = put_csv(p, row->index);
+      p = put_csv(p, row->agent_id);
+      p = put_csv(p, row->x);
+      p = put_csv(p, row->y);
+      if (t)
+        p = put_csv(p, row->distance);
+      else
+        *p++ = ','; // demands have no distance
+      p = put_csv(p, row->nA);
+      p = put_csv(p, row->nB);
+      p = put_csv(p, row->nC);
+      p[-1] = '\n';
+      used = p - buffer;
+      if (used > SNAPSHOT_BUFFER_BYTES - LIST_ROW_BYTES)
+      {
+        if (write(fd, buffer, used) != (ssize_t)used)
+          result = -1;
+        used = 0;
+      }
+    }
+  }
+  if (result == 0 && used > 0 && write(fd, buffer, used) != (ssize_t)used)
+    result = -1;
+  free(buffer);
+  if (fsync(fd) == -1 || close(fd) == -1 || result == -1 || rename(tmp_path, path) == -1)
   {
-    if (shared_data->supplies[i].agent_id == -1)
-      return i;
+    unlink(tmp_path);
+    return -1;
   }
-  return -1;
+  return 0;
 }
 
-int find_first_empty_demand()
+int write_market_snapshot(const char *path, market_snapshot_t *snapshot)
 {
-  for (int i = 0; i < MAX_DEMANDS; i++)
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  list_row_t *rows[2] = {NULL, NULL};
+  int count[2] = {0, 0};
+  uint64_t stripes = all_stripes();
+  const slot_table_t *slots[2] = {&shared_data->demand_slots, &shared_data->supply_slots};
+  for (;;)
+  {
+    // Room for the rows is taken before locking, with some slack for adds in between
+    int room[2];
+    for (int t = 0; t < 2; t++)
+    {
+      room[t] = __atomic_load_n(&slots[t]->live, __ATOMIC_RELAXED);
+      room[t] += room[t] / 8 + 64;
+      rows[t] = malloc(room[t] * sizeof(list_row_t));
+    }
+    if (rows[0] == NULL || rows[1] == NULL)
+    {
+      free(rows[0]);
+      free(rows[1]);
+      return -1;
+    }
+
+    // Only the time every stripe is held counts, not the wait for them
+    struct timespec locked;
+    lock_stripes(stripes);
+    clock_gettime(CLOCK_MONOTONIC, &locked);
+    int fits = slots[0]->live <= room[0] && slots[1]->live <= room[1];
+    if (fits)
+    {
+      int total;
+      for (int t = 0; t < 2; t++)
+      {
+        count[t] = copy_table_rows(t, rows[t], slots[t]->capacity, 0, room[t], &total);
+      }
+    }
+    unlock_stripes(stripes);
+    snapshot->pause_ms = ms_since(&locked);
+    if (fits)
+      break;
+    free(rows[0]);
+    free(rows[1]);
+  }
+  snapshot->demands = count[0];
+  snapshot->supplies = count[1];
+
+  // The child has its own copy of the rows, the tables themselves are shared
+  // memory and would keep changing under it
+  int result_pipe[2];
+  if (pipe(result_pipe) == -1)
+  {
+    free(rows[0]);
+    free(rows[1]);
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    close(result_pipe[0]);
+    int result = write_snapshot_file(path, rows, count);
+    if (write(result_pipe[1], &result, sizeof(result)) != sizeof(result))
+      _exit(EXIT_FAILURE);
+    _exit(EXIT_SUCCESS);
+  }
+  free(rows[0]);
+  free(rows[1]);
+  close(result_pipe[1]);
+  int result = -1;
+  // The result comes through the pipe, a SIGCHLD handler may reap the child first
+  ssize_t got = -1;
+  while (pid != -1 && (got = read(result_pipe[0], &result, sizeof(result))) == -1 && errno == EINTR)
   {
-    if (shared_data->demands[i].agent_id == -1)
-      return i;
   }
-  return -1;
+  if (got != sizeof(result))
+    result = -1;
+  close(result_pipe[0]);
+  if (pid != -1)
+    waitpid(pid, NULL, 0);
+  snapshot->total_ms = ms_since(&start);
+  return result;
 }
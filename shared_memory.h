@@ -1,11 +1,66 @@
 #include "data_structures.h"
+#include <stddef.h>
+#include <sys/types.h>
 
 #ifndef SHARED_MEMORY_H
 #define SHARED_MEMORY_H
 
-void init_shared_memory();
+void init_shared_memory(int map_width, int map_height);
 void destroy_shared_memory();
 
+// Keeps the tables in the file at path instead of anonymous memory, set
+// before init_shared_memory. A later server started with the same path and
+// map size takes them over, if the previous one did not stop in the middle of
+// a change.
+void set_segment_path(const char *path);
+
+// Replays the write-ahead log at path into the tables, rewrites it with just
+// the records that are left and logs every later change to it. Nothing is
+// replayed into tables taken over from a segment. Records of
+// agents from before the restart stay in the market until matched. Call after
+// init_shared_memory and before forking agents, returns -1 if the log cannot
+// be read or written.
+int open_market_log(const char *path);
+
+// Selects how check_match finds a partner, set before forking agents
+void set_match_index_mode(match_index_mode_t mode);
+
+// Chooses how free demand/supply slots are handed out, set before init_shared_memory
+void set_slot_alloc_policy(slot_alloc_policy_t policy);
+
+// Kernel used by full table scans, MATCH_KERNEL_AUTO picks AVX2 when the CPU has it
+void set_match_kernel(match_kernel_t kernel);
+
+// Number of lock stripes the map is split into, 1 gives a single global lock
+void set_lock_stripes(int stripes);
+
+// SIGTERM and SIGINT end the process only once it holds none of the stripes,
+// so a server that resumes the segment finds no table in the middle of a change
+void defer_termination();
+
+// Makes a forked process end like that when parent does, before an agent
+// could clean up its records, so they stay in the segment. Returns -1 when
+// parent is gone already.
+int end_with_parent(pid_t parent);
+
+// listdemands/listsupplies may answer from a copy up to ms milliseconds old,
+// 0 copies again whenever the table changed
+void set_list_staleness(int ms);
+
+// What producers do when a watcher's notification ring is full, set before
+// forking agents
+void set_notify_overflow(notify_overflow_t policy);
+
+typedef struct
+{
+  unsigned long dropped;
+  unsigned long spilled;
+  unsigned long blocked;
+} notification_stats_t;
+
+// Overflow counters of one agent and summed over every agent so far
+void notification_stats(int agent_id, notification_stats_t *agent, notification_stats_t *server);
+
 // Functions to access and modify shared data structures
 int add_demand(int agent_id, int nA, int nB, int nC);
 int remove_demand(int agent_id, int demand_id);
@@ -18,11 +73,62 @@ int remove_watch(int agent_id);
 
 int move(int agent_id, int x, int y);
 
-int check_match(int agent_id, int demand_or_supply_id, int is_demand);
+// Caller holds the stripes of the new record, reach is the supply reach its
+// stripes cover when matching a demand
+int check_match(int agent_id, int demand_or_supply_id, int is_demand, int reach);
+
+// Hands out the next agent id and sets up its entries, -1 once the agent
+// table is at its limit
+int get_next_agent_id(int *agent_id);
+
+// Receives text written for an agent's client
+typedef void (*notify_sink_fn)(const char *message, size_t len, void *ctx);
+
+// Receives every notification delivered to an agent
+typedef void (*notify_event_fn)(const notification_t *notif, void *ctx);
 
-void get_next_agent_id(int *agent_id);
+// Text of a notification as the text protocol sends it, returns its length
+size_t format_notification(const notification_t *notif, char *message, size_t size);
 
-void notify_client(int agent_id, int client_fd);
+// Bytes of the payload that follows the type of a notification
+size_t notification_payload_size(notification_type_t type);
+
+// Waits until the agent has notifications and hands them to sink. Returns -1
+// without waiting once interrupt_notifications was called for the agent.
+int notify_client(int agent_id, notify_event_fn sink, void *ctx);
+
+// Wakes a notify_client waiting for the agent and makes later calls return -1
+void interrupt_notifications(int agent_id);
+
+// Hands the agent's pending notifications to sink without waiting
+void deliver_notifications(int agent_id, notify_event_fn sink, void *ctx);
+
+// Socket that becomes readable when notifications for the agent arrive while
+// it is armed, for agents that poll it together with their client. -1 on error.
+int notification_wakeup_fd(int agent_id);
+
+// Call before polling the wakeup socket: returns 0 when armed, 1 when
+// notifications are pending already and the agent should deliver them
+// instead of waiting, -1 once interrupted. Delivering disarms it again.
+int arm_notification_wakeup(int agent_id);
+
+// Variants for callers holding lock_all_tables()
+void lock_all_tables();
+void unlock_all_tables();
+
+int add_demand_nolock(int agent_id, int nA, int nB, int nC);
+
+int add_supply_nolock(int agent_id, int distance, int nA, int nB, int nC);
+
+int add_watch_nolock(int agent_id, int distance);
+
+int remove_watch_nolock(int agent_id);
+
+int move_nolock(int agent_id, int x, int y);
+
+int free_demand_slots();
+
+int free_supply_slots();
 
 int remove_demand_nolock(int agent_id, int demand_id);
 
@@ -36,11 +142,39 @@ void remove_all_supplies_nolock(int agent_id);
 
 void cleanup_agent(int agent_id);
 
-char *create_supply_response(int agent_id, int all);
-
-char *create_demand_response(int agent_id, int all);
-
-int find_first_empty_supply();
+// Writes a listing of the whole table (all) or of the agent's own records to
+// sink, a few kilobytes at a time. Lists rows first to first + limit - 1, a
+// negative limit lists the rest of the table. Returns -1 if the rows could not
+// be copied.
+int write_list_response(int agent_id, int all, int supplies, int first, int limit, notify_sink_fn sink, void *ctx);
+
+// Part of the map a region listing covers: within Manhattan distance radius of
+// the agent's position (near), inside [x0,x1] x [y0,y1] (box), or both
+typedef struct
+{
+  int near;
+  int radius;
+  int box;
+  int x0;
+  int y0;
+  int x1;
+  int y1;
+} list_region_t;
+
+// Writes the demands or supplies of the whole table that lie in the region,
+// found through the spatial grids. Returns -1 on failure.
+int write_region_response(int agent_id, int supplies, const list_region_t *region, notify_sink_fn sink, void *ctx);
+typedef struct
+{
+  int demands;
+  int supplies;
+  double pause_ms; // every stripe locked, rows copied out
+  double total_ms; // until the file was on disk
+} market_snapshot_t;
+
+// Writes every demand and supply to path as CSV. The rows are copied out
+// under all stripe locks, then a forked child writes the copy while matching
+// goes on, the call waits for it. Returns -1 if the copy or the file failed.
+int write_market_snapshot(const char *path, market_snapshot_t *snapshot);
 
-int find_first_empty_demand();
 #endif // SHARED_MEMORY_H
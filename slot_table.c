@@ -0,0 +1,158 @@
+#include "slot_table.h"
+
+static void mark_used(slot_table_t *table, int index)
+{
+  int w = index / 64;
+  table->used[w] |= 1ULL << (index % 64);
+  table->nonempty[w / 64] |= 1ULL << (w % 64);
+  if (table->used[w] == ~0ULL)
+    table->notfull[w / 64] &= ~(1ULL << (w % 64));
+}
+
+static void mark_free(slot_table_t *table, int index)
+{
+  int w = index / 64;
+  table->used[w] &= ~(1ULL << (index % 64));
+  table->notfull[w / 64] |= 1ULL << (w % 64);
+  if (table->used[w] == 0)
+    table->nonempty[w / 64] &= ~(1ULL << (w % 64));
+}
+
+static int word_count(int slots)
+{
+  return (slots + 63) / 64;
+}
+
+static int summary_count(int slots)
+{
+  return (word_count(slots) + 63) / 64;
+}
+
+size_t slot_table_storage(int limit)
+{
+  return (size_t)word_count(limit) * sizeof(uint64_t) +
+         2 * (size_t)summary_count(limit) * sizeof(uint64_t) +
+         (size_t)limit * sizeof(int);
+}
+
+void slot_table_init(slot_table_t *table, void *storage, int limit, int capacity, slot_alloc_policy_t policy)
+{
+  table->used = storage;
+  table->nonempty = table->used + word_count(limit);
+  table->notfull = table->nonempty + summary_count(limit);
+  table->free_stack = (int *)(table->notfull + summary_count(limit));
+  table->limit = limit;
+  table->capacity = 0;
+  table->live = 0;
+  table->policy = policy;
+  table->free_top = 0;
+  for (int s = 0; s < summary_count(limit); s++)
+  {
+    table->nonempty[s] = 0;
+    table->notfull[s] = 0;
+  }
+  slot_table_grow(table, capacity);
+}
+
+int slot_table_grow(slot_table_t *table, int capacity)
+{
+  int old = table->capacity;
+  if (capacity > table->limit)
+    return -1;
+  if (capacity <= old)
+    return 0;
+
+  // New words start out all used, then the new slots are freed one by one.
+  // Bits past the capacity in the last word stay set so they are never handed out.
+  for (int w = word_count(old); w < word_count(capacity); w++)
+  {
+    table->used[w] = ~0ULL;
+  }
+  for (int i = old; i < capacity; i++)
+  {
+    mark_free(table, i);
+  }
+
+  // Stack is filled in reverse so the free list also starts from the lowest new slot
+  for (int i = capacity - 1; i >= old; i--)
+  {
+    table->free_stack[table->free_top++] = i;
+  }
+  __atomic_store_n(&table->capacity, capacity, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int slot_alloc(slot_table_t *table)
+{
+  int index = -1;
+  if (table->policy == SLOT_ALLOC_FREELIST)
+  {
+    if (table->free_top > 0)
+      index = table->free_stack[--table->free_top];
+  }
+  else
+  {
+    for (int s = 0; s < summary_count(table->capacity); s++)
+    {
+      if (table->notfull[s] != 0)
+      {
+        int w = s * 64 + __builtin_ctzll(table->notfull[s]);
+        index = w * 64 + __builtin_ctzll(~table->used[w]);
+        break;
+      }
+    }
+  }
+  if (index == -1)
+    return -1;
+  mark_used(table, index);
+  table->live++;
+  return index;
+}
+
+void slot_release(slot_table_t *table, int index)
+{
+  if (!slot_is_used(table, index))
+    return;
+  mark_free(table, index);
+  table->live--;
+  if (table->policy == SLOT_ALLOC_FREELIST)
+    table->free_stack[table->free_top++] = index;
+}
+
+int slot_is_used(const slot_table_t *table, int index)
+{
+  if (index < 0 || index >= table->capacity)
+    return 0;
+  return (table->used[index / 64] >> (index % 64)) & 1;
+}
+
+int slot_next(const slot_table_t *table, int from)
+{
+  int capacity = __atomic_load_n(&table->capacity, __ATOMIC_ACQUIRE);
+  if (from < 0)
+    from = 0;
+  if (from >= capacity)
+    return -1;
+
+  int w = from / 64;
+  uint64_t bits = table->used[w] & (~0ULL << (from % 64));
+  if (bits == 0)
+  {
+    // Skip to the next word holding a live slot through the summary bits
+    w++;
+    int s = w / 64;
+    if (s >= summary_count(capacity))
+      return -1;
+    uint64_t summary = table->nonempty[s] & (~0ULL << (w % 64));
+    while (summary == 0)
+    {
+      if (++s >= summary_count(capacity))
+        return -1;
+      summary = table->nonempty[s];
+    }
+    w = s * 64 + __builtin_ctzll(summary);
+    bits = table->used[w];
+  }
+  int index = w * 64 + __builtin_ctzll(bits);
+  return index < capacity ? index : -1;
+}
@@ -0,0 +1,29 @@
+#ifndef SLOT_TABLE_H
+#define SLOT_TABLE_H
+
+#include "data_structures.h"
+
+#include <stddef.h>
+
+// Bytes of storage the bitmaps and the free list need for up to limit slots
+size_t slot_table_storage(int limit);
+
+// Sets the table up on storage of slot_table_storage(limit) bytes, only the
+// part for the current capacity is touched
+void slot_table_init(slot_table_t *table, void *storage, int limit, int capacity, slot_alloc_policy_t policy);
+
+// Adds free slots up to capacity, -1 past the limit. Readers that load the
+// capacity see the new slots already set up.
+int slot_table_grow(slot_table_t *table, int capacity);
+
+// Returns a free slot and marks it used, -1 when the table is full
+int slot_alloc(slot_table_t *table);
+
+void slot_release(slot_table_t *table, int index);
+
+int slot_is_used(const slot_table_t *table, int index);
+
+// First used slot at or after from, -1 when there is none
+int slot_next(const slot_table_t *table, int from);
+
+#endif // SLOT_TABLE_H
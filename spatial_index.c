@@ -0,0 +1,224 @@
+#include "spatial_index.h"
+
+// Radii are bucketed by bit length, bucket b holds radii up to 2^b - 1
+static int radius_bucket(int radius)
+{
+  if (radius <= 0)
+    return 0;
+  return 32 - __builtin_clz((unsigned int)radius);
+}
+
+int grid_reach(const spatial_grid_t *grid)
+{
+  for (int b = GRID_RADIUS_BUCKETS - 1; b >= 0; b--)
+  {
+    if (__atomic_load_n(&grid->radius_count[b], __ATOMIC_RELAXED) > 0)
+      return b == 0 ? 0 : (int)((1LL << b) - 1);
+  }
+  return -1;
+}
+
+static int axis_cell(long long v, int min, int size, int count)
+{
+  if (v < min)
+    return 0;
+  long long c = (v - min) / size;
+  return c >= count ? count - 1 : (int)c;
+}
+
+// Distance from v to the span of cell c, edge cells extend to infinity since
+// agents may move outside of the map
+static long long axis_gap(long long v, int c, int min, int size, int count)
+{
+  long long lo = (long long)min + (long long)c * size;
+  long long hi = lo + size - 1;
+  if (c > 0 && v < lo)
+    return lo - v;
+  if (c < count - 1 && v > hi)
+    return v - hi;
+  return 0;
+}
+
+int grid_column(const spatial_grid_t *grid, long long v)
+{
+  return axis_cell(v, grid->min_x, grid->cell_w, grid->cols);
+}
+
+static int axis_cells(int length)
+{
+  if (length < 1)
+    length = 1;
+  return length < GRID_MAX_DIM ? length : GRID_MAX_DIM;
+}
+
+void grid_links_init(grid_link_t *links, int from, int to)
+{
+  for (int i = from; i < to; i++)
+  {
+    links[i].next = -1;
+    links[i].prev = -1;
+    links[i].cell = -1;
+    links[i].radius = 0;
+  }
+}
+
+void grid_init(spatial_grid_t *grid, grid_link_t *links, int capacity,
+               int min_x, int min_y, int width, int height)
+{
+  if (width < 1)
+    width = 1;
+  if (height < 1)
+    height = 1;
+  grid->min_x = min_x;
+  grid->min_y = min_y;
+  grid->cols = axis_cells(width);
+  grid->rows = axis_cells(height);
+  grid->cell_w = (width + grid->cols - 1) / grid->cols;
+  grid->cell_h = (height + grid->rows - 1) / grid->rows;
+  for (int b = 0; b < GRID_RADIUS_BUCKETS; b++)
+  {
+    grid->radius_count[b] = 0;
+  }
+  for (int i = 0; i < GRID_MAX_DIM * GRID_MAX_DIM; i++)
+  {
+    grid->cells[i].head = -1;
+    grid->cells[i].count = 0;
+    grid->cells[i].max_radius = 0;
+  }
+  grid_links_init(links, 0, capacity);
+}
+
+static void link_into_cell(spatial_grid_t *grid, grid_link_t *links, int index, int c, int radius)
+{
+  grid_cell_t *cell = &grid->cells[c];
+
+  links[index].cell = c;
+  links[index].radius = radius;
+  links[index].prev = -1;
+  links[index].next = cell->head;
+  if (cell->head != -1)
+    links[cell->head].prev = index;
+  cell->head = index;
+  if (cell->count == 0 || radius > cell->max_radius)
+    cell->max_radius = radius;
+  cell->count++;
+  __atomic_add_fetch(&grid->radius_count[radius_bucket(radius)], 1, __ATOMIC_RELAXED);
+}
+
+void grid_insert(spatial_grid_t *grid, grid_link_t *links, int index, int x, int y, int radius)
+{
+  int cx = axis_cell(x, grid->min_x, grid->cell_w, grid->cols);
+  int cy = axis_cell(y, grid->min_y, grid->cell_h, grid->rows);
+  link_into_cell(grid, links, index, cy * grid->cols + cx, radius);
+}
+
+void grid_remove(spatial_grid_t *grid, grid_link_t *links, int index)
+{
+  grid_link_t *link = &links[index];
+  if (link->cell == -1)
+    return;
+  grid_cell_t *cell = &grid->cells[link->cell];
+
+  if (link->prev != -1)
+    links[link->prev].next = link->next;
+  else
+    cell->head = link->next;
+  if (link->next != -1)
+    links[link->next].prev = link->prev;
+  // max_radius stays an upper bound until the cell drains
+  cell->count--;
+  if (cell->count == 0)
+    cell->max_radius = 0;
+  __atomic_sub_fetch(&grid->radius_count[radius_bucket(link->radius)], 1, __ATOMIC_RELAXED);
+
+  link->next = -1;
+  link->prev = -1;
+  link->cell = -1;
+  link->radius = 0;
+}
+
+int grid_visit_covering(const spatial_grid_t *grid, const grid_link_t *links, int x, int y, int reach,
+                        grid_visit_fn visit, void *ctx)
+{
+  if (reach < 0)
+    return 0;
+
+  int cx0 = axis_cell((long long)x - reach, grid->min_x, grid->cell_w, grid->cols);
+  int cx1 = axis_cell((long long)x + reach, grid->min_x, grid->cell_w, grid->cols);
+  int cy0 = axis_cell((long long)y - reach, grid->min_y, grid->cell_h, grid->rows);
+  int cy1 = axis_cell((long long)y + reach, grid->min_y, grid->cell_h, grid->rows);
+
+  for (int cy = cy0; cy <= cy1; cy++)
+  {
+    long long gap_y = axis_gap(y, cy, grid->min_y, grid->cell_h, grid->rows);
+    for (int cx = cx0; cx <= cx1; cx++)
+    {
+      const grid_cell_t *cell = &grid->cells[cy * grid->cols + cx];
+      if (cell->count == 0)
+        continue;
+      long long gap = gap_y + axis_gap(x, cx, grid->min_x, grid->cell_w, grid->cols);
+      if (gap > cell->max_radius)
+        continue;
+      for (int i = cell->head; i != -1; i = links[i].next)
+      {
+        if (visit(i, ctx))
+          return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+int grid_visit_box(const spatial_grid_t *grid, const grid_link_t *links,
+                   long long x0, long long y0, long long x1, long long y1,
+                   grid_visit_fn visit, void *ctx)
+{
+  if (x0 > x1 || y0 > y1)
+    return 0;
+
+  int cx0 = axis_cell(x0, grid->min_x, grid->cell_w, grid->cols);
+  int cx1 = axis_cell(x1, grid->min_x, grid->cell_w, grid->cols);
+  int cy0 = axis_cell(y0, grid->min_y, grid->cell_h, grid->rows);
+  int cy1 = axis_cell(y1, grid->min_y, grid->cell_h, grid->rows);
+
+  for (int cy = cy0; cy <= cy1; cy++)
+  {
+    for (int cx = cx0; cx <= cx1; cx++)
+    {
+      const grid_cell_t *cell = &grid->cells[cy * grid->cols + cx];
+      for (int i = cell->head; i != -1; i = links[i].next)
+      {
+        if (visit(i, ctx))
+          return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+void rotated_grid_init(spatial_grid_t *grid, grid_link_t *links, int capacity, int width, int height)
+{
+  if (width < 1)
+    width = 1;
+  if (height < 1)
+    height = 1;
+  // u = x + y spans [0, w + h - 2] and v = x - y spans [1 - h, w - 1] on the map
+  grid_init(grid, links, capacity, 0, 1 - height, width + height - 1, width + height - 1);
+}
+
+void rotated_grid_insert(spatial_grid_t *grid, grid_link_t *links, int index, int x, int y)
+{
+  int cu = axis_cell((long long)x + y, grid->min_x, grid->cell_w, grid->cols);
+  int cv = axis_cell((long long)x - y, grid->min_y, grid->cell_h, grid->rows);
+  link_into_cell(grid, links, index, cv * grid->cols + cu, 0);
+}
+
+int rotated_grid_visit_within(const spatial_grid_t *grid, const grid_link_t *links, int x, int y, int d,
+                              grid_visit_fn visit, void *ctx)
+{
+  if (d < 0)
+    return 0;
+  long long u = (long long)x + y;
+  long long v = (long long)x - y;
+  return grid_visit_box(grid, links, u - d, v - d, u + d, v + d, visit, ctx);
+}
@@ -0,0 +1,45 @@
+#ifndef SPATIAL_INDEX_H
+#define SPATIAL_INDEX_H
+
+#include "data_structures.h"
+
+// Called for every candidate found by a grid query, return non-zero to stop the walk
+typedef int (*grid_visit_fn)(int index, void *ctx);
+
+void grid_init(spatial_grid_t *grid, grid_link_t *links, int capacity,
+               int min_x, int min_y, int width, int height);
+
+// Unlinks items from..to-1, for the slots a growing table adds
+void grid_links_init(grid_link_t *links, int from, int to);
+
+void grid_insert(spatial_grid_t *grid, grid_link_t *links, int index, int x, int y, int radius);
+
+void grid_remove(spatial_grid_t *grid, grid_link_t *links, int index);
+
+// Largest radius any item may have, -1 when the grid is empty. The histogram
+// behind it is updated atomically so it can be read without the cell locks.
+int grid_reach(const spatial_grid_t *grid);
+
+// Grid column holding coordinate v, clamped to the grid
+int grid_column(const spatial_grid_t *grid, long long v);
+
+// Visits the items within reach of (x,y) whose radius may cover it, caller
+// does the exact distance test
+int grid_visit_covering(const spatial_grid_t *grid, const grid_link_t *links, int x, int y, int reach,
+                        grid_visit_fn visit, void *ctx);
+
+// Visits the items stored in cells overlapping the box [x0,x1] x [y0,y1]
+int grid_visit_box(const spatial_grid_t *grid, const grid_link_t *links,
+                   long long x0, long long y0, long long x1, long long y1,
+                   grid_visit_fn visit, void *ctx);
+
+// Point index over (x+y, x-y), a Manhattan diamond there is an axis aligned square
+void rotated_grid_init(spatial_grid_t *grid, grid_link_t *links, int capacity, int width, int height);
+
+void rotated_grid_insert(spatial_grid_t *grid, grid_link_t *links, int index, int x, int y);
+
+// Visits the items that may lie within Manhattan distance d of (x,y)
+int rotated_grid_visit_within(const spatial_grid_t *grid, const grid_link_t *links, int x, int y, int d,
+                              grid_visit_fn visit, void *ctx);
+
+#endif // SPATIAL_INDEX_H
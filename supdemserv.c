@@ -1,31 +1,67 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
+#include <getopt.h>
 
 #include "agent.h"
+#include "agent_pool.h"
+#include "io_ring.h"
+#include "reactor.h"
 #include "shared_memory.h"
 
-int main(int argc, char *argv[])
+#define ACCEPT_BATCH 64 // connections taken per wakeup before their agents are forked
+
+void usage(const char *prog_name)
 {
-  if (argc != 4)
-  {
-    fprintf(stderr, "Usage: %s conn Width Height\n", argv[0]);
-    exit(EXIT_FAILURE);
-  }
+  fprintf(stderr, "Usage: %s [options] conn Width Height\n", prog_name);
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  --match-index MODE   grid (default), scan, or verify to check the grid against a scan\n");
+  fprintf(stderr, "  --slot-alloc POLICY  lowest (default) reuses the lowest free slot, freelist reuses the last freed one\n");
+  fprintf(stderr, "  --match-kernel K     auto (default), scalar or avx2 kernel for full table scans\n");
+  fprintf(stderr, "  --lock-stripes N     split the map into N lock stripes (1-%d, default 16)\n", MAX_LOCK_STRIPES);
+  fprintf(stderr, "  --list-staleness MS  listdemands/listsupplies may answer from a snapshot up to MS ms old (default 0)\n");
+  fprintf(stderr, "  --reply-mode MODE    pipelined (default) sends the replies to one read with one writev, immediate writes each\n");
+  fprintf(stderr, "  --agent-loop MODE    threads (default) gives each agent a command and a notification thread, epoll one thread for both,\n");
+  fprintf(stderr, "                       uring one thread on an io_uring (epoll where io_uring is unavailable)\n");
+  fprintf(stderr, "  --reactor N          serve all connections from this process with N epoll worker threads\n");
+  fprintf(stderr, "  --pool N             keep N pre-forked agents waiting for clients instead of forking per connection\n");
+  fprintf(stderr, "  --pool-max-idle M    agents back from a client exit while more than M wait (default 2N)\n");
+  fprintf(stderr, "  --acceptors N        N processes accept connections, each with its own SO_REUSEPORT socket for TCP\n");
+  fprintf(stderr, "  --notify-overflow P  full notification ring: drop-oldest (default), block for up to %d ms (threads loop only), or spill\n", NOTIFY_BLOCK_MS);
+  fprintf(stderr, "  --wal PATH           log every demand and supply change to PATH, replies wait until it is on disk,\n");
+  fprintf(stderr, "                       and restore the market from it on startup\n");
+  fprintf(stderr, "  --segment PATH       keep the tables in the file PATH, a restarted server takes them over\n");
+  fprintf(stderr, "  --snapshot-dir DIR   the snapshot command writes a CSV dump of the market to DIR, not with --reactor\n");
+}
 
-  char *conn = argv[1];
-  int map_width = atoi(argv[2]);
-  int map_height = atoi(argv[3]);
+static struct sockaddr_in tcp_addr;
+static int reactor_workers = 0;
+static int pool_size = 0;
+static int pool_max_idle = -1;
 
-  // Initialize shared memory
-  init_shared_memory();
+static void reap_children(int sig)
+{
+  (void)sig;
+  int saved_errno = errno;
+  while (waitpid(-1, NULL, WNOHANG) > 0)
+  {
+  }
+  errno = saved_errno;
+}
 
-  // Setup listening socket based on conn
+// Listening socket for conn, with SO_REUSEPORT when several acceptors bind
+// the same TCP port
+static int open_listener(const char *conn, int reuseport)
+{
   int listen_fd;
   if (conn[0] == '@')
   {
@@ -35,7 +71,7 @@ int main(int argc, char *argv[])
     addr.sun_family = AF_UNIX;
     strncpy(addr.sun_path, conn + 1, sizeof(addr.sun_path) - 1);
 
-    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (listen_fd == -1)
     {
       perror("unix socket init problem");
@@ -51,33 +87,19 @@ int main(int argc, char *argv[])
   else
   {
     // Create TCP socket
-    char *ip_str = strtok(conn, ":");
-    char *port_str = strtok(NULL, ":");
-    if (!ip_str || !port_str)
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd == -1)
     {
-      fprintf(stderr, "Invalid conn format. Should be ip:port\n");
+      perror("tcp socket init problem");
       exit(EXIT_FAILURE);
     }
-    int port = atoi(port_str);
-
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(struct sockaddr_in));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    if (inet_pton(AF_INET, ip_str, &addr.sin_addr) <= 0)
+    int on = 1;
+    if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
     {
-      perror("inet_pton error");
+      perror("SO_REUSEPORT");
       exit(EXIT_FAILURE);
     }
-
-    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (listen_fd == -1)
-    {
-      perror("tcp socket init problem");
-      exit(EXIT_FAILURE);
-    }
-
-    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) == -1)
+    if (bind(listen_fd, (struct sockaddr *)&tcp_addr, sizeof(struct sockaddr_in)) == -1)
     {
       perror("tcp socket bind problem");
       exit(EXIT_FAILURE);
@@ -89,36 +111,387 @@ int main(int argc, char *argv[])
     perror("listen");
     exit(EXIT_FAILURE);
   }
+  return listen_fd;
+}
 
+// Forks an agent for every connection. Whatever is queued on the listening
+// socket is taken in one go with accept4 before the forks.
+static void accept_loop(int listen_fd)
+{
+  int client_fds[ACCEPT_BATCH];
+  pid_t acceptor_pid = getpid();
+  struct pollfd listener = {.fd = listen_fd, .events = POLLIN};
   while (1)
   {
-    int client_fd = accept(listen_fd, NULL, NULL);
-    if (client_fd == -1)
-    {
-      perror("accept");
+    if (poll(&listener, 1, -1) == -1)
       continue;
+    int count = 0;
+    while (count < ACCEPT_BATCH)
+    {
+      int client_fd = accept4(listen_fd, NULL, NULL, 0);
+      if (client_fd == -1)
+      {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          perror("accept");
+        break;
+      }
+      client_fds[count++] = client_fd;
     }
 
+    for (int i = 0; i < count; i++)
+    {
+      pid_t pid = fork();
+      if (pid == -1)
+      {
+        perror("fork");
+        close(client_fds[i]);
+        continue;
+      }
+      else if (pid == 0)
+      {
+        // Child process (agent), it ends with the acceptor
+        if (end_with_parent(acceptor_pid) == -1)
+          exit(EXIT_SUCCESS);
+        close(listen_fd);
+        for (int j = i + 1; j < count; j++)
+        {
+          close(client_fds[j]);
+        }
+        signal(SIGCHLD, SIG_DFL);
+        agent_process(client_fds[i]);
+        exit(EXIT_SUCCESS);
+      }
+      else
+      {
+        // Parent process
+        close(client_fds[i]);
+      }
+    }
+  }
+}
+
+// Runs the selected server mode on one listening socket, does not return
+static void serve(int listen_fd)
+{
+  // The reactor's threads change the tables in this process
+  if (reactor_workers > 0)
+  {
+    defer_termination();
+    run_reactor(listen_fd, reactor_workers);
+  }
+  if (pool_size > 0)
+    run_agent_pool(listen_fd, pool_size, pool_max_idle == -1 ? 2 * pool_size : pool_max_idle);
+  accept_loop(listen_fd);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  static struct option long_options[] = {
+      {"match-index", required_argument, 0, 0},
+      {"slot-alloc", required_argument, 0, 0},
+      {"match-kernel", required_argument, 0, 0},
+      {"lock-stripes", required_argument, 0, 0},
+      {"list-staleness", required_argument, 0, 0},
+      {"reply-mode", required_argument, 0, 0},
+      {"notify-overflow", required_argument, 0, 0},
+      {"agent-loop", required_argument, 0, 0},
+      {"reactor", required_argument, 0, 0},
+      {"pool", required_argument, 0, 0},
+      {"pool-max-idle", required_argument, 0, 0},
+      {"acceptors", required_argument, 0, 0},
+      {"wal", required_argument, 0, 0},
+      {"segment", required_argument, 0, 0},
+      {"snapshot-dir", required_argument, 0, 0},
+      {0, 0, 0, 0}};
+  int option_index = 0;
+  int acceptors = 1;
+  const char *wal_path = NULL;
+  int blocking_overflow = 0;
+  int single_thread_agents = 0;
+  int snapshots = 0;
+
+  while ((opt = getopt_long(argc, argv, "", long_options, &option_index)) != -1)
+  {
+    switch (opt)
+    {
+    case 0:
+      if (strcmp(long_options[option_index].name, "match-index") == 0)
+      {
+        if (strcmp(optarg, "grid") == 0)
+          set_match_index_mode(MATCH_INDEX_GRID);
+        else if (strcmp(optarg, "scan") == 0)
+          set_match_index_mode(MATCH_INDEX_SCAN);
+        else if (strcmp(optarg, "verify") == 0)
+          set_match_index_mode(MATCH_INDEX_VERIFY);
+        else
+        {
+          fprintf(stderr, "Invalid match index mode: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(long_options[option_index].name, "slot-alloc") == 0)
+      {
+        if (strcmp(optarg, "lowest") == 0)
+          set_slot_alloc_policy(SLOT_ALLOC_LOWEST);
+        else if (strcmp(optarg, "freelist") == 0)
+          set_slot_alloc_policy(SLOT_ALLOC_FREELIST);
+        else
+        {
+          fprintf(stderr, "Invalid slot allocation policy: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(long_options[option_index].name, "match-kernel") == 0)
+      {
+        if (strcmp(optarg, "auto") == 0)
+          set_match_kernel(MATCH_KERNEL_AUTO);
+        else if (strcmp(optarg, "scalar") == 0)
+          set_match_kernel(MATCH_KERNEL_SCALAR);
+        else if (strcmp(optarg, "avx2") == 0)
+          set_match_kernel(MATCH_KERNEL_AVX2);
+        else
+        {
+          fprintf(stderr, "Invalid match kernel: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(long_options[option_index].name, "lock-stripes") == 0)
+      {
+        int stripes = atoi(optarg);
+        if (stripes < 1 || stripes > MAX_LOCK_STRIPES)
+        {
+          fprintf(stderr, "Invalid lock stripe count: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        set_lock_stripes(stripes);
+      }
+      else if (strcmp(long_options[option_index].name, "list-staleness") == 0)
+      {
+        int ms = atoi(optarg);
+        if (ms < 0)
+        {
+          fprintf(stderr, "Invalid list staleness: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        set_list_staleness(ms);
+      }
+      else if (strcmp(long_options[option_index].name, "reply-mode") == 0)
+      {
+        if (strcmp(optarg, "pipelined") == 0)
+          set_pipelined_replies(1);
+        else if (strcmp(optarg, "immediate") == 0)
+          set_pipelined_replies(0);
+        else
+        {
+          fprintf(stderr, "Invalid reply mode: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(long_options[option_index].name, "notify-overflow") == 0)
+      {
+        if (strcmp(optarg, "drop-oldest") == 0)
+          set_notify_overflow(NOTIFY_OVERFLOW_DROP_OLDEST);
+        else if (strcmp(optarg, "block") == 0)
+        {
+          set_notify_overflow(NOTIFY_OVERFLOW_BLOCK);
+          blocking_overflow = 1;
+        }
+        else if (strcmp(optarg, "spill") == 0)
+          set_notify_overflow(NOTIFY_OVERFLOW_SPILL);
+        else
+        {
+          fprintf(stderr, "Invalid notification overflow policy: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(long_options[option_index].name, "agent-loop") == 0)
+      {
+        single_thread_agents = strcmp(optarg, "threads") != 0;
+        if (strcmp(optarg, "threads") == 0)
+          set_agent_loop(AGENT_LOOP_THREADS);
+        else if (strcmp(optarg, "epoll") == 0)
+          set_agent_loop(AGENT_LOOP_EPOLL);
+        else if (strcmp(optarg, "uring") == 0 && io_ring_supported())
+          set_agent_loop(AGENT_LOOP_URING);
+        else if (strcmp(optarg, "uring") == 0)
+        {
+          fprintf(stderr, "Debug: io_uring is unavailable, agents use the epoll loop\n");
+          set_agent_loop(AGENT_LOOP_EPOLL);
+        }
+        else
+        {
+          fprintf(stderr, "Invalid agent loop: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(long_options[option_index].name, "reactor") == 0)
+      {
+        reactor_workers = atoi(optarg);
+        if (reactor_workers < 1)
+        {
+          fprintf(stderr, "Invalid reactor worker count: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(long_options[option_index].name, "pool") == 0)
+      {
+        pool_size = atoi(optarg);
+        if (pool_size < 1)
+        {
+          fprintf(stderr, "Invalid pool size: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(long_options[option_index].name, "pool-max-idle") == 0)
+      {
+        pool_max_idle = atoi(optarg);
+        if (pool_max_idle < 1)
+        {
+          fprintf(stderr, "Invalid pool idle limit: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(long_options[option_index].name, "acceptors") == 0)
+      {
+        acceptors = atoi(optarg);
+        if (acceptors < 1)
+        {
+          fprintf(stderr, "Invalid acceptor count: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(long_options[option_index].name, "wal") == 0)
+      {
+        wal_path = optarg;
+      }
+      else if (strcmp(long_options[option_index].name, "segment") == 0)
+      {
+        set_segment_path(optarg);
+      }
+      else if (strcmp(long_options[option_index].name, "snapshot-dir") == 0)
+      {
+        set_snapshot_dir(optarg);
+        snapshots = 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (argc - optind != 3)
+  {
+    usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (reactor_workers > 0 && pool_size > 0)
+  {
+    fprintf(stderr, "--reactor and --pool are different server modes, pick one\n");
+    exit(EXIT_FAILURE);
+  }
+  // A worker blocked on a full ring may be the one that has to drain it
+  if (reactor_workers > 0 && blocking_overflow)
+  {
+    fprintf(stderr, "--notify-overflow block needs an agent per connection, not --reactor\n");
+    exit(EXIT_FAILURE);
+  }
+  // Same with one agent thread, a match notifies the supplier, who may be the agent itself
+  if (single_thread_agents && blocking_overflow)
+  {
+    fprintf(stderr, "--notify-overflow block needs --agent-loop threads\n");
+    exit(EXIT_FAILURE);
+  }
+  // The agent waits for the snapshot writer, a worker would stall all its connections
+  if (reactor_workers > 0 && snapshots)
+  {
+    fprintf(stderr, "--snapshot-dir needs an agent per connection, not --reactor\n");
+    exit(EXIT_FAILURE);
+  }
+
+  char *conn = argv[optind];
+  int map_width = atoi(argv[optind + 1]);
+  int map_height = atoi(argv[optind + 2]);
+
+  // Initialize shared memory
+  init_shared_memory(map_width, map_height);
+
+  // The market is back before the first client, every agent shares the log
+  if (wal_path != NULL && open_market_log(wal_path) == -1)
+  {
+    perror(wal_path);
+    exit(EXIT_FAILURE);
+  }
+
+  // A client that hangs up must not kill its agent in the middle of a write,
+  // the agent would die holding shared locks
+  signal(SIGPIPE, SIG_IGN);
+
+  // Setup listening socket based on conn
+  if (conn[0] != '@')
+  {
+    char *ip_str = strtok(conn, ":");
+    char *port_str = strtok(NULL, ":");
+    if (!ip_str || !port_str)
+    {
+      fprintf(stderr, "Invalid conn format. Should be ip:port\n");
+      exit(EXIT_FAILURE);
+    }
+    tcp_addr.sin_family = AF_INET;
+    tcp_addr.sin_port = htons(atoi(port_str));
+    if (inet_pton(AF_INET, ip_str, &tcp_addr.sin_addr) <= 0)
+    {
+      perror("inet_pton error");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Unix sockets cannot balance between listeners, acceptors share one then
+  int tcp = conn[0] != '@';
+  int *listen_fds = malloc(acceptors * sizeof(int));
+  for (int i = 0; i < acceptors; i++)
+  {
+    listen_fds[i] = i == 0 || tcp ? open_listener(conn, acceptors > 1) : listen_fds[0];
+  }
+
+  // Agents exit on their own, the acceptor that forked them reaps them
+  struct sigaction chld;
+  memset(&chld, 0, sizeof(chld));
+  chld.sa_handler = reap_children;
+  chld.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction(SIGCHLD, &chld, NULL);
+
+  if (acceptors == 1)
+    serve(listen_fds[0]);
+  pid_t server_pid = getpid();
+  for (int i = 0; i < acceptors; i++)
+  {
     pid_t pid = fork();
     if (pid == -1)
     {
       perror("fork");
-      close(client_fd);
-      continue;
-    }
-    else if (pid == 0)
-    {
-      // Child process (agent)
-      close(listen_fd);
-      agent_process(client_fd);
-      exit(EXIT_SUCCESS);
+      exit(EXIT_FAILURE);
     }
-    else
+    if (pid == 0)
     {
-      // Parent process
-      close(client_fd);
+      // Stopping the server stops its acceptors, and they their agents
+      if (end_with_parent(server_pid) == -1)
+        exit(EXIT_SUCCESS);
+      for (int j = 0; j < acceptors; j++)
+      {
+        if (listen_fds[j] != listen_fds[i])
+          close(listen_fds[j]);
+      }
+      serve(listen_fds[i]);
     }
   }
+  // The acceptors only end if something went badly wrong
+  signal(SIGCHLD, SIG_DFL);
+  while (wait(NULL) > 0)
+  {
+  }
 
   // Cleanup shared memory (won't reach here in current code)
   destroy_shared_memory();
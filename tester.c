@@ -9,11 +9,17 @@
 #include <pthread.h>
 #include <signal.h>
 #include <getopt.h>
+#include <time.h>
+#include "binary_protocol.h"
 
 #define BUFFER_SIZE 4096
 
 volatile int running = 1;
 
+// Syscalls made on the sockets, reported at the end of script mode
+static long socket_writes = 0;
+static long socket_reads = 0;
+
 void usage(const char *prog_name)
 {
   fprintf(stderr, "Usage: %s [options] conn [port]\n", prog_name);
@@ -22,6 +28,12 @@ void usage(const char *prog_name)
   fprintf(stderr, "  -s scriptfile      Script mode: read commands from scriptfile\n");
   fprintf(stderr, "  -n num_clients     Number of clients to simulate (default 1)\n");
   fprintf(stderr, "  --delay N          Delay between commands in milliseconds (default 0)\n");
+  fprintf(stderr, "  --bench N          Benchmark mode: each client runs N move+demand/supply ops and reports ops/s\n");
+  fprintf(stderr, "  --bench-size S     Coordinates used by the benchmark fall in [0,S) (default 1000)\n");
+  fprintf(stderr, "  --binary           Benchmark over the binary protocol instead of text commands\n");
+  fprintf(stderr, "  --connect-bench N  Connect benchmark: each client connects N times, runs one move and quits\n");
+  fprintf(stderr, "  --pipeline         Script mode: send the script in large chunks without waiting between commands\n");
+  fprintf(stderr, "  --syscall-stats    Script mode: print the socket syscalls made per command at the end\n");
   fprintf(stderr, "  conn               Connection string. If it starts with '@', Unix socket path; else IP\n");
   fprintf(stderr, "  port               Port number (required if conn is IP)\n");
 }
@@ -89,6 +101,7 @@ ssize_t send_command(int sockfd, const char *command)
   while (total_sent < len)
   {
     ssize_t sent = write(sockfd, command + total_sent, len - total_sent);
+    __atomic_add_fetch(&socket_writes, 1, __ATOMIC_RELAXED);
     if (sent <= 0)
     {
       perror("write");
@@ -114,6 +127,7 @@ void *receiver_thread(void *arg)
     ssize_t n = read(sockfd, buffer, sizeof(buffer) - 1);
     if (n > 0)
     {
+      __atomic_add_fetch(&socket_reads, 1, __ATOMIC_RELAXED);
       buffer[n] = '\0';
       printf("%s", buffer);
       fflush(stdout);
@@ -211,13 +225,219 @@ typedef struct
   int interactive_mode;
   char *scriptfile;
   int delay_ms;
+  int pipeline;
+  long commands;
   int client_num; // For identification
+  int bench_ops;
+  int bench_done; // ops that got their replies
+  int bench_size;
+  int binary;
+  double bench_seconds;
+  int connect_ops;
+  int connects_done;
+  double *connect_latency; // seconds from connect to the first reply, per connection
 } client_args_t;
 
+// Reads until `count` more replies arrived, a reply ends in "OK" or in the
+// newline of an error while notifications have neither
+static int wait_for_ok(int sockfd, int count, char *last)
+{
+  char buffer[BUFFER_SIZE];
+  while (count > 0)
+  {
+    ssize_t n = read(sockfd, buffer, sizeof(buffer));
+    if (n <= 0)
+    {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    for (ssize_t i = 0; i < n; i++)
+    {
+      if ((*last == 'O' && buffer[i] == 'K') || buffer[i] == '\n')
+        count--;
+      *last = buffer[i];
+    }
+  }
+  return 0;
+}
+
+// Replies of a benchmark connection in either protocol
+typedef struct
+{
+  int binary;
+  char last;   // last text byte seen
+  size_t used; // bytes of a partial frame at the start of data
+  char data[1 << 16];
+} reply_reader_t;
+
+// Sends the text command, or the frame of op with its nargs arguments
+static int send_request(int sockfd, const reply_reader_t *reader, const char *command, int op, const int32_t *values,
+                        int nargs)
+{
+  if (!reader->binary)
+    return send_command(sockfd, command) == -1 ? -1 : 0;
+  bin_request_t request;
+  memset(&request, 0, sizeof(request));
+  request.header.length = sizeof(bin_header_t) + nargs * sizeof(int32_t);
+  request.header.op = op;
+  memcpy(request.args, values, nargs * sizeof(int32_t));
+  if (write(sockfd, &request, request.header.length) != request.header.length)
+    return -1;
+  return 0;
+}
+
+// Reads until `count` more replies arrived, notification events and the
+// partial frames of a listing do not count
+static int wait_for_replies(int sockfd, reply_reader_t *reader, int count)
+{
+  if (!reader->binary)
+    return wait_for_ok(sockfd, count, &reader->last);
+  while (count > 0)
+  {
+    ssize_t n = read(sockfd, reader->data + reader->used, sizeof(reader->data) - reader->used);
+    if (n <= 0)
+    {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+    reader->used += n;
+    size_t at = 0;
+    bin_header_t header;
+    while (reader->used - at >= sizeof(header))
+    {
+      memcpy(&header, reader->data + at, sizeof(header));
+      if (header.length < sizeof(header))
+        return -1;
+      if (reader->used - at < header.length)
+        break;
+      if (header.op != BIN_NOTIFICATION && header.flags != BIN_MORE)
+        count--;
+      at += header.length;
+    }
+    reader->used -= at;
+    memmove(reader->data, reader->data + at, reader->used);
+  }
+  return 0;
+}
+
+// Closed loop load, each op moves the agent to a random spot and posts a
+// demand or a short range supply there once the previous op is acknowledged
+void run_bench_mode(int sockfd, client_args_t *args)
+{
+  unsigned int seed = args->client_num * 7919 + 1;
+  char command[128];
+  int32_t values[4];
+  struct timespec start, end;
+  reply_reader_t *reader = calloc(1, sizeof(reply_reader_t));
+
+  // The switch to frames is not part of the timed loop
+  if (args->binary && (send_command(sockfd, "binary\n") == -1 || wait_for_replies(sockfd, reader, 1) == -1))
+  {
+    free(reader);
+    return;
+  }
+  reader->binary = args->binary;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int op;
+  for (op = 0; op < args->bench_ops; op++)
+  {
+    values[0] = rand_r(&seed) % args->bench_size;
+    values[1] = rand_r(&seed) % args->bench_size;
+    snprintf(command, sizeof(command), "move %d %d\n", values[0], values[1]);
+    if (send_request(sockfd, reader, command, BIN_MOVE, values, 2) == -1 || wait_for_replies(sockfd, reader, 1) == -1)
+      break;
+    int request;
+    if (op % 2 == 0)
+    {
+      for (int k = 0; k < 3; k++)
+      {
+        values[k] = rand_r(&seed) % 3;
+      }
+      snprintf(command, sizeof(command), "demand %d %d %d\n", values[0], values[1], values[2]);
+      request = send_request(sockfd, reader, command, BIN_DEMAND, values, 3);
+    }
+    else
+    {
+      values[0] = 1 + rand_r(&seed) % 8;
+      for (int k = 1; k < 4; k++)
+      {
+        values[k] = rand_r(&seed) % 6;
+      }
+      snprintf(command, sizeof(command), "supply %d %d %d %d\n", values[0], values[1], values[2], values[3]);
+      request = send_request(sockfd, reader, command, BIN_SUPPLY, values, 4);
+    }
+    if (request == -1 || wait_for_replies(sockfd, reader, 1) == -1)
+      break;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  // Only the ops that got their replies count, a failed one ends the run
+  args->bench_done = op;
+  args->bench_seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("Client %d: %d ops in %.3f s, %.0f ops/s\n", args->client_num, args->bench_done,
+         args->bench_seconds, args->bench_done / args->bench_seconds);
+  send_request(sockfd, reader, "quit\n", BIN_QUIT, values, 0);
+  free(reader);
+}
+
+static int connect_server(client_args_t *args)
+{
+  if (args->conn[0] == '@')
+    return connect_unix_domain_socket(args->conn + 1);
+  return connect_tcp_socket(args->conn, args->port);
+}
+
+// Connection storm, each connection is opened, served one move and closed.
+// The latency covers the accept and the agent start on the server.
+void run_connect_bench(client_args_t *args)
+{
+  struct timespec start, connected, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int op = 0; op < args->connect_ops; op++)
+  {
+    char last = 0;
+    clock_gettime(CLOCK_MONOTONIC, &connected);
+    int sockfd = connect_server(args);
+    if (sockfd == -1)
+      break;
+    if (send_command(sockfd, "move 1 1\n") == -1 || wait_for_ok(sockfd, 1, &last) == -1)
+    {
+      close(sockfd);
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    args->connect_latency[args->connects_done++] =
+        (end.tv_sec - connected.tv_sec) + (end.tv_nsec - connected.tv_nsec) / 1e9;
+    send_command(sockfd, "quit\n");
+    close(sockfd);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  args->bench_seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("Client %d: %d connects in %.3f s, %.0f connects/s\n", args->client_num, args->connects_done,
+         args->bench_seconds, args->connects_done / args->bench_seconds);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
 void *client_thread(void *arg)
 {
   client_args_t *args = (client_args_t *)arg;
 
+  if (args->connect_ops > 0)
+  {
+    run_connect_bench(args);
+    pthread_exit(NULL);
+  }
+
   int sockfd = -1;
   if (args->conn[0] == '@')
   {
@@ -238,6 +458,14 @@ void *client_thread(void *arg)
     pthread_exit(NULL);
   }
 
+  if (args->bench_ops > 0)
+  {
+    // The benchmark reads the replies itself
+    run_bench_mode(sockfd, args);
+    close(sockfd);
+    pthread_exit(NULL);
+  }
+
   // Start receiver thread
   int *sockfd_ptr = malloc(sizeof(int));
   if (sockfd_ptr == NULL)
@@ -288,6 +516,8 @@ void *client_thread(void *arg)
     }
 
     char line[BUFFER_SIZE];
+    char chunk[BUFFER_SIZE + 2]; // room for a full line, its newline and the terminator
+    size_t chunk_len = 0;
     while (running && fgets(line, sizeof(line), script_fp) != NULL)
     {
       // Remove trailing newline
@@ -295,6 +525,29 @@ void *client_thread(void *arg)
       if (len > 0 && line[len - 1] == '\n')
       {
         line[len - 1] = '\0';
+        len--;
+      }
+      args->commands++;
+
+      if (args->pipeline)
+      {
+        // Commands go out in chunks, the server answers a chunk with one write
+        if (chunk_len + len + 2 > sizeof(chunk))
+        {
+          chunk[chunk_len] = '\0';
+          if (send_command(sockfd, chunk) == -1)
+          {
+            printf("Client %d: Failed to send commands.\n", args->client_num);
+            break;
+          }
+          chunk_len = 0;
+        }
+        memcpy(chunk + chunk_len, line, len);
+        chunk_len += len;
+        chunk[chunk_len++] = '\n';
+        if (strcmp(line, "quit") == 0)
+          break;
+        continue;
       }
 
       // Send the command to the server
@@ -324,6 +577,13 @@ void *client_thread(void *arg)
       }
     }
 
+    if (chunk_len > 0)
+    {
+      chunk[chunk_len] = '\0';
+      if (send_command(sockfd, chunk) == -1)
+        printf("Client %d: Failed to send commands.\n", args->client_num);
+    }
+
     usleep(1000000); // 1 second
     fclose(script_fp);
   }
@@ -344,11 +604,23 @@ int main(int argc, char *argv[])
   char *scriptfile = NULL;
   int interactive_mode = 1;
   int delay_ms = 0;
+  int bench_ops = 0;
+  int bench_size = 1000;
+  int connect_ops = 0;
+  int pipeline = 0;
+  int binary = 0;
+  int syscall_stats = 0;
 
   // Parse command-line options
   int opt;
   static struct option long_options[] = {
       {"delay", required_argument, 0, 0},
+      {"bench", required_argument, 0, 0},
+      {"bench-size", required_argument, 0, 0},
+      {"connect-bench", required_argument, 0, 0},
+      {"pipeline", no_argument, 0, 0},
+      {"binary", no_argument, 0, 0},
+      {"syscall-stats", no_argument, 0, 0},
       {0, 0, 0, 0}};
   int option_index = 0;
 
@@ -381,6 +653,45 @@ int main(int argc, char *argv[])
           exit(EXIT_FAILURE);
         }
       }
+      else if (strcmp(long_options[option_index].name, "bench") == 0)
+      {
+        bench_ops = atoi(optarg);
+        if (bench_ops <= 0)
+        {
+          fprintf(stderr, "Invalid benchmark op count: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(long_options[option_index].name, "bench-size") == 0)
+      {
+        bench_size = atoi(optarg);
+        if (bench_size <= 0)
+        {
+          fprintf(stderr, "Invalid benchmark size: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(long_options[option_index].name, "connect-bench") == 0)
+      {
+        connect_ops = atoi(optarg);
+        if (connect_ops <= 0)
+        {
+          fprintf(stderr, "Invalid connect count: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+      }
+      else if (strcmp(long_options[option_index].name, "pipeline") == 0)
+      {
+        pipeline = 1;
+      }
+      else if (strcmp(long_options[option_index].name, "binary") == 0)
+      {
+        binary = 1;
+      }
+      else if (strcmp(long_options[option_index].name, "syscall-stats") == 0)
+      {
+        syscall_stats = 1;
+      }
       break;
     default:
       usage(argv[0]);
@@ -437,6 +748,10 @@ int main(int argc, char *argv[])
     exit(EXIT_FAILURE);
   }
 
+  // A server that goes away ends the benchmark with what it completed
+  if (bench_ops > 0)
+    signal(SIGPIPE, SIG_IGN);
+
   for (int i = 0; i < num_clients; i++)
   {
     client_args[i].conn = conn;
@@ -444,7 +759,17 @@ int main(int argc, char *argv[])
     client_args[i].interactive_mode = interactive_mode;
     client_args[i].scriptfile = scriptfile;
     client_args[i].delay_ms = delay_ms;
+    client_args[i].pipeline = pipeline;
+    client_args[i].commands = 0;
     client_args[i].client_num = i;
+    client_args[i].bench_ops = bench_ops;
+    client_args[i].bench_done = 0;
+    client_args[i].bench_size = bench_size;
+    client_args[i].binary = binary;
+    client_args[i].bench_seconds = 0;
+    client_args[i].connect_ops = connect_ops;
+    client_args[i].connects_done = 0;
+    client_args[i].connect_latency = connect_ops > 0 ? malloc(connect_ops * sizeof(double)) : NULL;
 
     if (pthread_create(&threads[i], NULL, client_thread, &client_args[i]) != 0)
     {
@@ -454,9 +779,47 @@ int main(int argc, char *argv[])
   }
 
   // Wait for clients to finish
+  double slowest = 0;
+  long commands = 0;
+  long bench_done = 0;
   for (int i = 0; i < num_clients; i++)
   {
     pthread_join(threads[i], NULL);
+    if (client_args[i].bench_seconds > slowest)
+      slowest = client_args[i].bench_seconds;
+    commands += client_args[i].commands;
+    bench_done += client_args[i].bench_done;
+  }
+  // Only on request, testrunner.sh keeps stderr in the client logs
+  if (syscall_stats && scriptfile != NULL && commands > 0)
+  {
+    fprintf(stderr, "Script: %ld commands, %ld writes, %ld reads, %.2f socket syscalls per command\n", commands,
+           socket_writes, socket_reads, (double)(socket_writes + socket_reads) / commands);
+  }
+  if (bench_ops > 0 && slowest > 0)
+  {
+    printf("Total: %d clients, %ld ops in %.3f s, %.0f ops/s\n", num_clients, bench_done,
+           slowest, bench_done / slowest);
+  }
+  if (connect_ops > 0 && slowest > 0)
+  {
+    // Percentiles over the connections of every client
+    double *latency = malloc((size_t)num_clients * connect_ops * sizeof(double));
+    int connects = 0;
+    for (int i = 0; i < num_clients; i++)
+    {
+      memcpy(latency + connects, client_args[i].connect_latency, client_args[i].connects_done * sizeof(double));
+      connects += client_args[i].connects_done;
+      free(client_args[i].connect_latency);
+    }
+    if (connects > 0)
+    {
+      qsort(latency, connects, sizeof(double), compare_double);
+      printf("Total: %d clients, %d connects in %.3f s, %.0f connects/s, p50 %.3f ms, p99 %.3f ms\n",
+             num_clients, connects, slowest, connects / slowest, latency[connects / 2] * 1e3,
+             latency[(int)(connects * 0.99)] * 1e3);
+    }
+    free(latency);
   }
 
   free(threads);
@@ -0,0 +1,282 @@
+#include "wal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// How long a writer waits for another one's fdatasync before it syncs itself,
+// the other one may have died in the middle of it
+#define WAL_WAIT_MS 50
+
+#define WAL_READ_RECORDS 256
+
+// Shared by every process that appends, byte counts only ever grow
+typedef struct
+{
+  unsigned long long appended; // bytes whose write has returned
+  unsigned long long synced;   // bytes an fdatasync has finished for
+  int syncing;                 // futex word, 1 while a writer is in fdatasync
+  int failed;                  // set for good once a record was not written or synced
+} wal_state_t;
+
+static int wal_fd = -1;
+static wal_state_t *wal_state = NULL;
+
+// What appended was right after this thread's last record. A record that
+// could not be written leaves it at WAL_LOST, which no sync ever covers.
+static __thread unsigned long long appended_mark = 0;
+#define WAL_LOST ULLONG_MAX
+
+// FNV-1a over everything but the check itself
+static uint32_t record_check(const wal_record_t *record)
+{
+  const unsigned char *p = (const unsigned char *)record;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < offsetof(wal_record_t, check); i++)
+  {
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int record_intact(const wal_record_t *record)
+{
+  return record->type >= WAL_ADD_DEMAND && record->type <= WAL_MATCH && record->id >= 0 &&
+         record->check == record_check(record);
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+  const char *p = data;
+  while (len > 0)
+  {
+    ssize_t written = write(fd, p, len);
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return -1;
+    p += written;
+    len -= written;
+  }
+  return 0;
+}
+
+int wal_replay(const char *path, wal_apply_fn apply, void *ctx)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return errno == ENOENT ? 0 : -1;
+
+  wal_record_t records[WAL_READ_RECORDS];
+  size_t have = 0; // bytes in records, a partial record stays at the front
+  int count = 0;
+  for (;;)
+  {
+    ssize_t got = read(fd, (char *)records + have, sizeof(records) - have);
+    if (got == -1 && errno == EINTR)
+      continue;
+    if (got == -1)
+    {
+      close(fd);
+      return -1;
+    }
+    have += got;
+    size_t whole = have / sizeof(wal_record_t);
+    for (size_t i = 0; i < whole; i++)
+    {
+      if (!record_intact(&records[i]))
+      {
+        close(fd);
+        return count;
+      }
+      if (apply(&records[i], ctx) == -1)
+      {
+        close(fd);
+        return -1;
+      }
+      count++;
+    }
+    if (got == 0)
+      break;
+    have -= whole * sizeof(wal_record_t);
+    memmove(records, &records[whole], have);
+  }
+  close(fd);
+  return count;
+}
+
+// The rename is only durable once the directory is synced too
+static void sync_directory(const char *path)
+{
+  char dir[PATH_MAX];
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL)
+    strcpy(dir, ".");
+  else if (slash == path)
+    strcpy(dir, "/");
+  else
+    snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  if (fd == -1)
+    return;
+  fsync(fd);
+  close(fd);
+}
+
+int wal_start(const char *path, const wal_record_t *records, int count)
+{
+  char tmp_path[PATH_MAX];
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path))
+    return -1;
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    return -1;
+
+  // Written in chunks of the replay buffer, each with its check filled in
+  wal_record_t chunk[WAL_READ_RECORDS];
+  for (int i = 0; i < count; i += WAL_READ_RECORDS)
+  {
+    int n = count - i < WAL_READ_RECORDS ? count - i : WAL_READ_RECORDS;
+    for (int j = 0; j < n; j++)
+    {
+      chunk[j] = records[i + j];
+      chunk[j].check = record_check(&chunk[j]);
+    }
+    if (write_all(fd, chunk, n * sizeof(wal_record_t)) == -1)
+    {
+      close(fd);
+      unlink(tmp_path);
+      return -1;
+    }
+  }
+  if (fsync(fd) == -1 || close(fd) == -1 || rename(tmp_path, path) == -1)
+  {
+    unlink(tmp_path);
+    return -1;
+  }
+  sync_directory(path);
+
+  wal_state = mmap(NULL, sizeof(wal_state_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (wal_state == MAP_FAILED)
+  {
+    wal_state = NULL;
+    return -1;
+  }
+  memset(wal_state, 0, sizeof(wal_state_t));
+  wal_fd = open(path, O_WRONLY | O_APPEND);
+  return wal_fd == -1 ? -1 : 0;
+}
+
+// Only the first failure is reported, every writer sees the flag after it
+static void fail_log(const char *what)
+{
+  if (__atomic_exchange_n(&wal_state->failed, 1, __ATOMIC_ACQ_REL) == 0)
+    perror(what);
+}
+
+int wal_failed()
+{
+  return wal_fd != -1 && __atomic_load_n(&wal_state->failed, __ATOMIC_ACQUIRE);
+}
+
+int wal_append(const wal_record_t *record)
+{
+  if (wal_fd == -1)
+    return 0;
+  // After a torn record the replay stops, a record behind it would be lost
+  if (wal_failed())
+  {
+    appended_mark = WAL_LOST;
+    return -1;
+  }
+  wal_record_t copy = *record;
+  copy.check = record_check(&copy);
+  // O_APPEND puts each record in one piece at the end, whichever process writes it
+  if (write_all(wal_fd, &copy, sizeof(copy)) == -1)
+  {
+    fail_log("Debug: write-ahead log append");
+    appended_mark = WAL_LOST;
+    return -1;
+  }
+  appended_mark = __atomic_add_fetch(&wal_state->appended, sizeof(copy), __ATOMIC_ACQ_REL);
+  return 0;
+}
+
+void wal_catch_up()
+{
+  if (wal_fd == -1)
+    return;
+  unsigned long long appended = __atomic_load_n(&wal_state->appended, __ATOMIC_ACQUIRE);
+  if (appended > appended_mark)
+    appended_mark = appended;
+}
+
+static int futex_wait_ms(int *word, int value, int ms)
+{
+  struct timespec timeout = {ms / 1000, (ms % 1000) * 1000000L};
+  return syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+static void futex_wake_all(int *word)
+{
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void mark_synced(unsigned long long end)
+{
+  unsigned long long synced = __atomic_load_n(&wal_state->synced, __ATOMIC_ACQUIRE);
+  while (synced < end &&
+         !__atomic_compare_exchange_n(&wal_state->synced, &synced, end, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  {
+  }
+}
+
+// Bytes a failed fdatasync was for are never counted as synced, the kernel
+// may have dropped them already
+static void sync_log()
+{
+  unsigned long long end = __atomic_load_n(&wal_state->appended, __ATOMIC_ACQUIRE);
+  if (fdatasync(wal_fd) == -1)
+    fail_log("Debug: write-ahead log sync");
+  else
+    mark_synced(end);
+}
+
+// The first writer to get here syncs for everyone whose record is in the file
+// by then, the others wait for it and usually find their records covered
+int wal_sync()
+{
+  if (wal_fd == -1)
+    return 0;
+  unsigned long long mark = appended_mark;
+  while (__atomic_load_n(&wal_state->synced, __ATOMIC_ACQUIRE) < mark)
+  {
+    if (wal_failed())
+    {
+      // Only the output waiting now fails, later output of this thread
+      // reports no change since the log stopped taking them
+      appended_mark = 0;
+      return -1;
+    }
+    int idle = 0;
+    if (__atomic_compare_exchange_n(&wal_state->syncing, &idle, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+      sync_log();
+      __atomic_store_n(&wal_state->syncing, 0, __ATOMIC_RELEASE);
+      futex_wake_all(&wal_state->syncing);
+    }
+    else if (futex_wait_ms(&wal_state->syncing, 1, WAL_WAIT_MS) == -1 && errno == ETIMEDOUT)
+    {
+      sync_log();
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdint.h>
+
+// Write-ahead log of the demand and supply tables. Every change is appended
+// as one fixed size record while the stripe of the record is still held, so
+// the order in the file is the order the slots were taken and given back.
+// Replies wait in wal_sync until the records behind them are on disk, one
+// fdatasync covers every record appended before it started. Once a record
+// could not be written or synced the log takes no more, a torn record ends
+// the replay and nothing behind it would come back.
+
+typedef enum
+{
+  WAL_ADD_DEMAND = 1,
+  WAL_ADD_SUPPLY,
+  WAL_REMOVE_DEMAND,
+  WAL_REMOVE_SUPPLY,
+  WAL_MATCH // last type, id is the supply, x the demand it fulfilled, nA..nC what is left of the supply
+} wal_type_t;
+
+typedef struct
+{
+  uint32_t type;
+  int32_t id; // demand or supply slot
+  int32_t agent_id;
+  int32_t x;
+  int32_t y;
+  int32_t distance;
+  int32_t nA;
+  int32_t nB;
+  int32_t nC;
+  uint32_t check; // over the fields above, a torn write at the end fails it
+} wal_record_t;
+
+// Returns -1 when the record could not be taken in
+typedef int (*wal_apply_fn)(const wal_record_t *record, void *ctx);
+
+// Hands every intact record of the log at path to apply, in order, and stops
+// at the first torn or damaged one. Returns the number of records, 0 when
+// there is no log yet and -1 if it cannot be read or apply failed.
+int wal_replay(const char *path, wal_apply_fn apply, void *ctx);
+
+// Replaces the log at path by the count records, durably, and appends every
+// later record to it. Call before forking, the agents share the log.
+int wal_start(const char *path, const wal_record_t *records, int count);
+
+// Nothing to do while no log was started. Returns -1 when the record did not
+// make it into the log.
+int wal_append(const wal_record_t *record);
+
+// Set for good once the log failed, changes should be refused from then on
+int wal_failed();
+
+// Returns once every record this thread appended is on disk, or -1 when one
+// of them never will be
+int wal_sync();
+
+// Makes the next wal_sync of this thread also wait for what every other one
+// appended so far, for output that reports changes other agents made
+void wal_catch_up();
+
+#endif // WAL_H